@@ -2,6 +2,11 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#ifdef GUEST_SIMD
+// mm_malloc.h uvlaci stdlib.h, a gost ima svoj exit()
+#define _MM_MALLOC_H_INCLUDED
+#include <immintrin.h>
+#endif
 
 #define O_RDONLY        0        /* open for reading only */
 #define O_WRONLY        1        /* open for writing only */
@@ -28,13 +33,42 @@
 #define CLOSE 2
 #define READ 3
 #define WRITE 4
+#define LSEEK 5
+#define COPY 6
+#define STREAM_READ 7
+#define STREAM_WRITE 8
+
+#define COPY_ALL ((uint64_t) -1)
+#define STREAM_PENDING (1UL << 63)
 #define FINISH 0
 #define EOF -1
 
-static inline void exit() {
-	for (;;)
-		asm("hlt");
-}
+#define BALLOON_PORT 0x27A
+#define BALLOON_INFLATE 1
+#define BALLOON_DEFLATE 2
+#define BALLOON_TARGET 3
+#define PAGE_SIZE 4096
+
+#define BENCH_PORT 0x27C
+#define EXIT_PORT 0x27E
+
+#define PIC_MASTER 0x20
+#define PIC_SLAVE 0xA0
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND 0x43
+#define PIT_HZ 1193182
+#define IRQ_BASE 32
+#define IRQ_TIMER 0
+#define IRQ_CONSOLE 4
+#define IRQ_FILE 5
+
+#define MMIO_BASE 0x3FE00000UL
+#define MMIO_CONSOLE_DATA (MMIO_BASE + 0x0)
+#define MMIO_CONSOLE_COUNT (MMIO_BASE + 0x8)
+
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
 
 static void outb(uint16_t port, uint8_t value) {
 	asm("outb %0,%1" : /* empty */ : "a" (value), "Nd" (port) : "memory");
@@ -54,19 +88,202 @@ static void outq(uint16_t port, uint64_t value) {
 
 static int in(uint16_t port) {
   int ret;
-  asm("in %1, %0" : "=a"(ret) : "Nd"(port));
+  asm volatile("in %1, %0" : "=a"(ret) : "Nd"(port));
   return ret;
 }
 
 static char inb(uint16_t port) {
   char ret;
-  asm("inb %1, %0" : "=a"(ret) : "Nd"(port));
+  asm volatile("inb %1, %0" : "=a"(ret) : "Nd"(port));
   return ret;
 }
 
+static void fflush_all();
+
+// Javlja hipervizoru da je gost zavrsio. Sa --irqchip HLT ne izlazi
+// iz KVM_RUN (gost samo ceka prekid), pa je potreban poseban port
+static inline __attribute__((noreturn)) void exit() {
+  fflush_all();
+  outb(EXIT_PORT, 0);
+	for (;;)
+		asm("hlt");
+}
+
+// Prekidi (zahtevaju --irqchip)
+//
+// interrupts_init postavlja GDT, IDT i 8259 PIC tako da IRQ 0-15
+// dolaze na vektore 32-47. Tajmer je PIT kanal 0 u jednokratnom modu,
+// pa gost koji spava u HLT-u ne dobija prekide koje nije trazio.
+// Hipervizor salje IRQ_CONSOLE kada na konzoli ima ulaza i IRQ_FILE
+// kada se zavrsi fajl operacija.
+
+static volatile uint64_t ticks;
+static volatile uint64_t events;
+static volatile uint64_t console_events;
+static volatile uint64_t file_events;
+
+static uint64_t gdt[3] = {
+  0,
+  0x00AF9A000000FFFFUL,   // 64-bitni kod, selektor 0x08
+  0x00CF92000000FFFFUL,   // podaci, selektor 0x10
+};
+
+struct idt_entry {
+  uint16_t offset_low;
+  uint16_t selector;
+  uint8_t ist;
+  uint8_t type;
+  uint16_t offset_middle;
+  uint32_t offset_high;
+  uint32_t reserved;
+};
+
+static struct idt_entry idt[48] __attribute__((aligned(16)));
+
+struct __attribute__((packed)) descriptor_pointer {
+  uint16_t limit;
+  uint64_t base;
+};
+
+void irq_dispatch(uint64_t vector) {
+  if (vector >= IRQ_BASE) {
+    int irq = vector - IRQ_BASE;
+
+    if (irq == IRQ_TIMER) ticks++;
+    if (irq == IRQ_CONSOLE) console_events++;
+    if (irq == IRQ_FILE) file_events++;
+
+    if (irq >= 8) outb(PIC_SLAVE, 0x20);
+    outb(PIC_MASTER, 0x20);
+  }
+  events++;
+}
+
+// Ulazne tacke prekida: cuvaju registre koje C kod sme da menja,
+// pozivaju irq_dispatch(vektor) i vracaju se sa iretq. U SIMD programima
+// C kod sme da koristi i XMM registre, pa se cuvaju sa FXSAVE. Prekidi
+// se ne gnezde (interrupt gate brise IF), pa je dovoljna jedna oblast
+#ifdef GUEST_SIMD
+static uint8_t irq_fpu_state[512] __attribute__((aligned(16), used));
+#define IRQ_FPU_SAVE "  fxsave irq_fpu_state(%rip)\n"
+#define IRQ_FPU_RESTORE "  fxrstor irq_fpu_state(%rip)\n"
+#else
+#define IRQ_FPU_SAVE ""
+#define IRQ_FPU_RESTORE ""
+#endif
+
+asm(".text\n"
+    ".macro IRQ_STUB n\n"
+    "irq_stub_\\n:\n"
+    "  push %rax; push %rcx; push %rdx; push %rsi; push %rdi\n"
+    "  push %r8; push %r9; push %r10; push %r11\n"
+    IRQ_FPU_SAVE
+    "  mov $\\n, %edi\n"
+    "  call irq_dispatch\n"
+    IRQ_FPU_RESTORE
+    "  pop %r11; pop %r10; pop %r9; pop %r8\n"
+    "  pop %rdi; pop %rsi; pop %rdx; pop %rcx; pop %rax\n"
+    "  iretq\n"
+    ".endm\n"
+    ".altmacro\n"
+    ".set i, 0\n"
+    ".rept 48\n"
+    "  IRQ_STUB %i\n"
+    "  .set i, i + 1\n"
+    ".endr\n"
+    ".macro STUB_ADDRESS n\n"
+    "  .quad irq_stub_\\n\n"
+    ".endm\n"
+    ".section .rodata\n"
+    ".align 8\n"
+    "irq_stubs:\n"
+    ".set i, 0\n"
+    ".rept 48\n"
+    "  STUB_ADDRESS %i\n"
+    "  .set i, i + 1\n"
+    ".endr\n"
+    ".text\n");
+
+extern uint64_t irq_stubs[48];
+
+static void interrupts_init() {
+  struct descriptor_pointer gdtr = {sizeof(gdt) - 1, (uint64_t) gdt};
+  struct descriptor_pointer idtr = {sizeof(idt) - 1, (uint64_t) idt};
+
+  asm volatile("lgdt %0\n"
+               "pushq $0x08\n"
+               "leaq 1f(%%rip), %%rax\n"
+               "pushq %%rax\n"
+               "lretq\n"
+               "1:\n"
+               "movw $0x10, %%ax\n"
+               "movw %%ax, %%ds\n"
+               "movw %%ax, %%es\n"
+               "movw %%ax, %%ss\n"
+               : : "m"(gdtr) : "rax", "memory");
+
+  for (int i = 0; i < 48; i++) {
+    idt[i].offset_low = irq_stubs[i] & 0xFFFF;
+    idt[i].selector = 0x08;
+    idt[i].ist = 0;
+    idt[i].type = 0x8E;   // prisutan, DPL 0, 64-bitni interrupt gate
+    idt[i].offset_middle = (irq_stubs[i] >> 16) & 0xFFFF;
+    idt[i].offset_high = irq_stubs[i] >> 32;
+    idt[i].reserved = 0;
+  }
+  asm volatile("lidt %0" : : "m"(idtr) : "memory");
+
+  // ICW1-ICW4: IRQ 0-7 na vektore 32-39, IRQ 8-15 na 40-47
+  outb(PIC_MASTER, 0x11);
+  outb(PIC_SLAVE, 0x11);
+  outb(PIC_MASTER + 1, IRQ_BASE);
+  outb(PIC_SLAVE + 1, IRQ_BASE + 8);
+  outb(PIC_MASTER + 1, 4);
+  outb(PIC_SLAVE + 1, 2);
+  outb(PIC_MASTER + 1, 1);
+  outb(PIC_SLAVE + 1, 1);
+  outb(PIC_MASTER + 1, ~((1 << IRQ_TIMER) | (1 << IRQ_CONSOLE) | (1 << IRQ_FILE) | (1 << 2)));
+  outb(PIC_SLAVE + 1, 0xFF);
+
+  asm volatile("sti");
+}
+
+// Ceka sledeci prekid u HLT-u. Provera i HLT su zasticeni sa cli,
+// a "sti; hlt" ne moze da propusti prekid izmedju dve instrukcije
+static void wait_for_event() {
+  uint64_t seen = events;
+
+  asm volatile("cli" : : : "memory");
+  if (events == seen) {
+    asm volatile("sti; hlt" : : : "memory");
+  } else {
+    asm volatile("sti" : : : "memory");
+  }
+}
+
+static void sleep_ms(uint32_t ms) {
+  while (ms > 0) {
+    uint32_t chunk = ms > 50 ? 50 : ms;
+    uint32_t count = PIT_HZ / 1000 * chunk;
+    uint64_t target = ticks + 1;
+
+    outb(PIT_COMMAND, 0x30);   // kanal 0, lo/hi bajt, mod 0
+    outb(PIT_CHANNEL0, count & 0xFF);
+    outb(PIT_CHANNEL0, count >> 8);
+
+    while (ticks < target) {
+      wait_for_event();
+    }
+    ms -= chunk;
+  }
+}
+
 void
 printf(const char *fmt, ...);
 
+static void stdio_sync(int fd);
+static void stdio_release(int fd);
+
 static int open(const char* file_name, int flags, int mode) {
   out(PARALEL_PORT, OPEN);
   int i;
@@ -84,7 +301,8 @@ static int open(const char* file_name, int flags, int mode) {
 }
 
 static int close(int fd) {
-  
+  stdio_release(fd);
+
   out(PARALEL_PORT, CLOSE);
   out(PARALEL_PORT, fd);
 
@@ -93,6 +311,7 @@ static int close(int fd) {
 }
 
 size_t read(int fd, void* buf, size_t count) {
+  stdio_sync(fd);
   out(PARALEL_PORT, READ);
   out(PARALEL_PORT, fd); 
   outq(PARALEL_PORT, (uint64_t) buf);
@@ -110,7 +329,626 @@ size_t write(int fd, void* buf, size_t count) {
   return in(PARALEL_PORT);
 }
 
+// Vraca hipervizoru stranice iz opsega [addr, addr + size),
+// rezultat je broj oslobodjenih stranica
+static uint32_t balloon_inflate(void* addr, size_t size) {
+  out(BALLOON_PORT, BALLOON_INFLATE);
+  outq(BALLOON_PORT, (uint64_t) addr);
+  outq(BALLOON_PORT, (uint64_t) size);
+
+  return in(BALLOON_PORT);
+}
+
+// Javlja hipervizoru da se opseg ponovo koristi
+static uint32_t balloon_deflate(void* addr, size_t size) {
+  out(BALLOON_PORT, BALLOON_DEFLATE);
+  outq(BALLOON_PORT, (uint64_t) addr);
+  outq(BALLOON_PORT, (uint64_t) size);
+
+  return in(BALLOON_PORT);
+}
+
+// Broj stranica koje hipervizor trazi da budu u balonu
+static uint32_t balloon_target() {
+  out(BALLOON_PORT, BALLOON_TARGET);
+  return in(BALLOON_PORT);
+}
+
+// Pomera poziciju u fajlu, vraca novu poziciju ili -1
+static int lseek(int fd, int64_t offset, int whence) {
+  stdio_sync(fd);
+  out(PARALEL_PORT, LSEEK);
+  out(PARALEL_PORT, fd);
+  outq(PARALEL_PORT, (uint64_t) offset);
+  out(PARALEL_PORT, whence);
+
+  return in(PARALEL_PORT);
+}
+
+// Kopira count bajtova (COPY_ALL za ceo ostatak fajla) iz fd_in u
+// fd_out na strani hipervizora, bez prolaska kroz memoriju gosta.
+// Vraca broj kopiranih bajtova ili -1
+static int64_t copy_file(int fd_in, int fd_out, uint64_t count) {
+  stdio_sync(fd_in);
+  stdio_sync(fd_out);
+  out(PARALEL_PORT, COPY);
+  out(PARALEL_PORT, fd_in);
+  out(PARALEL_PORT, fd_out);
+  outq(PARALEL_PORT, count);
+
+  uint32_t low = in(PARALEL_PORT);
+  uint32_t high = in(PARALEL_PORT);
+  return (int64_t) (((uint64_t) high << 32) | low);
+}
+
+// Veliki prenosi. Hipervizor prenosi u pozadini, deo po deo, a gost
+// pita za stanje: rezultat je broj prenetih bajtova (64 bita) sa
+// STREAM_PENDING dok prenos traje, ili -1. Svako pitanje ceka najvise
+// nekoliko ms, pa gost moze da obradjuje deo koji je vec stigao
+static void stream_begin(int op, int fd, void* buf, uint64_t count) {
+  stdio_sync(fd);
+  out(PARALEL_PORT, op);
+  out(PARALEL_PORT, fd);
+  outq(PARALEL_PORT, (uint64_t) buf);
+  outq(PARALEL_PORT, count);
+}
+
+static uint64_t stream_poll() {
+  uint32_t low = in(PARALEL_PORT);
+  uint32_t high = in(PARALEL_PORT);
+  return ((uint64_t) high << 32) | low;
+}
+
+typedef void (*stream_fn)(void* ctx, char* data, uint64_t size);
+
+// Prenosi count bajtova i za svaki preneti deo poziva fn (ako nije 0).
+// Ako prenos stane pre kraja (greska posle dela podataka), nastavlja se
+// od mesta gde je stao dok ima napretka
+static int64_t stream(int op, int fd, void* buf, uint64_t count, stream_fn fn, void* ctx) {
+  char* data = buf;
+  uint64_t total = 0;
+
+  while (total < count) {
+    uint64_t seen = 0;
+    uint64_t status;
+
+    stream_begin(op, fd, data + total, count - total);
+    do {
+      status = stream_poll();
+      if (status == (uint64_t) -1) {
+        return total ? (int64_t) total : -1;
+      }
+
+      uint64_t done = status & ~STREAM_PENDING;
+      if (fn && done > seen) fn(ctx, data + total + seen, done - seen);
+      seen = done;
+    } while (status & STREAM_PENDING);
+
+    if (seen == 0) break;
+    total += seen;
+  }
+
+  return total;
+}
+
+static int64_t stream_read(int fd, void* buf, uint64_t count, stream_fn fn, void* ctx) {
+  return stream(STREAM_READ, fd, buf, count, fn, ctx);
+}
+
+static int64_t stream_write(int fd, void* buf, uint64_t count, stream_fn fn, void* ctx) {
+  return stream(STREAM_WRITE, fd, buf, count, fn, ctx);
+}
+
+// stream_fn koji sabira prvu rec svake stranice pristiglog dela
+static void stream_sum(void* ctx, char* data, uint64_t size) {
+  uint64_t* sum = ctx;
+  for (uint64_t i = 0; i < size; i += PAGE_SIZE) {
+    *sum += *(uint64_t*) (data + i);
+  }
+}
+
+static inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t) hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+  asm volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+// Brojaci performansi (zahteva --pmu)
+//
+// Arhitekturni PMU iz CPUID 0xA. Fiksni brojac 0 broji izvrsene
+// instrukcije, a 1 cikluse jezgra. Opsti brojaci broje dogadjaj koji
+// im se zada sa pmu_program. Gost radi u prstenu 0, pa RDPMC radi bez
+// CR4.PCE. Bez PMU-a pmu_init vraca 0, pmu_program -1, a citanja 0.
+
+#define MSR_PMC0 0xC1
+#define MSR_PERFEVTSEL0 0x186
+#define MSR_FIXED_CTR_CTRL 0x38D
+#define MSR_PERF_GLOBAL_CTRL 0x38F
+
+#define PERFEVTSEL_USR (1 << 16)
+#define PERFEVTSEL_OS (1 << 17)
+#define PERFEVTSEL_EN (1 << 22)
+
+// Arhitekturni dogadjaji, redom kao bitovi u CPUID 0xA EBX
+#define PMU_CYCLES 0
+#define PMU_INSTRUCTIONS 1
+#define PMU_REF_CYCLES 2
+#define PMU_LLC_REFERENCES 3
+#define PMU_LLC_MISSES 4
+#define PMU_BRANCHES 5
+#define PMU_BRANCH_MISSES 6
+
+// umask << 8 | event
+static const uint16_t pmu_events[] = {0x003C, 0x00C0, 0x013C, 0x4F2E, 0x412E, 0x00C4, 0x00C5};
+
+static struct {
+  int version;
+  int counters;
+  int fixed;
+  uint32_t missing;   // bit i: dogadjaj i ne postoji
+  uint64_t enabled;   // IA32_PERF_GLOBAL_CTRL
+} pmu;
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+}
+
+static inline uint64_t rdpmc(uint32_t counter) {
+  uint32_t lo, hi;
+  asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+  return ((uint64_t) hi << 32) | lo;
+}
+
+// Vraca broj opstih brojaca i pokrece fiksne
+static int pmu_init() {
+  uint32_t a, b, c, d, known;
+
+  pmu.version = pmu.counters = pmu.fixed = 0;
+  cpuid(0, &a, &b, &c, &d);
+  if (a < 0xA) return 0;
+
+  cpuid(0xA, &a, &b, &c, &d);
+  pmu.version = a & 0xFF;
+  if (pmu.version == 0) return 0;
+
+  pmu.counters = (a >> 8) & 0xFF;
+  known = (a >> 24) >= 32 ? ~0U : (1U << (a >> 24)) - 1;
+  pmu.missing = b | ~known;
+  pmu.enabled = 0;
+
+  if (pmu.version > 1) {
+    pmu.fixed = (d & 0x1F) < 2 ? d & 0x1F : 2;
+    wrmsr(MSR_FIXED_CTR_CTRL, pmu.fixed == 2 ? 0x33 : pmu.fixed ? 0x3 : 0);
+    pmu.enabled = ((1UL << pmu.fixed) - 1) << 32;
+    wrmsr(MSR_PERF_GLOBAL_CTRL, pmu.enabled);
+  }
+
+  return pmu.counters;
+}
+
+// Nulira opsti brojac i pokrece ga za arhitekturni dogadjaj. Vraca -1
+// ako nema tog brojaca ili dogadjaja
+static int pmu_program(int counter, int event) {
+  if (counter >= pmu.counters || (pmu.missing & (1U << event))) {
+    return -1;
+  }
+
+  wrmsr(MSR_PERFEVTSEL0 + counter, 0);
+  wrmsr(MSR_PMC0 + counter, 0);
+  wrmsr(MSR_PERFEVTSEL0 + counter, pmu_events[event] | PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+  if (pmu.version > 1) {
+    pmu.enabled |= 1UL << counter;
+    wrmsr(MSR_PERF_GLOBAL_CTRL, pmu.enabled);
+  }
+  return 0;
+}
+
+static uint64_t pmu_read(int counter) {
+  return counter < pmu.counters ? rdpmc(counter) : 0;
+}
+
+// 0 instrukcije, 1 ciklusi jezgra
+static uint64_t pmu_read_fixed(int counter) {
+  return counter < pmu.fixed ? rdpmc((1U << 30) | counter) : 0;
+}
+
+// Rezultat merenja, hipervizor ga cita preko BENCH_PORT-a. Poravnanje
+// je vece od strukture, pa nikad ne prelazi granicu stranice. Posle
+// pmu_init merenje pamti i brojace: opsti brojac 0 broji LLC
+// promasaje, a 1 promasene grane
+struct bench_result {
+  char name[24];
+  uint64_t phase;
+  uint64_t size;
+  uint64_t ops;
+  uint64_t cycles;
+  uint64_t instructions;
+  uint64_t core_cycles;
+  uint64_t llc_misses;
+  uint64_t branch_misses;
+} __attribute__((aligned(128)));
+
+static struct bench_result bench;
+
+static void bench_begin(const char* name, uint64_t size) {
+  int i;
+  for (i = 0; name[i] && i < sizeof(bench.name) - 1; i++) {
+    bench.name[i] = name[i];
+  }
+  bench.name[i] = 0;
+  bench.phase = 0;
+  bench.size = size;
+  bench.ops = 0;
+  outq(BENCH_PORT, (uint64_t) &bench);
+  pmu_program(0, PMU_LLC_MISSES);
+  pmu_program(1, PMU_BRANCH_MISSES);
+  bench.instructions = pmu_read_fixed(0);
+  bench.core_cycles = pmu_read_fixed(1);
+  bench.llc_misses = pmu_read(0);
+  bench.branch_misses = pmu_read(1);
+  bench.cycles = rdtsc();
+}
+
+static void bench_end(uint64_t ops) {
+  bench.cycles = rdtsc() - bench.cycles;
+  bench.instructions = pmu_read_fixed(0) - bench.instructions;
+  bench.core_cycles = pmu_read_fixed(1) - bench.core_cycles;
+  bench.llc_misses = pmu_read(0) - bench.llc_misses;
+  bench.branch_misses = pmu_read(1) - bench.branch_misses;
+  bench.ops = ops;
+  bench.phase = 1;
+  outq(BENCH_PORT, (uint64_t) &bench);
+}
+
+// SIMD (zahteva --simd)
+//
+// Obicni gosti se prevode sa -mgeneral-regs-only i nikada ne koriste
+// vektorske registre. Programi iz SIMD_NUMBERS (makefile) se prevode
+// bez toga, sa -O2 i GUEST_SIMD: kompajler sme da koristi SSE2 bilo gde,
+// pa se moraju pokretati sa --simd, a ulazne tacke prekida cuvaju XMM
+// registre sa FXSAVE. AVX koriste samo funkcije sa target("avx"), koje
+// se pozivaju posto simd_init proveri CR4 i XCR0; kod prekida se ne
+// prevodi za AVX, pa gornje polovine YMM registara ne dira.
+
+#define SIMD_NONE 0
+#define SIMD_SSE2 1
+#define SIMD_AVX 2
+
+static int simd_level = SIMD_NONE;
+
+static const char* simd_names[] = {"none", "sse2", "avx"};
+
+static int simd_init() {
+  simd_level = SIMD_NONE;
+#ifdef GUEST_SIMD
+  uint32_t a, b, c, d;
+  uint64_t cr4;
+
+  cpuid(1, &a, &b, &c, &d);
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+  if ((d & (1 << 26)) && (cr4 & (1 << 9))) {
+    simd_level = SIMD_SSE2;
+  }
+  if (simd_level && (c & (1 << 28)) && (c & (1 << 27))) {
+    uint32_t xcr0_low, xcr0_high;
+    asm volatile("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    if ((xcr0_low & 6) == 6) {
+      simd_level = SIMD_AVX;
+    }
+  }
+#endif
+
+  return simd_level;
+}
+
+#ifdef GUEST_SIMD
+__attribute__((target("avx")))
+static size_t copy_avx(char* d, const char* s, size_t n) {
+  size_t done;
+  for (done = 0; done + 32 <= n; done += 32) {
+    _mm256_storeu_si256((__m256i*) (d + done), _mm256_loadu_si256((const __m256i*) (s + done)));
+  }
+  _mm256_zeroupper();
+  return done;
+}
+
+static size_t copy_sse2(char* d, const char* s, size_t n) {
+  size_t done;
+  for (done = 0; done + 16 <= n; done += 16) {
+    _mm_storeu_si128((__m128i*) (d + done), _mm_loadu_si128((const __m128i*) (s + done)));
+  }
+  return done;
+}
+
+// Uzorak se ucitava iz memorije, a ne pravi iz opsteg registra (movd,
+// pshufd), jer emulator instrukcija u KVM-u zna samo za premestanja
+__attribute__((target("avx")))
+static size_t fill_avx(char* d, const void* bytes, size_t n) {
+  __m256i pattern = _mm256_loadu_si256((const __m256i*) bytes);
+  size_t done;
+  for (done = 0; done + 32 <= n; done += 32) {
+    _mm256_storeu_si256((__m256i*) (d + done), pattern);
+  }
+  _mm256_zeroupper();
+  return done;
+}
+
+static size_t fill_sse2(char* d, const void* bytes, size_t n) {
+  __m128i pattern = _mm_loadu_si128((const __m128i*) bytes);
+  size_t done;
+  for (done = 0; done + 16 <= n; done += 16) {
+    _mm_storeu_si128((__m128i*) (d + done), pattern);
+  }
+  return done;
+}
+#endif
+
+void* memcpy(void* dst, const void* src, size_t n) {
+  char* d = dst;
+  const char* s = src;
+  size_t done = 0;
+
+#ifdef GUEST_SIMD
+  if (simd_level == SIMD_AVX) {
+    done = copy_avx(d, s, n);
+  } else if (simd_level == SIMD_SSE2) {
+    done = copy_sse2(d, s, n);
+  }
+#endif
+  for (; done < n; done++) {
+    d[done] = s[done];
+  }
+
+  return dst;
+}
+
+void* memset(void* dst, int value, size_t n) {
+  char* d = dst;
+  size_t done = 0;
+
+#ifdef GUEST_SIMD
+  volatile uint64_t pattern[4];
+
+  for (int i = 0; i < 4; i++) {
+    pattern[i] = 0x0101010101010101UL * (uint8_t) value;
+  }
+  if (simd_level == SIMD_AVX) {
+    done = fill_avx(d, (const void*) pattern, n);
+  } else if (simd_level == SIMD_SSE2) {
+    done = fill_sse2(d, (const void*) pattern, n);
+  }
+#endif
+  for (; done < n; done++) {
+    d[done] = (char) value;
+  }
+
+  return dst;
+}
+
+// Ispis preko MMIO konzole. Registar DATA je u coalesced zoni, pa
+// upisi ne izlaze iz gosta, hipervizor ih obradi pri sledecem izlasku.
+// Jedan upis nosi do 8 bajtova
+static void mmio_console_write(const char* s, size_t n) {
+  volatile uint64_t* data64 = (volatile uint64_t*) MMIO_CONSOLE_DATA;
+  volatile uint8_t* data8 = (volatile uint8_t*) MMIO_CONSOLE_DATA;
+
+  for (; n >= 8; n -= 8, s += 8) {
+    uint64_t chunk;
+    __builtin_memcpy(&chunk, s, 8);
+    *data64 = chunk;
+  }
+  for (; n > 0; n--) {
+    *data8 = *s++;
+  }
+}
+
+static uint64_t mmio_console_count() {
+  return *(volatile uint64_t*) MMIO_CONSOLE_COUNT;
+}
+
+// Blok uredjaj (zahteva --disk)
+//
+// Zahtevi se upisuju u prsten bez izlaska, a jedan OUT na DISK_NOTIFY
+// ih predaje sve odjednom. Hipervizor ih obradi pre nego sto se gost
+// nastavi, pa su posle disk_notify svi zavrseni. Sa --dedicated prsten
+// prati nit hipervizora, pa disk_notify prvo kratko ceka bez izlaska.
+
+#define DISK_PORT 0x280
+#define DISK_NOTIFY (DISK_PORT + 1)
+#define DISK_SECTOR 512
+#define DISK_RING_SIZE 64
+#define DISK_SPIN_CYCLES 50000
+
+#define DISK_READ 0
+#define DISK_WRITE 1
+#define DISK_FLUSH 2
+#define DISK_DISCARD 3
+
+#define DISK_OK 0
+
+struct disk_request {
+  uint8_t op;
+  uint8_t status;
+  uint16_t pad;
+  uint32_t sectors;
+  uint64_t sector;
+  uint64_t addr;
+};
+
+struct disk_ring {
+  uint32_t avail;
+  uint32_t used;
+  struct disk_request requests[DISK_RING_SIZE];
+} __attribute__((aligned(4096)));
+
+static struct disk_ring disk_ring;
+static uint32_t disk_checked;
+static int disk_errors;
+static int disk_polled;
+
+// Prijavljuje prsten i vraca velicinu diska u sektorima
+static uint32_t disk_init() {
+  out(DISK_PORT, (uint32_t) (uint64_t) &disk_ring);
+  disk_checked = 0;
+  disk_polled = in(DISK_NOTIFY);
+  return in(DISK_PORT);
+}
+
+// Predaje sve zahteve iz prstena i vraca broj neuspelih od poslednjeg poziva
+static int disk_notify() {
+  volatile uint32_t* used = &disk_ring.used;
+  int errors = disk_errors;
+  uint64_t start = disk_polled ? rdtsc() : 0;
+
+  while (disk_polled && *used != disk_ring.avail && rdtsc() - start < DISK_SPIN_CYCLES) {
+    asm volatile("pause");
+  }
+  if (*used != disk_ring.avail) {
+    out(DISK_NOTIFY, disk_ring.avail);
+  }
+  for (; disk_checked != *used; disk_checked++) {
+    if (disk_ring.requests[disk_checked % DISK_RING_SIZE].status != DISK_OK) errors++;
+  }
+
+  disk_errors = 0;
+  return errors;
+}
+
+// Dodaje zahtev u prsten, a pun prsten prvo predaje hipervizoru
+static void disk_submit(int op, uint64_t sector, void* buf, uint32_t sectors) {
+  if (disk_ring.avail - disk_ring.used == DISK_RING_SIZE) {
+    disk_errors = disk_notify();
+  }
+
+  struct disk_request* request = &disk_ring.requests[disk_ring.avail % DISK_RING_SIZE];
+  request->op = op;
+  request->sector = sector;
+  request->sectors = sectors;
+  request->addr = (uint64_t) buf;
+  __atomic_store_n(&disk_ring.avail, disk_ring.avail + 1, __ATOMIC_RELEASE);
+}
+
+// Baferisan ispis
+//
+// Svaki fd kome se pise kroz putc/printf/fprintf dobija bafer od
+// STDIO_BUFSIZ bajtova. Konzola (fd 1) je linijski baferisana, a
+// fajlovi potpuno. Konzola se prazni jednim upisom adrese opisa
+// bafera na CONSOLE_BULK_PORT, sto je jedan izlazak za ceo bafer
+// umesto jednog po znaku, a fajl jednim write-om.
+// read, lseek, copy_file i close prvo prazne bafer svog fd-a, getchar
+// prazni konzolu, a exit sve bafere.
+
+#define STDOUT 1
+
+#define _IONBF 0
+#define _IOLBF 1
+#define _IOFBF 2
+
+#define STDIO_BUFSIZ 4096
+#define STDIO_FILES 8
+
+#define CONSOLE_BULK_PORT 0xEA
+
+struct stdio_buffer {
+  int active;
+  int fd;
+  int mode;
+  size_t used;
+  char data[STDIO_BUFSIZ];
+};
+
+static struct stdio_buffer stdio_buffers[STDIO_FILES];
+
+// Opis bafera za CONSOLE_BULK_PORT, hipervizor ga cita iz memorije gosta
+struct console_bulk {
+  uint64_t addr;
+  uint64_t len;
+};
+
+static struct console_bulk console_bulk;
+
+static void console_write(const char* s, size_t n) {
+  if (n == 1) {
+    outb(0xE9, *s);
+    return;
+  }
+
+  console_bulk.addr = (uint64_t) s;
+  console_bulk.len = n;
+  out(CONSOLE_BULK_PORT, (uint32_t) (uint64_t) &console_bulk);
+}
+
+static struct stdio_buffer* stdio_find(int fd, int create) {
+  struct stdio_buffer* free = NULL;
+
+  for (int i = 0; i < STDIO_FILES; i++) {
+    if (stdio_buffers[i].active && stdio_buffers[i].fd == fd) {
+      return &stdio_buffers[i];
+    }
+    if (!stdio_buffers[i].active && free == NULL) {
+      free = &stdio_buffers[i];
+    }
+  }
+
+  if (create && free) {
+    free->active = 1;
+    free->fd = fd;
+    free->mode = fd == STDOUT ? _IOLBF : _IOFBF;
+    free->used = 0;
+  }
+  return create ? free : NULL;
+}
+
+static void stdio_flush(struct stdio_buffer* b) {
+  if (b->used == 0) return;
+
+  if (b->fd == STDOUT) {
+    console_write(b->data, b->used);
+  } else {
+    write(b->fd, b->data, b->used);
+  }
+  b->used = 0;
+}
+
+static void fflush(int fd) {
+  struct stdio_buffer* b = stdio_find(fd, 0);
+  if (b) stdio_flush(b);
+}
+
+static void fflush_all() {
+  for (int i = 0; i < STDIO_FILES; i++) {
+    if (stdio_buffers[i].active) stdio_flush(&stdio_buffers[i]);
+  }
+}
+
+// Menja nacin baferisanja za fd (_IONBF, _IOLBF ili _IOFBF)
+static void setvbuf(int fd, int mode) {
+  struct stdio_buffer* b = stdio_find(fd, 1);
+  if (b) {
+    stdio_flush(b);
+    b->mode = mode;
+  }
+}
+
+static void stdio_sync(int fd) {
+  fflush(fd);
+}
+
+static void stdio_release(int fd) {
+  struct stdio_buffer* b = stdio_find(fd, 0);
+  if (b) {
+    stdio_flush(b);
+    b->active = 0;
+  }
+}
+
 static char getchar() {
+    fflush(STDOUT);
     return inb(0xE9);
 }
 
@@ -119,10 +957,20 @@ static char digits[] = "0123456789ABCDEF";
 static void
 putc(int fd, char c)
 {
-    if (fd == 1) {
-        outb(0xE9, c);
-    } else {
-        write(fd, &c, 1);
+    struct stdio_buffer* b = stdio_find(fd, 1);
+
+    if (b == NULL || b->mode == _IONBF) {
+        if (fd == STDOUT) {
+            console_write(&c, 1);
+        } else {
+            write(fd, &c, 1);
+        }
+        return;
+    }
+
+    b->data[b->used++] = c;
+    if (b->used == STDIO_BUFSIZ || (b->mode == _IOLBF && c == '\n')) {
+        stdio_flush(b);
     }
 }
 
@@ -240,9 +1088,14 @@ int scan_int() {
 
 }
 
+// Hipervizor postavlja RSP poravnat na 16, a ne kao posle call-a, pa
+// SIMD program poravnava stek sam pre SSE pristupa steku
 void
 __attribute__((noreturn))
 __attribute__((section(".start")))
+#ifdef GUEST_SIMD
+__attribute__((force_align_arg_pointer))
+#endif
 _start(void) {
 	const char *p;
 	uint16_t port = 0xE9;
@@ -324,19 +1177,559 @@ _start(void) {
     printf("Greska pri otvaranju fajla %s\n", "primer.txt");
   }
 
-  char buf[20];
-  int size = 0;
-
-  do {
-    size = read(fd1, buf, 20);
-    write(fd2, buf, size);
-  } while (size == 20);
+  // Kopiranje jednim zahtevom, podaci ne prolaze kroz memoriju gosta
+  int64_t copied = copy_file(fd1, fd2, COPY_ALL);
+  printf("Kopirano %d bajtova\n", (int) copied);
 
   close(fd1);
   close(fd2);
 
-#endif
+#elif PROGRAM == 5
+
+  // Prvi megabajt zauzimaju kod i stek, ostatak prve 2MB stranice
+  // gost koristi kao privremeni bafer pa ga vraca hipervizoru
+  char* heap = (char*) 0x100000;
+  size_t heap_size = 0x80000;
+
+  for (size_t i = 0; i < heap_size; i += PAGE_SIZE) {
+    heap[i] = (char) i;
+  }
+  printf("Zauzeto %d KB\n", (int) (heap_size / 1024));
+
+  uint32_t released = balloon_inflate(heap, heap_size);
+  printf("Balon: vraceno %d stranica, cilj %d\n", released, balloon_target());
+
+  balloon_deflate(heap, PAGE_SIZE);
+  heap[0] = 1;
+  printf("Balon: ponovo koriscena %d stranica\n", 1);
+
+#elif PROGRAM == 6
+
+  // Merenja: prazan izlazak, konzola, open/close, sekvencijalni
+  // upis i citanje za vise velicina bafera i nasumicni mali I/O
+  char* buf = (char*) 0x100000;
+  const int total = 1024 * 1024;
+  const int sizes[] = {64, 512, 4096, 65536};
+  int fd, i, j;
+
+  pmu_init();
+  bench_begin("pio", 0);
+  for (i = 0; i < 100000; i++) {
+    inb(BENCH_PORT);
+  }
+  bench_end(100000);
+
+  bench_begin("console", 1);
+  for (i = 0; i < 20000; i++) {
+    putc(1, (i % 64 == 63) ? '\n' : 'a' + i % 26);
+  }
+  bench_end(20000);
+
+  fd = open("bench.txt", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  close(fd);
+  bench_begin("open_close", 0);
+  for (i = 0; i < 2000; i++) {
+    fd = open("bench.txt", O_RDONLY, 0);
+    close(fd);
+  }
+  bench_end(2000);
+
+  for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+    fd = open("bench.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bench_begin("seq_write", sizes[j]);
+    for (i = 0; i < total / sizes[j]; i++) {
+      write(fd, buf, sizes[j]);
+    }
+    bench_end(total / sizes[j]);
+    close(fd);
+
+    fd = open("bench.txt", O_RDONLY, 0);
+    bench_begin("seq_read", sizes[j]);
+    for (i = 0; i < total / sizes[j]; i++) {
+      read(fd, buf, sizes[j]);
+    }
+    bench_end(total / sizes[j]);
+    close(fd);
+  }
+
+  uint32_t seed = 12345;
+  fd = open("bench.txt", O_RDWR, 0);
+  bench_begin("rand_read", 512);
+  for (i = 0; i < 2000; i++) {
+    seed = seed * 1103515245 + 12345;
+    lseek(fd, (int64_t) ((seed >> 8) % (total / 512)) * 512, SEEK_SET);
+    read(fd, buf, 512);
+  }
+  bench_end(2000);
+
+  bench_begin("rand_write", 512);
+  for (i = 0; i < 2000; i++) {
+    seed = seed * 1103515245 + 12345;
+    lseek(fd, (int64_t) ((seed >> 8) % (total / 512)) * 512, SEEK_SET);
+    write(fd, buf, 512);
+  }
+  bench_end(2000);
+  close(fd);
+
+#elif PROGRAM == 7
+
+  // Kratko opterecenje za merenje skaliranja (scale_bench): prazni
+  // izlasci i sekvencijalni upis i citanje 256KB u blokovima od 4KB
+  char* buf = (char*) 0x100000;
+  int fd, i;
+
+  for (i = 0; i < 20000; i++) {
+    inb(BENCH_PORT);
+  }
+
+  fd = open("scale.txt", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  for (i = 0; i < 64; i++) {
+    write(fd, buf, 4096);
+  }
+  lseek(fd, 0, SEEK_SET);
+  for (i = 0; i < 64; i++) {
+    read(fd, buf, 4096);
+  }
+  close(fd);
+
+#elif PROGRAM == 8
+
+  // Prekidi (pokretati sa --irqchip): gost spava u HLT-u umesto da
+  // vrti petlju, budi ga PIT tajmer odnosno IRQ konzole
+  interrupts_init();
+
+  printf("Spavam 1s...\n");
+  sleep_ms(1000);
+  printf("Probudjen posle %d prekida tajmera\n", (int) ticks);
+
+  printf("Unesi broj: ");
+  while (console_events == 0) {
+    wait_for_event();
+  }
+  int n = scan_int();
+  printf("Uneto %d (prekida konzole: %d, ukupno prekida: %d)\n",
+         n, (int) console_events, (int) events);
+
+#elif PROGRAM == 9
+
+  // Gost koji trosi procesor (za --quota i --watchdog): neko vreme
+  // racuna i javlja napredak, a zatim se zaglavi u petlji bez izlazaka
+  volatile uint64_t counter = 0;
+
+  for (int i = 0; i < 10; i++) {
+    for (int j = 0; j < (1 << 16); j++) {
+      counter++;
+    }
+    printf(".");
+  }
+  printf("\n");
+
   for (;;) {
-    asm volatile("hlt");
+    counter++;
+  }
+
+#elif PROGRAM == 10
+
+  // SIMD memcpy/memset (pokretati sa --simd): isti posao bez vektorskih
+  // registara i sa najsirim koji je hipervizor ukljucio
+  char* src = (char*) 0x100000;
+  char* dst = (char*) 0x140000;
+  int level = simd_init();
+  int i;
+
+  printf("SIMD: %s\n", simd_names[level]);
+
+  for (int pass = 0; pass < 2; pass++) {
+    simd_level = pass ? level : SIMD_NONE;
+
+    bench_begin(pass ? "memset_simd" : "memset_scalar", 0x10000);
+    for (i = 0; i < 4; i++) {
+      memset(src, i, 0x10000);
+    }
+    bench_end(4);
+
+    bench_begin(pass ? "memcpy_simd" : "memcpy_scalar", 0x10000);
+    for (i = 0; i < 4; i++) {
+      memcpy(dst, src, 0x10000);
+    }
+    bench_end(4);
+  }
+
+  for (i = 0; i < 0x10000 && dst[i] == 3; i++);
+  printf("Provera: %s\n", i == 0x10000 ? "ok" : "greska");
+
+#elif PROGRAM == 11
+
+  // Isti tekst kroz linijski baferisan printf (izlazak po redu) i preko
+  // MMIO konzole (coalesced upisi od po 8 bajtova)
+  const char line[] = "Red teksta za poredjenje konzola na portu i u MMIO prozoru\n";
+  int len = sizeof(line) - 1;
+  int i;
+
+  bench_begin("port_console", len);
+  for (i = 0; i < 20; i++) {
+    printf("%s", line);
+  }
+  bench_end(20);
+
+  bench_begin("mmio_console", len);
+  for (i = 0; i < 20; i++) {
+    mmio_console_write(line, len);
+  }
+  bench_end(20);
+
+  printf("MMIO konzola: %d bajtova\n", (int) mmio_console_count());
+
+#elif PROGRAM == 12
+
+  // Isti formatirani redovi u fajl i na konzolu, prvo bez bafera
+  // (izlazak po znaku), pa sa baferom (izlazak po praznjenju bafera)
+  int fd = open("izlaz.txt", O_WRONLY | O_CREAT | O_TRUNC, 0);
+  if (fd < 0) {
+    printf("Greska pri otvaranju fajla izlaz.txt\n");
+    exit();
   }
+
+  int lines = 50;
+  int i;
+
+  setvbuf(fd, _IONBF);
+  bench_begin("fprintf_nobuf", 0);
+  for (i = 0; i < lines; i++) {
+    fprintf(fd, "red %d: vrednost %x\n", i, i * 37);
+  }
+  bench_end(lines);
+
+  setvbuf(fd, _IOFBF);
+  bench_begin("fprintf_buf", 0);
+  for (i = 0; i < lines; i++) {
+    fprintf(fd, "red %d: vrednost %x\n", i, i * 37);
+  }
+  fflush(fd);
+  bench_end(lines);
+
+  setvbuf(STDOUT, _IONBF);
+  bench_begin("printf_nobuf", 0);
+  for (i = 0; i < 5; i++) {
+    printf("red %d: vrednost %x\n", i, i * 37);
+  }
+  bench_end(5);
+
+  setvbuf(STDOUT, _IOFBF);
+  bench_begin("printf_buf", 0);
+  for (i = 0; i < 5; i++) {
+    printf("red %d: vrednost %x\n", i, i * 37);
+  }
+  fflush(STDOUT);
+  bench_end(5);
+
+  close(fd);
+
+#elif PROGRAM == 13
+
+  // Sekvencijalni upis i citanje diska u zahtevima od 1MB (pokretati sa
+  // --disk i --disk-size od bar 16), zatim DISCARD druge polovine
+  char* buf = (char*) 0x100000;
+  uint32_t chunk = 0x100000 / DISK_SECTOR;
+  int requests = 16;
+  int errors = 0;
+  int ok = 1;
+  int i;
+
+  uint32_t sectors = disk_init();
+  printf("Disk: %d MB\n", (int) (sectors / 2048));
+  if (sectors < chunk * requests) {
+    printf("Disk je premali, potrebno je bar %d MB\n", requests);
+    exit();
+  }
+
+  for (i = 0; i < 0x100000; i += PAGE_SIZE) {
+    *(uint64_t*) (buf + i) = i + 1;
+  }
+
+  // Svi zahtevi i flush se predaju jednim izlaskom
+  bench_begin("disk_write", 0x100000);
+  for (i = 0; i < requests; i++) {
+    disk_submit(DISK_WRITE, (uint64_t) i * chunk, buf, chunk);
+  }
+  disk_submit(DISK_FLUSH, 0, 0, 0);
+  errors += disk_notify();
+  bench_end(requests);
+
+  for (i = 0; i < 0x100000; i += PAGE_SIZE) {
+    *(uint64_t*) (buf + i) = 0;
+  }
+
+  // Jedan zahtev po izlasku, pa svi zahtevi u jednom izlasku
+  bench_begin("disk_rd_sync", 0x100000);
+  for (i = 0; i < requests; i++) {
+    disk_submit(DISK_READ, (uint64_t) i * chunk, buf, chunk);
+    errors += disk_notify();
+  }
+  bench_end(requests);
+
+  bench_begin("disk_rd_batch", 0x100000);
+  for (i = 0; i < requests; i++) {
+    disk_submit(DISK_READ, (uint64_t) i * chunk, buf, chunk);
+  }
+  errors += disk_notify();
+  bench_end(requests);
+
+  for (i = 0; i < 0x100000; i += PAGE_SIZE) {
+    if (*(uint64_t*) (buf + i) != i + 1) ok = 0;
+  }
+
+  disk_submit(DISK_DISCARD, (uint64_t) chunk * requests / 2, 0, chunk * requests / 2);
+  disk_submit(DISK_READ, (uint64_t) chunk * requests / 2, buf, 1);
+  errors += disk_notify();
+
+  printf("Greske: %d, provera: %s, posle discard: %s\n", errors, ok ? "ok" : "greska",
+         *(uint64_t*) buf == 0 ? "nule" : "greska");
+
+#elif PROGRAM == 14
+
+  // Dugo izvrsavanje za inspect i core dump: brojaci na 256 stranica se
+  // stalno menjaju, a ispis ceka u punom baferu konzole
+  volatile uint64_t* counters = (uint64_t*) 0x100000;
+  uint64_t round;
+
+  setvbuf(STDOUT, _IOFBF);
+  printf("Brojaci rade, ispis ceka u baferu\n");
+
+  for (round = 1; round <= 5000; round++) {
+    for (int i = 0; i < 256; i++) {
+      counters[i * (PAGE_SIZE / 8)] = round;
+    }
+  }
+
+  printf("Gotovo posle %d rundi\n", (int) (round - 1));
+
+#elif PROGRAM == 15
+
+  // Veliki prenosi (pokretati sa --memory 300 --file veliki.bin, a za
+  // upis preko 2GB sa --memory 3200). Citanje jednim READ-om pa obrada,
+  // zatim isto preko STREAM_READ uz obradu svakog pristiglog dela
+  char* buf = (char*) 0x200000;
+  uint64_t size = 256UL << 20;
+  uint64_t big = 3UL << 30;
+  uint64_t sum = 0;
+  int64_t n;
+
+  int fd = open("veliki.bin", O_RDONLY, 0);
+  if (fd < 0) {
+    printf("Nema fajla veliki.bin\n");
+    exit();
+  }
+
+  bench_begin("read_sync", size);
+  n = read(fd, buf, size);
+  stream_sum(&sum, buf, n > 0 ? n : 0);
+  bench_end(1);
+  printf("read: %d MB, zbir %d\n", (int) (n >> 20), (int) sum);
+
+  sum = 0;
+  lseek(fd, 0, SEEK_SET);
+  bench_begin("stream_read", size);
+  n = stream_read(fd, buf, size, &stream_sum, &sum);
+  bench_end(1);
+  printf("stream_read: %d MB, zbir %d\n", (int) (n >> 20), (int) sum);
+  close(fd);
+
+  // Preko 2GB jednim pozivom: WRITE vraca najvise 2GB, STREAM_WRITE sve
+  fd = open("izlaz.bin", O_WRONLY | O_CREAT, 0644);
+  n = write(fd, buf, big);
+  printf("write: %d MB od %d\n", (int) (n >> 20), (int) (big >> 20));
+  n = stream_write(fd, buf, big, 0, 0);
+  printf("stream_write: %d MB od %d\n", (int) (n >> 20), (int) (big >> 20));
+  close(fd);
+
+#elif PROGRAM == 16
+
+  // Pokretanje sa puno page fault-ova (scale_bench -i guest16.img -m 64):
+  // prvi upis u svaku stranicu od 2MB do 62MB, pa isti prazni izlasci
+  // kao PROGRAM 7
+  char* mem = (char*) 0x200000;
+  uint64_t size = 60UL << 20;
+  uint64_t i;
+
+  for (i = 0; i < size; i += PAGE_SIZE) {
+    mem[i] = 1;
+  }
+
+  for (i = 0; i < 20000; i++) {
+    inb(BENCH_PORT);
+  }
+
+#elif PROGRAM == 17
+
+  // Direktorijum gosta (pokretati sa --file primer1.txt --stats s.json,
+  // a vm0_izvan.txt je link na ../izvan.txt): dugo ime, pokusaj izlaska
+  // iz direktorijuma i ponovljeno otvaranje deljenog fajla, svako jednim
+  // sistemskim pozivom
+  const char* long_name = "fajl_sa_imenom_mnogo_duzim_od_nekadasnjih_pedeset_znakova_i_jos_malo.txt";
+  char buf[16];
+  int fd, i, n;
+
+  fd = open(long_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  write(fd, "dugo ime\n", 9);
+  lseek(fd, 0, SEEK_SET);
+  n = read(fd, buf, sizeof(buf) - 1);
+  buf[n > 0 ? n : 0] = 0;
+  close(fd);
+  printf("%s: %s", long_name, buf);
+
+  fd = open("izvan.txt", O_RDWR | O_CREAT, 0644);
+  printf("Otvaranje izvan.txt: %d\n", fd);
+
+  for (i = 0; i < 1000; i++) {
+    fd = open("primer1.txt", O_RDONLY, 0);
+    close(fd);
+  }
+  printf("Deljeni fajl otvoren 1000 puta\n");
+
+#elif PROGRAM == 18
+
+  // Kasnjenje (pokretati sa --irqchip --disk d.img --disk-size 1, jednom
+  // bez i jednom sa --dedicated): zahtev od jednog sektora pa cekanje na
+  // njegov zavrsetak, budjenje iz HLT-a posle 1ms i petlja sa PAUSE
+  char* buf = (char*) 0x100000;
+  int rounds = 20000;
+  int errors = 0;
+  int i;
+
+  interrupts_init();
+  uint32_t sectors = disk_init();
+  printf("Prsten diska: %s\n", disk_polled ? "prati ga nit hipervizora" : "javlja se izlaskom");
+
+  bench_begin("disk_rtt", DISK_SECTOR);
+  for (i = 0; i < rounds; i++) {
+    disk_submit(DISK_READ, i % sectors, buf, 1);
+    errors += disk_notify();
+  }
+  bench_end(rounds);
+
+  bench_begin("sleep_1ms", 0);
+  for (i = 0; i < 200; i++) {
+    sleep_ms(1);
+  }
+  bench_end(200);
+
+  bench_begin("pause_spin", 0);
+  for (i = 0; i < 1000000; i++) {
+    asm volatile("pause");
+  }
+  bench_end(1000000);
+
+  printf("Greske: %d\n", errors);
+
+#elif PROGRAM == 19
+
+  // Ogranicenje protoka (pokretati sa --file primer1.txt i sa
+  // --io-limit / --file-limit): 16MB upisa i citanja u delovima od 64KB,
+  // pa 1000 malih citanja deljenog fajla
+  char* buf = (char*) 0x200000;
+  uint64_t chunk = 64 * 1024;
+  uint64_t size = 16UL << 20;
+  uint64_t done;
+  int fd, i;
+
+  fd = open("ogranicenje.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  bench_begin("limit_write", chunk);
+  for (done = 0; done < size; done += chunk) {
+    write(fd, buf, chunk);
+  }
+  bench_end(size / chunk);
+
+  lseek(fd, 0, SEEK_SET);
+  bench_begin("limit_read", chunk);
+  for (done = 0; done < size; done += chunk) {
+    read(fd, buf, chunk);
+  }
+  bench_end(size / chunk);
+  close(fd);
+
+  fd = open("primer1.txt", O_RDONLY, 0);
+  bench_begin("limit_shared", 16);
+  for (i = 0; i < 1000; i++) {
+    lseek(fd, 0, SEEK_SET);
+    read(fd, buf, 16);
+  }
+  bench_end(1000);
+  close(fd);
+
+#elif PROGRAM == 20
+
+  // Brojaci performansi (pokretati sa --pmu i --memory 32): sekvencijalni
+  // prolaz i nasumicno skakanje po 16MB, pa predvidive i nepredvidive
+  // grane. Bez PMU-a tabela ima samo redove sa TSC ciklusima
+  uint64_t* chain = (uint64_t*) 0x200000;
+  uint8_t* bits = (uint8_t*) 0x200000;
+  uint64_t nodes = (16UL << 20) / 64;
+  uint64_t branches = 1UL << 18;
+  uint64_t seed = 88172645463325252UL;
+  uint64_t i, j, tmp, pos, sum = 0;
+
+  if (pmu_init() > 0) {
+    printf("PMU: verzija %d, %d opstih i %d fiksnih brojaca\n", pmu.version, pmu.counters, pmu.fixed);
+  } else {
+    printf("PMU: nema (pokretati sa --pmu, KVM mora imati enable_pmu)\n");
+  }
+
+  // Jedan cvor po liniji kesa, Sattolo daje jedan ciklus kroz sve
+  for (i = 0; i < nodes; i++) {
+    chain[i * 8] = i;
+  }
+  for (i = nodes - 1; i > 0; i--) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    j = seed % i;
+    tmp = chain[i * 8];
+    chain[i * 8] = chain[j * 8];
+    chain[j * 8] = tmp;
+  }
+
+  bench_begin("seq_scan", 64);
+  for (i = 0; i < nodes; i++) {
+    sum += chain[i * 8];
+  }
+  bench_end(nodes);
+
+  bench_begin("random_chase", 64);
+  for (i = 0, pos = 0; i < nodes; i++) {
+    pos = chain[pos * 8];
+  }
+  bench_end(nodes);
+  sum += pos;
+
+  for (i = 0; i < branches; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    bits[i] = seed;
+  }
+
+  // Prazan asm u grani sprecava da kompajler grane pretvori u cmov
+  bench_begin("branch_fixed", 0);
+  for (i = 0; i < branches; i++) {
+    if (i & 1) {
+      asm volatile("");
+      sum += bits[i];
+    }
+  }
+  bench_end(branches);
+
+  bench_begin("branch_rand", 0);
+  for (i = 0; i < branches; i++) {
+    if (bits[i] & 1) {
+      asm volatile("");
+      sum += bits[i];
+    }
+  }
+  bench_end(branches);
+
+  printf("Kontrolna suma: %x\n", (int) sum);
+
+#endif
+  exit();
 }
@@ -0,0 +1,142 @@
+#ifndef GUEST_MEM_H
+#define GUEST_MEM_H
+
+#include <stdint.h>
+
+//  Raspored memorije gosta koji dele mini_hypervisor i inspect.
+//
+//  Fizicka memorija gosta je memfd sa imenom GUEST_MEMFD_NAME, pa je
+//  drugi proces moze mapirati preko /proc/PID/fd dok gost radi. Tabele
+//  stranica pocinju od fizicke adrese 0 (PML4), a prevodjenje adresa
+//  ispod radi samo nad tom memorijom, bez KVM-a.
+
+#define GUEST_MEMFD_NAME "mini_hypervisor-vm%d"
+
+//  Signal za core dump, si_value je id gosta (bez sigqueue svi gosti)
+#define GUEST_CORE_SIGNAL SIGUSR2
+
+#define PDE64_PRESENT 1
+#define PDE64_RW (1U << 1)
+#define PDE64_USER (1U << 2)
+#define PDE64_PWT (1U << 3)
+#define PDE64_PCD (1U << 4)
+#define PDE64_PS (1U << 7)
+
+#define PM5O_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 48UL))
+#define PM4O_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 39UL))
+#define PDPO_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 30UL))
+#define PDO_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 21UL))
+#define PTO_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 12UL))
+
+#define PAGE4KB_OFFSET(addr) ((addr) & ((1 << 12) - 1))
+#define PAGE2MB_OFFSET(addr) ((addr) & ((1 << 21) - 1))
+
+#define PM5_ADDR_TO_ENTRY(addr) ((addr & PM5O_MASK) >> 48UL)
+#define PM4_ADDR_TO_ENTRY(addr) ((addr & PM4O_MASK) >> 39UL)
+#define PDPO_ADDR_TO_ENTRY(addr) ((addr & PDPO_MASK) >> 30UL)
+#define PDO_ADDR_TO_ENTRY(addr) ((addr & PDO_MASK) >> 21UL)
+#define PTO_ADDR_TO_ENTRY(addr) ((addr & PTO_MASK) >> 12UL)
+
+#define PMT_ENTRY_TO_ADDR(entry) ((((entry >> 12)) & ((1L << 40UL) - 1)) << 12UL)
+
+#define GUEST_TABLE_SIZE 0x1000
+#define GUEST_UNMAPPED ((uint64_t) -1)
+
+//  Tabela stranica na koju pokazuje entry ili NULL ako je van memorije
+static inline const uint64_t* guest_table(const char* mem, uint64_t mem_size, uint64_t entry) {
+    uint64_t addr = PMT_ENTRY_TO_ADDR(entry);
+
+    return addr + GUEST_TABLE_SIZE <= mem_size ? (const uint64_t*) (mem + addr) : NULL;
+}
+
+//  Prevodi virtuelnu adresu gosta u fizicku ili vraca GUEST_UNMAPPED.
+//  Fizicka adresa moze biti van memorije (MMIO prozor), to proverava
+//  pozivalac
+static inline uint64_t guest_walk(const char* mem, uint64_t mem_size, uint64_t addr) {
+    const uint64_t* pm4 = (const uint64_t*) mem;
+    uint64_t entry = pm4[PM4_ADDR_TO_ENTRY(addr)];
+
+    if (!(entry & PDE64_PRESENT)) return GUEST_UNMAPPED;
+
+    const uint64_t* pdp = guest_table(mem, mem_size, entry);
+    if (pdp == NULL) return GUEST_UNMAPPED;
+    entry = pdp[PDPO_ADDR_TO_ENTRY(addr)];
+    if (!(entry & PDE64_PRESENT)) return GUEST_UNMAPPED;
+
+    const uint64_t* pd = guest_table(mem, mem_size, entry);
+    if (pd == NULL) return GUEST_UNMAPPED;
+    entry = pd[PDO_ADDR_TO_ENTRY(addr)];
+    if (!(entry & PDE64_PRESENT)) return GUEST_UNMAPPED;
+
+    if (entry & PDE64_PS) {
+        return PMT_ENTRY_TO_ADDR(entry) + PAGE2MB_OFFSET(addr);
+    }
+
+    const uint64_t* pt = guest_table(mem, mem_size, entry);
+    if (pt == NULL) return GUEST_UNMAPPED;
+    entry = pt[PTO_ADDR_TO_ENTRY(addr)];
+    if (!(entry & PDE64_PRESENT)) return GUEST_UNMAPPED;
+
+    return PMT_ENTRY_TO_ADDR(entry) + PAGE4KB_OFFSET(addr);
+}
+
+typedef void (*guest_mapping_fn)(void* ctx, uint64_t virt, uint64_t phys, uint64_t size);
+
+//  Opseg koji se trenutno spaja u guest_mappings
+struct guest_mapping_run {
+    uint64_t virt;
+    uint64_t phys;
+    uint64_t size;
+};
+
+static inline void guest_mapping_add(struct guest_mapping_run* run, uint64_t virt, uint64_t phys, uint64_t size,
+    guest_mapping_fn fn, void* ctx) {
+
+    if (run->size && run->virt + run->size == virt && run->phys + run->size == phys) {
+        run->size += size;
+        return;
+    }
+
+    if (run->size) fn(ctx, run->virt, run->phys, run->size);
+    run->virt = virt;
+    run->phys = phys;
+    run->size = size;
+}
+
+//  Poziva fn za svaki mapirani opseg virtuelnih adresa, redom po
+//  adresama. Susedne stranice koje su i fizicki susedne se spajaju
+static inline void guest_mappings(const char* mem, uint64_t mem_size, guest_mapping_fn fn, void* ctx) {
+    struct guest_mapping_run run = {0, 0, 0};
+    const uint64_t* pm4 = (const uint64_t*) mem;
+
+    for (uint64_t i = 0; i < 512; i++) {
+        const uint64_t* pdp = (pm4[i] & PDE64_PRESENT) ? guest_table(mem, mem_size, pm4[i]) : NULL;
+        uint64_t base4 = (i << 39) | (i >= 256 ? 0xffff000000000000UL : 0);
+
+        for (uint64_t j = 0; pdp && j < 512; j++) {
+            const uint64_t* pd = (pdp[j] & PDE64_PRESENT) ? guest_table(mem, mem_size, pdp[j]) : NULL;
+            uint64_t base3 = base4 | (j << 30);
+
+            for (uint64_t k = 0; pd && k < 512; k++) {
+                uint64_t base2 = base3 | (k << 21);
+
+                if (!(pd[k] & PDE64_PRESENT)) continue;
+                if (pd[k] & PDE64_PS) {
+                    guest_mapping_add(&run, base2, PMT_ENTRY_TO_ADDR(pd[k]), 1UL << 21, fn, ctx);
+                    continue;
+                }
+
+                const uint64_t* pt = guest_table(mem, mem_size, pd[k]);
+                for (uint64_t l = 0; pt && l < 512; l++) {
+                    if (pt[l] & PDE64_PRESENT) {
+                        guest_mapping_add(&run, base2 | (l << 12), PMT_ENTRY_TO_ADDR(pt[l]), 1UL << 12, fn, ctx);
+                    }
+                }
+            }
+        }
+    }
+
+    if (run.size) fn(ctx, run.virt, run.phys, run.size);
+}
+
+#endif
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <elf.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+
+#include "guest_mem.h"
+
+//  Pregled memorije gosta dok radi. Memfd sa memorijom gosta se otvara
+//  preko /proc/PID/fd procesa mini_hypervisor i mapira samo za citanje,
+//  pa gost ne primecuje pregled
+//
+//  ./inspect PID ID regions           mapirani opsezi iz tabela stranica
+//  ./inspect PID ID read ADDR LEN     sadrzaj na virtuelnoj adresi
+//  ./inspect PID ID phys ADDR LEN     sadrzaj na fizickoj adresi
+//  ./inspect PID ID console ELF       neispisan sadrzaj stdio bafera gosta
+//  ./inspect PID ID core              trazi core dump (--core u hipervizoru)
+
+#define PAGE_SIZE 0x1000
+
+//  Mora odgovarati strukturi stdio_buffer u guest.c
+#define GUEST_STDIO_BUFSIZ 4096
+#define GUEST_STDIO_FILES 8
+
+struct guest_stdio_buffer {
+    int32_t active;
+    int32_t fd;
+    int32_t mode;
+    uint64_t used;
+    char data[GUEST_STDIO_BUFSIZ];
+};
+
+static const char* stdio_modes[] = {"bez bafera", "linijski", "pun"};
+
+static char* mem;
+static uint64_t mem_size;
+
+//  Trazi memfd gosta medju otvorenim fajlovima procesa
+static int open_guest_memory(int pid, int id) {
+    char name[64], expected[96], path[PATH_MAX], link[PATH_MAX];
+    struct dirent* entry;
+
+    snprintf(name, sizeof(name), GUEST_MEMFD_NAME, id);
+    snprintf(expected, sizeof(expected), "/memfd:%s (deleted)", name);
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "GRESKA: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int fd = -1;
+    while (fd < 0 && (entry = readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, entry->d_name);
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len < 0) continue;
+        link[len] = '\0';
+
+        if (strcmp(link, expected) == 0) {
+            fd = open(path, O_RDONLY);
+        }
+    }
+    closedir(dir);
+
+    if (fd < 0) {
+        fprintf(stderr, "GRESKA: proces %d nema gosta %d\n", pid, id);
+    }
+    return fd;
+}
+
+//  Kopira len bajtova sa virtuelne adrese gosta, stranicu po stranicu
+static int read_virtual(uint64_t addr, void* buf, uint64_t len) {
+    char* out = buf;
+
+    while (len > 0) {
+        uint64_t chunk = PAGE_SIZE - PAGE4KB_OFFSET(addr);
+        if (chunk > len) chunk = len;
+
+        uint64_t phys = guest_walk(mem, mem_size, addr);
+        if (phys == GUEST_UNMAPPED || phys + chunk > mem_size) {
+            return -1;
+        }
+
+        memcpy(out, mem + phys, chunk);
+        out += chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static void hexdump(uint64_t addr, const unsigned char* data, uint64_t len) {
+    for (uint64_t i = 0; i < len; i += 16) {
+        printf("%016" PRIx64 "  ", addr + i);
+        for (uint64_t j = i; j < i + 16; j++) {
+            if (j < len) printf("%02x ", data[j]);
+            else printf("   ");
+        }
+        printf(" ");
+        for (uint64_t j = i; j < i + 16 && j < len; j++) {
+            putchar(data[j] >= 32 && data[j] < 127 ? data[j] : '.');
+        }
+        printf("\n");
+    }
+}
+
+static void print_region(void* ctx, uint64_t virt, uint64_t phys, uint64_t size) {
+    printf("%016" PRIx64 "-%016" PRIx64 " -> %010" PRIx64 " %8" PRIu64 " KB%s\n", virt, virt + size, phys,
+        size / 1024, phys >= mem_size ? " mmio" : "");
+}
+
+//  Adresa simbola iz ELF verzije slike gosta (guestN.elf)
+static uint64_t find_symbol(const char* path, const char* symbol) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "GRESKA: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    char* elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (elf == MAP_FAILED || st.st_size < sizeof(Elf64_Ehdr) || memcmp(elf, ELFMAG, SELFMAG) != 0) {
+        fprintf(stderr, "GRESKA: %s nije ELF fajl\n", path);
+        return 0;
+    }
+
+    Elf64_Ehdr* ehdr = (Elf64_Ehdr*) elf;
+    Elf64_Shdr* sections = (Elf64_Shdr*) (elf + ehdr->e_shoff);
+    uint64_t value = 0;
+
+    for (int i = 0; i < ehdr->e_shnum && value == 0; i++) {
+        if (sections[i].sh_type != SHT_SYMTAB) continue;
+
+        Elf64_Sym* symbols = (Elf64_Sym*) (elf + sections[i].sh_offset);
+        const char* names = elf + sections[sections[i].sh_link].sh_offset;
+        for (uint64_t j = 0; j < sections[i].sh_size / sizeof(Elf64_Sym); j++) {
+            if (strcmp(names + symbols[j].st_name, symbol) == 0) {
+                value = symbols[j].st_value;
+                break;
+            }
+        }
+    }
+
+    munmap(elf, st.st_size);
+    if (value == 0) {
+        fprintf(stderr, "GRESKA: %s nema simbol %s\n", path, symbol);
+    }
+    return value;
+}
+
+//  Ispisuje bafere koje gost jos nije predao hipervizoru
+static int print_console(const char* elf) {
+    uint64_t addr = find_symbol(elf, "stdio_buffers");
+    struct guest_stdio_buffer* buffers;
+
+    if (addr == 0) return -1;
+
+    buffers = malloc(sizeof(struct guest_stdio_buffer) * GUEST_STDIO_FILES);
+    if (buffers == NULL || read_virtual(addr, buffers, sizeof(struct guest_stdio_buffer) * GUEST_STDIO_FILES) < 0) {
+        fprintf(stderr, "GRESKA: stdio_buffers (0x%" PRIx64 ") nije mapiran\n", addr);
+        return -1;
+    }
+
+    for (int i = 0; i < GUEST_STDIO_FILES; i++) {
+        struct guest_stdio_buffer* b = &buffers[i];
+        if (!b->active) continue;
+
+        uint64_t used = b->used < GUEST_STDIO_BUFSIZ ? b->used : GUEST_STDIO_BUFSIZ;
+        printf("fd %d (%s, %" PRIu64 " bajtova):\n", b->fd, b->mode >= 0 && b->mode < 3 ? stdio_modes[b->mode] : "?", used);
+        fwrite(b->data, 1, used, stdout);
+        if (used && b->data[used - 1] != '\n') printf("\n");
+    }
+
+    free(buffers);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 4) {
+        fprintf(stderr, "Upotreba: %s PID id_gosta regions|read ADDR LEN|phys ADDR LEN|console ELF|core\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int pid = atoi(argv[1]);
+    int id = atoi(argv[2]);
+    const char* command = argv[3];
+
+    if (strcmp(command, "core") == 0) {
+        union sigval value = {.sival_int = id};
+        if (sigqueue(pid, GUEST_CORE_SIGNAL, value) < 0) {
+            fprintf(stderr, "GRESKA: sigqueue: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    int fd = open_guest_memory(pid, id);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    mem_size = st.st_size;
+    mem = mmap(NULL, mem_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("GRESKA: Neuspesan mmap memorije gosta");
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(command, "regions") == 0) {
+        guest_mappings(mem, mem_size, &print_region, NULL);
+    } else if ((strcmp(command, "read") == 0 || strcmp(command, "phys") == 0) && argc > 5) {
+        uint64_t addr = strtoull(argv[4], NULL, 0);
+        uint64_t len = strtoull(argv[5], NULL, 0);
+        unsigned char* data = malloc(len);
+
+        if (command[0] == 'p') {
+            if (data == NULL || addr > mem_size || len > mem_size - addr) {
+                fprintf(stderr, "GRESKA: opseg je van memorije gosta (%" PRIu64 " KB)\n", mem_size / 1024);
+                return EXIT_FAILURE;
+            }
+            memcpy(data, mem + addr, len);
+        } else if (data == NULL || read_virtual(addr, data, len) < 0) {
+            fprintf(stderr, "GRESKA: opseg 0x%" PRIx64 " nije mapiran\n", addr);
+            return EXIT_FAILURE;
+        }
+        hexdump(addr, data, len);
+    } else if (strcmp(command, "console") == 0 && argc > 4) {
+        if (print_console(argv[4]) < 0) return EXIT_FAILURE;
+    } else {
+        fprintf(stderr, "GRESKA: nepoznata komanda %s\n", command);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -12,42 +13,92 @@
 #include <getopt.h>
 #include <pty.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/procfs.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "trace.h"
+#include "guest_mem.h"
 
 #define OPEN 1
 #define CLOSE 2
 #define READ 3
 #define WRITE 4
+#define LSEEK 5
+#define COPY 6
+#define STREAM_READ 7
+#define STREAM_WRITE 8
 #define FINISH 0
 
-#define PDE64_PRESENT 1
-#define PDE64_RW (1U << 1)
-#define PDE64_USER (1U << 2)
-#define PDE64_PS (1U << 7)
+#define BALLOON_PORT 0x27A
+#define BALLOON_INFLATE 1
+#define BALLOON_DEFLATE 2
+#define BALLOON_TARGET 3
 
-#define PM5O_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 48UL))
-#define PM4O_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 39UL))
-#define PDPO_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 30UL))
-#define PDO_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 21UL))
-#define PTO_MASK ((uint64_t)(((1UL << 9UL) - 1UL) << 12UL))
+#define BENCH_PORT 0x27C
+#define CONSOLE_BULK_PORT 0xEA
+#define EXIT_PORT 0x27E
 
-#define PAGE4KB_OFFSET(addr) (addr & ((1 << 12) - 1))
-#define PAGE2MB_OFFSET(addr) (addr & ((1 << 21) - 1))
+#define IRQ_CONSOLE 4
+#define IRQ_FILE 5
+#define TSS_ADDRESS 0xfffbd000
 
-#define PM5_ADDR_TO_ENTRY(addr) ((addr & PM5O_MASK) >> 48UL)
-#define PM4_ADDR_TO_ENTRY(addr) ((addr & PM4O_MASK) >> 39UL)
-#define PDPO_ADDR_TO_ENTRY(addr) ((addr & PDPO_MASK) >> 30UL)
-#define PDO_ADDR_TO_ENTRY(addr) ((addr & PDO_MASK) >> 21UL)
-#define PTO_ADDR_TO_ENTRY(addr) ((addr & PTO_MASK) >> 12UL)
+//  MMIO prozor: fizicke adrese bez memorije, pristup izaziva
+//  KVM_EXIT_MMIO. Gost ga vidi na virtuelnoj adresi MMIO_VIRTUAL
+//  (poslednji ulaz prvog PD-a)
+#define MMIO_BASE 0xC0000000UL
+#define MMIO_SIZE SIZE2MB
+#define MMIO_VIRTUAL 0x3FE00000UL
 
-#define PMT_ENTRY_TO_ADDR(entry) ((((entry >> 12)) & ((1L << 40UL) - 1)) << 12UL)
+#define MMIO_CONSOLE_DATA 0x0
+#define MMIO_CONSOLE_COUNT 0x8
+
+//  sys/user.h (iz sys/procfs.h) ima svoj PAGE_SIZE iste vrednosti
+#undef PAGE_SIZE
+#define PAGE_SIZE 0x1000
+
+#define SIG_KICK (SIGRTMIN + 1)
+#define KICK_PROFILE 1
+#define KICK_QUOTA 2
+#define KICK_WATCHDOG 4
+#define KICK_STOP 8
+#define KICK_PAUSE 16
 
 // CR4
 #define CR4_PAE (1U << 5)
+#define CR4_OSFXSR (1U << 9)
+#define CR4_OSXMMEXCPT (1U << 10)
+#define CR4_OSXSAVE (1U << 18)
 
 // CR0
 #define CR0_PE 1u
+#define CR0_MP (1U << 1)
+#define CR0_EM (1U << 2)
+#define CR0_TS (1U << 3)
+#define CR0_NE (1U << 5)
 #define CR0_PG (1U << 31)
 
+// CPUID.1:ECX
+#define CPUID_XSAVE (1U << 26)
+
+// XCR0
+#define XCR0_X87 (1UL << 0)
+#define XCR0_SSE (1UL << 1)
+#define XCR0_AVX (1UL << 2)
+
 #define EFER_LME (1U << 8)
 #define EFER_LMA (1U << 10)
 
@@ -55,6 +106,7 @@
 
 const char** shared_files;
 int shared_file_size = 0;
+int* shared_fds = NULL;
 
 enum PageSize {MB2, KB4};
 
@@ -65,6 +117,8 @@ enum PageSize {MB2, KB4};
 struct hypervisor {
     int kvm_fd; 
     int kvm_run_mmap_size;
+    struct kvm_cpuid2* cpuid;
+    int coalesced_mmio_page;
 };
 
 //  Inicijalizuje hypervisora sa potrebnim parametrima,
@@ -85,6 +139,9 @@ int init_hypervisor(struct hypervisor* hypervisor) {
         return -1;
     }
 
+    hypervisor->cpuid = NULL;
+    hypervisor->coalesced_mmio_page = ioctl(hypervisor->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+
     return 0;
 
 }
@@ -93,6 +150,52 @@ struct guest;
 
 typedef int (*State) (struct guest*, uint32_t data, void* data_offset);
 
+//  Nacin na koji se izvrsava virtuelni procesor gosta
+//
+//  run - izvrsava gosta do sledeceg izlaska i popunjava kvm_run,
+//        u slucaju greske vraca negativnu vrednost i postavlja errno
+struct vcpu_backend {
+    const char* name;
+    int (*run)(struct guest* vm);
+};
+
+//  Izlasci koje reprodukuje replay backend
+//
+//  records - I/O izlasci u formatu traga (trace.h)
+//  position - sledeci izlazak, loops - preostali broj prolaza
+//  fd_map - preslikavanje snimljenih fajl deskriptora u stvarne
+struct replay {
+    struct trace_record* records;
+    size_t count;
+    size_t position;
+    uint64_t loops;
+    int last_state;
+    int fd_map[2][16];
+};
+
+//  Kofa tokena: rate tokena u sekundi, najvise burst. Zahtev se naplacuje
+//  tek kad se zavrsi, pa tokens moze otici u minus; sledeci zahtev ceka
+//  dok se dug ne otplati
+struct bucket {
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t last_ns;
+};
+
+//  Ogranicenje fajl operacija gosta (--io-limit) ili deljenog fajla
+//  (--file-limit)
+//
+//  bytes, ops - kofe za bajtove i operacije, rate 0 je bez ogranicenja
+//  throttled, throttled_ns - broj zadrzanih zahteva i ukupno cekanje
+struct io_limit {
+    pthread_mutex_t lock;
+    struct bucket bytes;
+    struct bucket ops;
+    uint64_t throttled;
+    uint64_t throttled_ns;
+};
+
 struct file {
     int fd;
     int flags;
@@ -101,27 +204,215 @@ struct file {
     uint64_t addr;
     uint64_t size;
     struct file* next;
-    char ime[50];
+    struct io_limit* limit;
+    char* ime;
+    size_t ime_size;
+    char ime_inline[64];
+};
+
+#define EXIT_REASONS 64
+#define STAT_PORTS 8
+#define FILE_OPS 9
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+//  Histogram latencija u nanosekundama sa logaritamsko-linearnim
+//  korpama (kao HDR histogram): svaki stepen dvojke je podeljen na
+//  HIST_SUB korpi pa je relativna greska najvise 1 / HIST_SUB
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct port_stats {
+    uint16_t port;
+    uint64_t in;
+    uint64_t out;
+};
+
+//  Statistika jednog virtuelnog procesora
+//
+//  exits - broj izlazaka po razlogu (kvm_run->exit_reason)
+//  ports - broj I/O izlazaka po portu i smeru, port 0 skuplja ostale
+//  file_ops - broj fajl operacija po kodu (OPEN, CLOSE, READ, WRITE)
+//  kvm_run_ns - vreme provedeno u KVM_RUN
+//  handler_ns - vreme provedeno u obradi izlaska u korisnickom prostoru
+struct vcpu_stats {
+    uint64_t exits[EXIT_REASONS];
+    struct port_stats ports[STAT_PORTS];
+    uint64_t file_ops[FILE_OPS];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t open_syscalls;
+    uint64_t coalesced_mmio;
+    struct histogram kvm_run_ns;
+    struct histogram handler_ns;
+};
+
+#define TRACE_RING_SIZE 4096
+
+//  Prsten zapisa traga jednog virtuelnog procesora. Pise ga samo nit
+//  virtuelnog procesora (head), a prazni ga samo nit za trag (tail),
+//  pa nisu potrebna zakljucavanja. Kada je prsten pun zapis se odbacuje
+struct trace_ring {
+    struct trace_record records[TRACE_RING_SIZE];
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    uint64_t dropped;
+};
+
+//  Prenos u delovima (STREAM_READ i STREAM_WRITE)
+//
+//  Posle fd-a, adrese i velicine hipervizor pokrece nit koja prenosi
+//  STREAM_CHUNK po STREAM_CHUNK bajtova, a vCPU se odmah vraca gostu.
+//  Svako citanje statusa (dva 32-bitna IN-a) ceka sledeci zavrseni deo
+//  i vraca ukupno preneto, sa STREAM_PENDING dok prenos traje, pa gost
+//  obradjuje prethodni deo dok nit cita sledeci. Bez STREAM_PENDING je
+//  rezultat konacan: manji od trazenog posle EOF-a ili greske (gost
+//  tada moze nastaviti od tog mesta), a -1 ako nista nije preneto
+//
+//  done - preneseno do sada, reported - poslednje prijavljeno gostu
+//  finished, error - kraj prenosa i errno ako se zavrsio greskom
+//  stop - zahtev niti da prekine posle tekuceg dela
+//  limit - ogranicenje deljenog fajla (--file-limit) ili NULL
+struct stream {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    pthread_mutex_t transfer;   //  Drzi je nit dok prenosi deo (core dump je uzima)
+    struct guest* vm;
+    int active;
+    int fd;
+    int is_write;
+    uint64_t addr;
+    uint64_t size;
+    uint64_t done;
+    uint64_t reported;
+    uint64_t status;
+    int finished;
+    int error;
+    _Atomic int stop;   //  Postavlja vCPU, cita nit prenosa
+    struct io_limit* limit;
 };
 
+#define LOOKUP_BUCKETS 64
+#define LOOKUP_UNKNOWN -1
+
+struct lookup_entry;
+
 //  Struktura koja definise jednog gosta
 //
 //  vm_fd - fajl deskriptor koji komunicira sa odredjenim vm-om
 //  vm_vcp - fajl deskriptor koji predstavlja virtuelni procesor
+//  mem_fd - memfd sa fizickom memorijom gosta
 //  mem - memorija gosta
 //  kvm_run - run struktura gosta  
+//  mem_size - velicina fizicke memorije gosta
+//  reserved_size - pocetak memorije koja nije tabela stranica
+//  balloon_* - stanje balon uredjaja (u stranicama od 4KB)
+//  rss_pages - poslednje izmereni broj rezidentnih stranica
+//  disk - blok uredjaj gosta (--disk) ili NULL
+//  dir_fd, lookup - direktorijum gosta (--sandbox) i kes deljenih imena
+//  disabled_exits, poll_* - posveceno jezgro (--dedicated)
+//  io_limit - ogranicenje fajl operacija gosta (--io-limit)
+//  client - klijent demona koji je pokrenuo gosta ili -1
+//  pmu_* - MSR filter virtuelnog PMU-a i odbijeni pristupi (--pmu)
 struct guest {
     int vm_fd;
     int vm_vcpu;
+    int mem_fd;
     int pty_master;
     int pty_slave;
+    int console_in;
+    int console_out;
     int lock;
     int id;
     char* mem;
+    size_t mem_size;
+    size_t reserved_size;
     struct kvm_run* kvm_run;
     struct file* file_head;
     struct file* current_file;
     State current_file_state;
+    State balloon_state;
+    int balloon_lock;
+    uint64_t balloon_addr;
+    uint64_t balloon_size;
+    uint64_t balloon_pages;
+    volatile uint64_t balloon_target;
+    volatile uint64_t rss_pages;
+    int vm_stats_fd;
+    int vcpu_stats_fd;
+    struct vcpu_stats stats;
+    struct trace_ring* trace;
+    const struct vcpu_backend* backend;
+    struct replay* replay;
+    uint64_t bench_addr;
+    int bench_half;
+    uint64_t bench_start_ns;
+    uint64_t bench_start_exits;
+    uint64_t launch_ns;
+    uint64_t first_run_ns;
+    uint64_t end_ns;
+    uint64_t allocations;   //  Alokacije niti gosta u petlji (ALLOC_COUNT)
+    _Atomic int kicks;
+    struct profile* profile;
+
+    int irqchip;
+    sem_t console_armed;
+    pthread_t console_thread;
+
+    pthread_t thread;
+    timer_t quota_timer;
+    timer_t watchdog_timer;
+    uint64_t quota_period_start;
+    uint64_t quota_cpu_start;
+    uint64_t throttled;
+    uint64_t throttled_ns;
+    uint64_t watchdog_exits;
+    const char* stop_reason;
+
+    struct kvm_coalesced_mmio_ring* coalesced_ring;
+    uint64_t mmio_console_bytes;
+
+    pthread_mutex_t log_lock;
+    struct log_page* log_page;
+    struct log_target* log_target;
+    int log_record_open;
+    uint64_t log_last_ns;
+
+    struct disk* disk;
+
+    sem_t paused;
+    sem_t resume;
+    _Atomic uint64_t* _Atomic host_dirty;
+    _Atomic uint64_t* host_dirty_bitmap;
+
+    struct stream stream;
+
+    int dir_fd;
+    struct lookup_entry* lookup[LOOKUP_BUCKETS];
+
+    uint64_t disabled_exits;
+    int dedicated;
+    int core;
+    int poll_core;
+    int polling;
+    pthread_t poll_thread;
+    _Atomic int poll_stop;
+    uint64_t poll_loops;
+    uint64_t poll_batches;
+
+    struct io_limit io_limit;
+    int client;
+
+    int pmu_filter;
+    uint64_t pmu_denied;
+    uint32_t pmu_last_msr;
 };
 
 //  Kreira novog gosta i vraca 0 pri uspehu,
@@ -139,21 +430,74 @@ int create_guest(struct hypervisor* hypervisor, struct guest* vm) {
     return 0;
 }
 
-//  Alocira prostor za fizicku memoriju gosta
-//  i dodaje je u vm strukturu
-int create_memory_region(struct guest* vm, size_t mem_size) {
-    struct kvm_userspace_memory_region region;
+int use_irqchip = 0;
 
-    vm->mem = (char*)mmap(NULL, mem_size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (vm->mem == MAP_FAILED) {
-        perror("GRESKA: Neuspesan mmap za mapiranje memorije\n");
+//  Pravi kontroler prekida (PIC, IOAPIC, lokalni APIC) i PIT tajmer
+//  u kernelu. Tada KVM sam obradjuje HLT: vCPU spava u kernelu dok
+//  ne stigne prekid, umesto da svaki HLT izlazi u hipervizor
+int setup_irqchip(struct guest* vm) {
+    struct kvm_pit_config pit = {.flags = 0};
+
+    if (ioctl(vm->vm_fd, KVM_SET_TSS_ADDR, TSS_ADDRESS) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_SET_TSS_ADDR\n");
+        fprintf(stderr, "KVM_SET_TSS_ADDR: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ioctl(vm->vm_fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_CREATE_IRQCHIP\n");
+        fprintf(stderr, "KVM_CREATE_IRQCHIP: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ioctl(vm->vm_fd, KVM_CREATE_PIT2, &pit) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_CREATE_PIT2\n");
+        fprintf(stderr, "KVM_CREATE_PIT2: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+//  Salje ivicu na liniju prekida irq
+int raise_irq(struct guest* vm, int irq) {
+    struct kvm_irq_level level = {.irq = irq, .level = 1};
+
+    if (ioctl(vm->vm_fd, KVM_IRQ_LINE, &level) < 0) {
+        fprintf(stderr, "KVM_IRQ_LINE: %s\n", strerror(errno));
         return -1;
     }
+    level.level = 0;
+    ioctl(vm->vm_fd, KVM_IRQ_LINE, &level);
+
+    return 0;
+}
+
+//  Ceka ulaz na konzoli i javlja ga gostu kao IRQ_CONSOLE. Posle
+//  prekida nit ceka da gost procita znak (console_armed), da isti
+//  ulaz ne bi javljala vise puta
+void* console_irq_thread(void* par) {
+    struct guest* vm = (struct guest*) par;
+    struct pollfd pfd = {.fd = vm->console_in, .events = POLLIN};
+
+    for (;;) {
+        sem_wait(&vm->console_armed);
+        while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+        if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL) && !(pfd.revents & POLLIN)) {
+            return NULL;
+        }
+        raise_irq(vm, IRQ_CONSOLE);
+    }
+}
+
+//  Prijavljuje memoriju gosta KVM-u, flags je 0 ili KVM_MEM_LOG_DIRTY_PAGES
+int set_memory_region(struct guest* vm, uint32_t flags) {
+    struct kvm_userspace_memory_region region;
 
     region.slot = 0;
-    region.flags = 0;
+    region.flags = flags;
     region.guest_phys_addr = 0;
-    region.memory_size = mem_size;
+    region.memory_size = vm->mem_size;
     region.userspace_addr = (unsigned long)vm->mem;
 
     if (ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
@@ -165,6 +509,30 @@ int create_memory_region(struct guest* vm, size_t mem_size) {
     return 0;
 }
 
+//  Alocira prostor za fizicku memoriju gosta i dodaje je u vm strukturu.
+//  Memorija je memfd (GUEST_MEMFD_NAME), pa je inspect moze mapirati
+//  preko /proc/PID/fd dok gost radi
+int create_memory_region(struct guest* vm, size_t mem_size) {
+    char name[64];
+
+    snprintf(name, sizeof(name), GUEST_MEMFD_NAME, vm->id);
+    vm->mem_fd = memfd_create(name, MFD_CLOEXEC);
+    if (vm->mem_fd < 0 || ftruncate(vm->mem_fd, mem_size) < 0) {
+        perror("GRESKA: Neuspesno pravljenje memfd-a za memoriju gosta\n");
+        fprintf(stderr, "memfd_create: %s\n", strerror(errno));
+        return -1;
+    }
+
+    vm->mem = (char*)mmap(NULL, mem_size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_SHARED, vm->mem_fd, 0);
+    if (vm->mem == MAP_FAILED) {
+        perror("GRESKA: Neuspesan mmap za mapiranje memorije\n");
+        return -1;
+    }
+    vm->mem_size = mem_size;
+
+    return set_memory_region(vm, 0);
+}
+
 //  Kreira virtuelni procesor i vraca 0
 //  u slucaju uspeha u slucaju neuspeha
 // vraca -1
@@ -183,7 +551,7 @@ int create_vcpu(struct guest* vm) {
 //  Alocira prostor za kvm run strukturu
 int create_kvm_run(struct hypervisor* hypervisor, struct guest* vm) {
 
-    vm->kvm_run = mmap(NULL,hypervisor->kvm_run_mmap_size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_SHARED, vm->vm_vcpu, 0);
+    vm->kvm_run = mmap(NULL,hypervisor->kvm_run_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vm->vm_vcpu, 0);
     if (vm->kvm_run == MAP_FAILED) {
         perror("GRESKA: Neuspesan mmap za mapiranje kvm_run strukture\n");
         return -1;
@@ -213,15 +581,9 @@ void setup_64bit_code_segment(struct kvm_sregs* sregs) {
 
 }
 
-int setup_long_mode(struct guest* vm, size_t mem_size, enum PageSize page_size) {
-
-    struct kvm_sregs sregs;
-
-    if (ioctl(vm->vm_vcpu, KVM_GET_SREGS, &sregs) < 0) {
-        perror("GRESKA: Neuspesan ioctl KVM_GET_SREGS\n");
-        fprintf(stderr, "KVM_GET_SREGS: %s\n", strerror(errno));
-        return -1;
-    }
+//  Pravi tabele stranica gosta na pocetku njegove memorije i vraca
+//  fizicku adresu od koje pocinje memorija za program gosta
+uint64_t setup_page_tables(struct guest* vm, size_t mem_size, enum PageSize page_size) {
 
 	uint64_t pml4_addr = 0;
 	uint64_t *pml4 = (void *)(vm->mem + pml4_addr);
@@ -238,6 +600,13 @@ int setup_long_mode(struct guest* vm, size_t mem_size, enum PageSize page_size)
 	pdpt[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pd_addr;
 
     if (page_size == MB2) {
+        //  Preko 1GB memorije treba vise PD tabela. Stoje jedna iza druge,
+        //  pa pd[i] ostaje ulaz za i-tu stranicu od 2MB
+        uint64_t pd_count = (mem_size / SIZE2MB + 511) / 512;
+        for (uint64_t i = 1; i < pd_count; i++) {
+            pdpt[i] = PDE64_PRESENT | PDE64_RW | PDE64_USER | (pd_addr + i * 0x1000);
+        }
+
         page = (page / SIZE2MB + 1) * SIZE2MB;
         uint64_t page_address = page;
         for (int i = 0; i < mem_size / SIZE2MB - 1; i++) {
@@ -264,6 +633,250 @@ int setup_long_mode(struct guest* vm, size_t mem_size, enum PageSize page_size)
         }
     }
 
+    //  MMIO prozor, bez kesiranja
+    if (mem_size / SIZE2MB < PDO_ADDR_TO_ENTRY(MMIO_VIRTUAL)) {
+        pd[PDO_ADDR_TO_ENTRY(MMIO_VIRTUAL)] = PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS
+            | PDE64_PWT | PDE64_PCD | MMIO_BASE;
+    }
+
+    return page;
+}
+
+//  Cita CPUID koji KVM moze da ponudi gostu (sve sto podrzava i
+//  procesor domacina i KVM). Broj ulaza nije unapred poznat, pa se
+//  bafer povecava dok ioctl vraca E2BIG
+struct kvm_cpuid2* get_supported_cpuid(struct hypervisor* hypervisor) {
+    int nent = 64;
+
+    for (;;) {
+        struct kvm_cpuid2* cpuid = calloc(1, sizeof(*cpuid) + nent * sizeof(struct kvm_cpuid_entry2));
+        if (cpuid == NULL) {
+            printf("GRESKA: Alokacija nije uspela\n");
+            return NULL;
+        }
+        cpuid->nent = nent;
+
+        if (ioctl(hypervisor->kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid) == 0) {
+            return cpuid;
+        }
+        free(cpuid);
+
+        if (errno != E2BIG) {
+            perror("GRESKA: Neuspesan ioctl KVM_GET_SUPPORTED_CPUID\n");
+            fprintf(stderr, "KVM_GET_SUPPORTED_CPUID: %s\n", strerror(errno));
+            return NULL;
+        }
+        nent *= 2;
+    }
+}
+
+struct kvm_cpuid_entry2* cpuid_entry(struct kvm_cpuid2* cpuid, uint32_t function, uint32_t index) {
+    for (uint32_t i = 0; i < cpuid->nent; i++) {
+        if (cpuid->entries[i].function == function && cpuid->entries[i].index == index) {
+            return &cpuid->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+void pmu_cpuid(struct kvm_cpuid2* cpuid);
+
+//  Prosledjuje gostu CPUID domacina (--simd, --pmu). Mora da se pozove pre
+//  KVM_SET_SREGS, jer KVM odbija CR4 bitove (npr. OSXSAVE) koje CPUID
+//  gosta ne prijavljuje
+int setup_cpuid(struct hypervisor* hypervisor, struct guest* vm) {
+
+    if (hypervisor->cpuid == NULL) {
+        if ((hypervisor->cpuid = get_supported_cpuid(hypervisor)) == NULL) {
+            return -1;
+        }
+        pmu_cpuid(hypervisor->cpuid);
+    }
+
+    if (ioctl(vm->vm_vcpu, KVM_SET_CPUID2, hypervisor->cpuid) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_SET_CPUID2\n");
+        fprintf(stderr, "KVM_SET_CPUID2: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+//  Ukljucuje x87/SSE/AVX stanje: CR0.MP i NE bez EM i TS, CR4.OSFXSR
+//  i OSXMMEXCPT, a ako CPUID ima XSAVE i CR4.OSXSAVE i XCR0 sa svim
+//  podrzanim komponentama od x87, SSE i AVX. Cuvanje i vracanje ovog
+//  stanja pri svakom ulasku i izlasku iz gosta obavlja KVM
+int setup_simd(struct hypervisor* hypervisor, struct guest* vm, struct kvm_sregs* sregs) {
+    struct kvm_cpuid_entry2* features = cpuid_entry(hypervisor->cpuid, 1, 0);
+    struct kvm_cpuid_entry2* xstate = cpuid_entry(hypervisor->cpuid, 0xD, 0);
+
+    sregs->cr0 = (sregs->cr0 | CR0_MP | CR0_NE) & ~(uint64_t) (CR0_EM | CR0_TS);
+    sregs->cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+
+    if (features == NULL || xstate == NULL || !(features->ecx & CPUID_XSAVE)) {
+        return 0;
+    }
+    sregs->cr4 |= CR4_OSXSAVE;
+
+    if (ioctl(vm->vm_vcpu, KVM_SET_SREGS, sregs) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_SET_SREGS\n");
+        fprintf(stderr, "KVM_SET_SREGS: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct kvm_xcrs xcrs;
+    memset(&xcrs, 0, sizeof(xcrs));
+    xcrs.nr_xcrs = 1;
+    xcrs.xcrs[0].xcr = 0;
+    xcrs.xcrs[0].value = (XCR0_X87 | XCR0_SSE | XCR0_AVX) & xstate->eax;
+
+    if (ioctl(vm->vm_vcpu, KVM_SET_XCRS, &xcrs) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_SET_XCRS\n");
+        fprintf(stderr, "KVM_SET_XCRS: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int use_simd = 0;
+
+//  Virtuelni PMU (--pmu)
+//
+//  Gost dobija arhitekturne brojace performansi koje emulira KVM
+//  (CPUID 0xA): fiksne brojace instrukcija i ciklusa i opste brojace
+//  koji se programiraju preko IA32_PERFEVTSELx i citaju sa RDPMC.
+//  Model-specificni delovi PMU-a (LBR, PEBS, DS, OFFCORE_RSP,
+//  PERF_CAPABILITIES) se sklanjaju iz CPUID-a, a ako ih gost ipak
+//  dira, MSR filter salje izlazak u korisnicki prostor, gde se pristup
+//  broji i gost dobija #GP. Bez --pmu list 0xA je prazan. CPUID se
+//  gostu daje samo sa --simd ili --pmu
+
+int use_pmu = 0;
+int pmu_version = 0;
+
+#define CPUID_DTES64 (1U << 2)
+#define CPUID_PDCM (1U << 15)
+#define CPUID_DS (1U << 21)
+#define CPUID_ARCH_LBR (1U << 19)
+
+struct msr_range {
+    uint32_t base;
+    uint32_t count;
+};
+
+//  MSR-ovi koje filter odbija sa --pmu
+static const struct msr_range pmu_denied_msrs[] = {
+    {0x1A6, 2},     //  OFFCORE_RSP_0, OFFCORE_RSP_1
+    {0x1C8, 2},     //  LBR_SELECT, LBR_TOS
+    {0x1D9, 1},     //  DEBUGCTL (LBR i BTS)
+    {0x345, 1},     //  PERF_CAPABILITIES
+    {0x3F1, 7},     //  PEBS_ENABLE, PEBS_LD_LAT, PEBS_FRONTEND
+    {0x600, 1},     //  DS_AREA
+    {0x680, 0x60},  //  LBR_FROM_x, LBR_TO_x
+    {0xDC0, 0x20},  //  LBR_INFO_x
+    {0x14CE, 2},    //  ARCH_LBR_CTL, ARCH_LBR_DEPTH
+};
+
+#define PMU_DENIED_RANGES (sizeof(pmu_denied_msrs) / sizeof(pmu_denied_msrs[0]))
+
+//  Prilagodjava CPUID koji KVM nudi: bez --pmu gost ne vidi PMU (samo
+//  list 0xA je obrisan, ostalo ostaje kako je za --simd bilo), a sa
+//  --pmu vidi samo arhitekturni
+void pmu_cpuid(struct kvm_cpuid2* cpuid) {
+    struct kvm_cpuid_entry2* features = cpuid_entry(cpuid, 1, 0);
+    struct kvm_cpuid_entry2* extended = cpuid_entry(cpuid, 7, 0);
+    struct kvm_cpuid_entry2* perf = cpuid_entry(cpuid, 0xA, 0);
+
+    if (use_pmu && features) {
+        features->ecx &= ~(CPUID_DTES64 | CPUID_PDCM);
+        features->edx &= ~CPUID_DS;
+    }
+    if (use_pmu && extended) {
+        extended->edx &= ~CPUID_ARCH_LBR;
+    }
+    for (uint32_t i = 0; i < cpuid->nent; i++) {
+        struct kvm_cpuid_entry2* entry = &cpuid->entries[i];
+        if (entry->function == (use_pmu ? 0x1C : 0xA)) {
+            entry->eax = entry->ebx = entry->ecx = entry->edx = 0;
+        }
+    }
+
+    pmu_version = perf ? perf->eax & 0xFF : 0;
+    if (use_pmu && pmu_version == 0) {
+        fprintf(stderr, "KVM ne nudi virtuelni PMU (kvm.enable_pmu=N?), gost nece imati brojace\n");
+    }
+}
+
+//  Postavlja MSR filter za --pmu. Bez KVM_CAP_X86_MSR_FILTER gost dobija
+//  PMU i bez filtera, a CPUID mu i dalje ne prijavljuje odbijene delove
+int setup_pmu(struct guest* vm) {
+    static uint8_t deny[0x60 / 8];
+    struct kvm_enable_cap cap = {.cap = KVM_CAP_X86_USER_SPACE_MSR};
+    struct kvm_msr_filter filter;
+
+    vm->pmu_filter = 0;
+    vm->pmu_denied = 0;
+    if (ioctl(vm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_MSR_FILTER) <= 0 ||
+        ioctl(vm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_USER_SPACE_MSR) <= 0) {
+        fprintf(stderr, "vm%d: domacin nema KVM_CAP_X86_MSR_FILTER, MSR-ovi PMU-a nisu filtrirani\n", vm->id);
+        return 0;
+    }
+
+    cap.args[0] = KVM_MSR_EXIT_REASON_FILTER;
+    if (ioctl(vm->vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_ENABLE_CAP\n");
+        fprintf(stderr, "KVM_CAP_X86_USER_SPACE_MSR: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&filter, 0, sizeof(filter));
+    filter.flags = KVM_MSR_FILTER_DEFAULT_ALLOW;
+    for (int i = 0; i < PMU_DENIED_RANGES; i++) {
+        filter.ranges[i].flags = KVM_MSR_FILTER_READ | KVM_MSR_FILTER_WRITE;
+        filter.ranges[i].base = pmu_denied_msrs[i].base;
+        filter.ranges[i].nmsrs = pmu_denied_msrs[i].count;
+        filter.ranges[i].bitmap = deny;
+    }
+
+    if (ioctl(vm->vm_fd, KVM_X86_SET_MSR_FILTER, &filter) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_X86_SET_MSR_FILTER\n");
+        fprintf(stderr, "KVM_X86_SET_MSR_FILTER: %s\n", strerror(errno));
+        return -1;
+    }
+
+    vm->pmu_filter = 1;
+    return 0;
+}
+
+//  Gost je dirao MSR koji filter odbija. Prvi pristup se prijavljuje,
+//  svi se broje, a gost dobija #GP kao na procesoru bez tog MSR-a
+int exit_msr(struct guest* vm) {
+    struct kvm_run* run = vm->kvm_run;
+
+    if (vm->pmu_denied++ == 0) {
+        fprintf(stderr, "vm%d: %s MSR 0x%x je odbijen (--pmu daje samo arhitekturni PMU)\n", vm->id,
+            run->exit_reason == KVM_EXIT_X86_RDMSR ? "citanje" : "upis", run->msr.index);
+    }
+    vm->pmu_last_msr = run->msr.index;
+    run->msr.error = 1;
+    return 0;
+}
+
+int setup_long_mode(struct hypervisor* hypervisor, struct guest* vm, size_t mem_size, enum PageSize page_size) {
+
+    struct kvm_sregs sregs;
+
+    if (ioctl(vm->vm_vcpu, KVM_GET_SREGS, &sregs) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_GET_SREGS\n");
+        fprintf(stderr, "KVM_GET_SREGS: %s\n", strerror(errno));
+        return -1;
+    }
+
+    uint64_t pml4_addr = 0;
+    uint64_t page = setup_page_tables(vm, mem_size, page_size);
+
     sregs.cr3 = pml4_addr;
     sregs.cr4 = CR4_PAE;
     sregs.cr0 = CR0_PE | CR0_PG;
@@ -271,6 +884,10 @@ int setup_long_mode(struct guest* vm, size_t mem_size, enum PageSize page_size)
 
     setup_64bit_code_segment(&sregs);
 
+    if (use_simd && setup_simd(hypervisor, vm, &sregs) < 0) {
+        return -1;
+    }
+
     if (ioctl(vm->vm_vcpu, KVM_SET_SREGS, &sregs) < 0) {
         perror("GRESKA: Neuspesan ioctl KVM_SET_SREGS\n");
         fprintf(stderr, "KVM_SET_SREGS: %s\n", strerror(errno));
@@ -322,6 +939,16 @@ int exit_halt(struct guest* vm) {
 sem_t file_mutex;
 
 int start_file_operation(struct guest*, uint32_t, void*);
+int wait_for_first_size_half(struct guest*, uint32_t, void*);
+int wait_for_copy_status_high(struct guest*, uint32_t, void*);
+void guest_mark_dirty(struct guest* vm, const void* host, size_t len);
+void* guest_range(struct guest* vm, uint64_t addr, size_t len);
+int wait_for_stream_status(struct guest*, uint32_t, void*);
+int wait_for_stream_status_high(struct guest*, uint32_t, void*);
+int stream_start(struct guest* vm);
+uint64_t now_ns();
+void stream_join(struct stream* stream);
+int64_t copy_between_fds(int in, int out, uint64_t count);
 
 struct file* init_file() {
 
@@ -332,52 +959,30 @@ struct file* init_file() {
     }
 
     new_file->cnt = 0;
+    new_file->ime = new_file->ime_inline;
+    new_file->ime_size = sizeof(new_file->ime_inline);
     new_file->next = NULL;
     new_file->flags = -1;
     new_file->mode = -1;
     new_file->fd = -1;
     new_file->addr = 0;
     new_file->size = 0;
+    new_file->limit = NULL;
 
     return new_file; 
 }
 
+//  Prevodjenje je u guest_mem.h i deli ga sa inspect-om. Adresa van
+//  memorije gosta (MMIO prozor) nema pokazivac u domacinu
 void* virtual_to_physical_add(struct guest* vm, uint64_t addr) {
 
-    uint64_t* pm4 = (uint64_t*) vm->mem;
-    uint64_t entry2 = PM4_ADDR_TO_ENTRY(addr);
-
-    if (!(pm4[entry2] & PDE64_PRESENT)) {
-        return NULL;
-    }
-
-    uint64_t* pdp = (uint64_t*) (vm->mem + PMT_ENTRY_TO_ADDR(pm4[entry2]));
-    uint64_t entry3 = PDPO_ADDR_TO_ENTRY(addr);
-
-    if (!(pdp[entry3] & PDE64_PRESENT)) {
-        return NULL;
-    }
-
-    uint64_t* pd = (uint64_t*) (vm->mem + PMT_ENTRY_TO_ADDR(pdp[entry3]));
-    uint64_t entry4 = PDO_ADDR_TO_ENTRY(addr);
-
-    if (!(pd[entry4] & PDE64_PRESENT)) {
-        return NULL;
-    }
-
-    if (pd[entry4] & PDE64_PS) {
-        return vm->mem + (PMT_ENTRY_TO_ADDR(pd[entry4])) + PAGE2MB_OFFSET(addr);
-    }
-
-    uint64_t* pt = (uint64_t*) (vm->mem + PMT_ENTRY_TO_ADDR(pd[entry4]));
-    uint64_t entry5 = PTO_ADDR_TO_ENTRY(addr);
+    uint64_t phys = guest_walk(vm->mem, vm->mem_size, addr);
 
-    if (!(pt[entry5] & PDE64_PRESENT)) {
+    if (phys == GUEST_UNMAPPED || phys >= vm->mem_size) {
         return NULL;
     }
 
-    return vm->mem + PMT_ENTRY_TO_ADDR(pt[entry5]) + PAGE4KB_OFFSET(addr); 
-
+    return vm->mem + phys;
 }
 
 int get_file_descriptor(struct guest* vm, int data) {
@@ -420,111 +1025,477 @@ int is_shared_file(const char* file_name) {
     return 0;
 }
 
-void create_local_copy(struct guest* vm) {
-
-    char path[200];
-    sprintf(path, "vm%d_", vm->id);
-    strcat(path, vm->current_file->ime);
-    int fd = open(path, O_CREAT | O_WRONLY, 0777);
+//  Otvara deljeni fajl. U procesu gostiju (--workers) fajl je otvorio
+//  nadzorni proces, pa se preko /proc/self/fd otvara novi opis istog
+//  fajla, sa svojom pozicijom
+int open_shared_file(const char* file_name, int flags, int mode) {
 
-    if (is_shared_file(vm->current_file->ime)) {
-        int shared_fd = open(vm->current_file->ime, O_RDONLY);
-        if (shared_fd < 0) {
-            fprintf(stderr, "GRESKA: Nepostojeci deljeni fajl %s\n", vm->current_file->ime);
+    for (int i = 0; shared_fds && i < shared_file_size; i++) {
+        if (shared_fds[i] >= 0 && strcmp(shared_files[i], file_name) == 0) {
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", shared_fds[i]);
+            return open(path, flags & ~(O_CREAT | O_TRUNC), mode);
         }
-
-        char buffer[1024];
-        int size = 0;
-
-        do {
-            size = read(shared_fd, buffer, 1024);
-            write(fd, buffer, size);
-        } while (size == 1024);
-        close(shared_fd);
     }
 
-    close(fd);
+    return open(file_name, flags, mode);
 }
 
-int return_local_file(struct guest* vm) {
+//  Direktorijum gosta (--sandbox, podrazumevano tekuci). Lokalni fajlovi
+//  gosta su vm<id>_<ime> u tom direktorijumu i otvaraju se sa openat2 od
+//  dir_fd gosta uz RESOLVE_BENEATH, pa ime koje zada gost ne moze izaci
+//  iz direktorijuma ni preko "..", ni preko apsolutnih linkova.
+//  Na kernelu bez openat2 (pre 5.6) ime sme biti samo jedna komponenta
+//  (bez '/'), a otvara se sa openat i O_NOFOLLOW, pa ni tada ne izlazi
+const char* sandbox_path = ".";
+_Atomic int sandbox_no_openat2 = 0;
+
+int sandbox_openat(struct guest* vm, const char* name, int flags, mode_t mode) {
+    char path[PATH_MAX + 32];
+    struct open_how how = {
+        .flags = flags,
+        .mode = (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE ? mode & 07777 : 0,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
 
-    char path[200];
-    sprintf(path, "vm%d_", vm->id);    
-    strcat(path, vm->current_file->ime);
-    if (access(path, F_OK) != 0 && vm->current_file->flags & O_CREAT) {
-        create_local_copy(vm);
+    if (snprintf(path, sizeof(path), "vm%d_%s", vm->id, name) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
-    return open(path, vm->current_file->flags, vm->current_file->mode);
-}
 
-int check_path_exists(struct guest* vm) {
-    char path[200];
-    sprintf(path, "vm%d_", vm->id);    
-    strcat(path, vm->current_file->ime);
-    return access(path, F_OK) == 0;
-}
+    vm->stats.open_syscalls++;
+    if (!sandbox_no_openat2) {
+        int fd = syscall(SYS_openat2, vm->dir_fd, path, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS) {
+            if (fd < 0 && errno == EXDEV) {
+                fprintf(stderr, "vm%d: %s vodi van direktorijuma gosta\n", vm->id, path);
+            }
+            return fd;
+        }
+        if (!atomic_exchange(&sandbox_no_openat2, 1)) {
+            fprintf(stderr, "Kernel nema openat2, imena fajlova gosta ne smeju sadrzati '/'\n");
+        }
+    }
 
-int wait_for_mode(struct guest* vm, uint32_t data, void* data_offset) {
-    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
-        perror("GRESKA: Vm nije ispostovan protokol\n");
+    if (strchr(path, '/') != NULL) {
+        errno = EXDEV;
         return -1;
     }
-   
-    vm->current_file->mode = data;
+    return openat(vm->dir_fd, path, flags | O_NOFOLLOW, how.mode);
+}
 
-    if (check_path_exists(vm)) {
-        vm->current_file->fd = return_local_file(vm);
-    } else if (is_shared_file(vm->current_file->ime) && !(vm->current_file->mode & (O_WRONLY | O_RDWR | O_APPEND | O_CREAT))) {
-        vm->current_file->fd = open(vm->current_file->ime, vm->current_file->flags, vm->current_file->mode);
-    } else {
-        vm->current_file->fd = return_local_file(vm);
+//  Kes lokalnih kopija deljenih fajlova: za svako deljeno ime koje je
+//  gost otvarao pamti da li kopija postoji. Ostala imena postoje samo
+//  lokalno, pa je sam openat2 provera
+struct lookup_entry {
+    struct lookup_entry* next;
+    int exists;
+    char name[];
+};
+
+//  Ulaz kesa za ime (novi ulaz je LOOKUP_UNKNOWN) ili NULL
+struct lookup_entry* lookup_entry(struct guest* vm, const char* name) {
+    uint32_t hash = 2166136261U;
+    for (const char* p = name; *p; p++) {
+        hash = (hash ^ (uint8_t) *p) * 16777619U;
     }
 
-    vm->current_file_state = &return_fd_to_vm;
-    return 0;
-}
+    struct lookup_entry** slot = &vm->lookup[hash % LOOKUP_BUCKETS];
+    for (; *slot; slot = &(*slot)->next) {
+        if (strcmp((*slot)->name, name) == 0) return *slot;
+    }
 
-int wait_for_flag(struct guest* vm, uint32_t data, void* data_offset) {
-    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
-        perror("GRESKA: Vm nije ispostovan protokol\n");
-        return -1;
+    *slot = malloc(sizeof(struct lookup_entry) + strlen(name) + 1);
+    if (*slot != NULL) {
+        (*slot)->next = NULL;
+        (*slot)->exists = LOOKUP_UNKNOWN;
+        strcpy((*slot)->name, name);
     }
+    return *slot;
+}
 
-    vm->current_file->flags = data;
-    vm->current_file_state = &wait_for_mode;
+//  Pravi lokalnu kopiju deljenog fajla
+int sandbox_copy_shared(struct guest* vm, const char* name) {
+    int fd = sandbox_openat(vm, name, O_CREAT | O_WRONLY, 0777);
+    if (fd < 0) return -1;
+
+    int shared_fd = open_shared_file(name, O_RDONLY, 0);
+    if (shared_fd < 0) {
+        fprintf(stderr, "GRESKA: Nepostojeci deljeni fajl %s\n", name);
+    } else {
+        copy_between_fds(shared_fd, fd, UINT64_MAX);
+        close(shared_fd);
+    }
 
+    close(fd);
     return 0;
 }
 
-int reading_name(struct guest* vm, uint32_t data, void* data_offset) {
+//  Otvara fajl gosta, po pravilu jednim sistemskim pozivom. Ime koje nije
+//  deljeno se otvara samo lokalno. Za deljeno ime vazi lokalna kopija
+//  ako postoji, inace original samo za citanje, a upis sa O_CREAT prvo
+//  pravi kopiju originala. Ako fajl nestane ispod kesa, ulaz se ispravlja
+int sandbox_open(struct guest* vm, struct file* file) {
+    const char* name = file->ime;
 
-    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint8_t)) {
-        perror("GRESKA: Vm nije ispostovan protokol\n");
+    if (file->cnt > file->ime_size) {
+        errno = ENAMETOOLONG;
         return -1;
     }
 
-    char c = (char) (data & 0xFF);
+    if (!is_shared_file(name)) {
+        return sandbox_openat(vm, name, file->flags, file->mode);
+    }
 
-    vm->current_file->ime[vm->current_file->cnt++] = c;
+    struct lookup_entry* entry = lookup_entry(vm, name);
+    int exists = entry ? entry->exists : LOOKUP_UNKNOWN;
 
-    if (c != '\0') {
-        vm->current_file_state = &reading_name;
-    } else {
-        vm->current_file_state = &wait_for_flag;
+    if (exists != 0) {
+        int fd = sandbox_openat(vm, name, file->flags & ~O_CREAT, file->mode);
+        if (fd >= 0 || errno != ENOENT) {
+            if (entry && fd >= 0) entry->exists = 1;
+            return fd;
+        }
+        if (entry) entry->exists = 0;
     }
 
-    return 0;
-}
+    if (!(file->flags & (O_WRONLY | O_RDWR | O_APPEND | O_CREAT | O_TRUNC))) {
+        vm->stats.open_syscalls++;
+        return open_shared_file(name, file->flags, file->mode);
+    }
 
-int wait_for_read_status(struct guest* vm, uint32_t data, void* data_offset) {
-    if (vm->kvm_run->io.direction != KVM_EXIT_IO_IN || vm->kvm_run->io.size != sizeof(uint32_t)) {
-        perror("GRESKA: Vm nije ispostovan protokol\n");
+    if (!(file->flags & O_CREAT)) {
+        errno = ENOENT;
         return -1;
     }
 
-    void* addr = virtual_to_physical_add(vm, vm->current_file->addr);
-    int status = read(vm->current_file->fd, addr, vm->current_file->size);
+    if (sandbox_copy_shared(vm, name) < 0) return -1;
+    if (entry) entry->exists = 1;
+    return sandbox_openat(vm, name, file->flags, file->mode);
+}
+
+//  Ogranicenje protoka fajl operacija
+//
+//  Svaki gost ima svoje kofe za bajtove i operacije (READ, WRITE, COPY i
+//  STREAM_*), a deljeni fajl moze imati zajednicke za sve goste. Pre
+//  prenosa nit ceka dok obe kofe (gosta i fajla) ne izadju iz minusa,
+//  a posle prenosa se naplacuje stvarno preneto. Veliki zahtev se zato
+//  ne deli, njegov dug zadrzava sledeci. Ceka samo nit koja je poslala
+//  zahtev, pa ostali gosti rade nesmetano
+#define IO_THROTTLE_SLICE_NS (10 * 1000000UL)
+
+//  Ogranicenje za goste sa datim id-em, -1 za sve
+struct guest_limit {
+    int id;
+    struct io_limit limit;
+};
+
+struct file_limit {
+    const char* name;
+    struct io_limit limit;
+};
+
+struct guest_limit* guest_limits = NULL;
+int guest_limit_count = 0;
+struct file_limit* file_limits = NULL;
+int file_limit_count = 0;
+
+//  Cita MB_PO_S:OPS_PO_S[:BURST_MB:BURST_OPS], 0 je bez ogranicenja, a
+//  podrazumevani burst je desetina sekunde
+int parse_io_limit(const char* spec, struct io_limit* limit) {
+    double values[4] = {0, 0, -1, -1};
+    char* end = (char*) spec;
+
+    for (int i = 0; i < 4; i++) {
+        values[i] = strtod(end, &end);
+        if (*end != ':') break;
+        end++;
+    }
+    if (*end != '\0' || values[0] < 0 || values[1] < 0) {
+        return -1;
+    }
+
+    memset(limit, 0, sizeof(*limit));
+    pthread_mutex_init(&limit->lock, NULL);
+    limit->bytes.rate = values[0] * 1024 * 1024;
+    limit->bytes.burst = values[2] >= 0 ? values[2] * 1024 * 1024 : limit->bytes.rate / 10;
+    limit->ops.rate = values[1];
+    limit->ops.burst = values[3] >= 0 ? values[3] : limit->ops.rate / 10;
+    limit->bytes.tokens = limit->bytes.burst;
+    limit->ops.tokens = limit->ops.burst;
+    limit->bytes.last_ns = limit->ops.last_ns = now_ns();
+    return 0;
+}
+
+//  --io-limit [ID=]SPEC (bez ID-a za sve goste) i --file-limit IME=SPEC
+int add_io_limit(char* arg, int per_file) {
+    char* spec = strrchr(arg, '=');
+    struct io_limit limit;
+
+    if ((per_file && spec == NULL) || parse_io_limit(spec ? spec + 1 : arg, &limit) < 0) {
+        return -1;
+    }
+
+    if (per_file) {
+        *spec = '\0';
+        file_limits = realloc(file_limits, sizeof(struct file_limit) * (file_limit_count + 1));
+        file_limits[file_limit_count].name = arg;
+        file_limits[file_limit_count++].limit = limit;
+    } else {
+        guest_limits = realloc(guest_limits, sizeof(struct guest_limit) * (guest_limit_count + 1));
+        guest_limits[guest_limit_count].id = spec ? atoi(arg) : -1;
+        guest_limits[guest_limit_count++].limit = limit;
+    }
+    return 0;
+}
+
+//  Sa --workers svaki proces ima svoje kofe za deljeni fajl, pa svaki
+//  dobija jednak deo zadatog protoka i bursta i zbir ostaje --file-limit
+void file_limits_divide(int parts) {
+    for (int i = 0; i < file_limit_count; i++) {
+        struct bucket* buckets[] = {&file_limits[i].limit.bytes, &file_limits[i].limit.ops};
+        for (int j = 0; j < 2; j++) {
+            buckets[j]->rate /= parts;
+            buckets[j]->burst /= parts;
+            buckets[j]->tokens = buckets[j]->burst;
+        }
+    }
+}
+
+//  Ogranicenje gosta: poslednje --io-limit za njegov id ili za sve
+void io_limit_init(struct guest* vm) {
+    memset(&vm->io_limit, 0, sizeof(vm->io_limit));
+
+    for (int i = 0; i < guest_limit_count; i++) {
+        if (guest_limits[i].id < 0 || guest_limits[i].id == vm->id) {
+            vm->io_limit = guest_limits[i].limit;
+        }
+    }
+    pthread_mutex_init(&vm->io_limit.lock, NULL);
+}
+
+struct io_limit* file_limit(const char* name) {
+    for (int i = 0; i < file_limit_count; i++) {
+        if (strcmp(file_limits[i].name, name) == 0) return &file_limits[i].limit;
+    }
+    return NULL;
+}
+
+int io_limited(struct io_limit* limit) {
+    return limit && (limit->bytes.rate > 0 || limit->ops.rate > 0);
+}
+
+//  Dopunjava kofu i vraca koliko jos treba cekati da izadje iz minusa
+uint64_t bucket_wait(struct bucket* bucket, uint64_t now) {
+    if (bucket->rate <= 0) return 0;
+
+    bucket->tokens += (double) (now - bucket->last_ns) * bucket->rate / 1e9;
+    if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+    bucket->last_ns = now;
+    return bucket->tokens < 0 ? (uint64_t) (-bucket->tokens / bucket->rate * 1e9) : 0;
+}
+
+uint64_t io_limit_wait(struct io_limit* limit, uint64_t now) {
+    if (!io_limited(limit)) return 0;
+
+    pthread_mutex_lock(&limit->lock);
+    uint64_t bytes = bucket_wait(&limit->bytes, now);
+    uint64_t ops = bucket_wait(&limit->ops, now);
+    pthread_mutex_unlock(&limit->lock);
+    return bytes > ops ? bytes : ops;
+}
+
+void io_limit_count(struct io_limit* limit, uint64_t wait, uint64_t slept) {
+    if (wait == 0) return;
+
+    pthread_mutex_lock(&limit->lock);
+    limit->throttled++;
+    limit->throttled_ns += wait < slept ? wait : slept;
+    pthread_mutex_unlock(&limit->lock);
+}
+
+void io_limit_charge(struct io_limit* limit, uint64_t bytes, uint64_t ops) {
+    if (!io_limited(limit)) return;
+
+    pthread_mutex_lock(&limit->lock);
+    if (limit->bytes.rate > 0) limit->bytes.tokens -= bytes;
+    if (limit->ops.rate > 0) limit->ops.tokens -= ops;
+    pthread_mutex_unlock(&limit->lock);
+}
+
+//  Ceka dok ogranicenja gosta i fajla ne dozvole sledeci zahtev. Nit
+//  virtuelnog procesora prestaje da ceka kad gost treba da stane ili
+//  se pauzira, a nit prenosa kad se prenos zaustavlja; dug tada ostaje
+//  u kofi i placa ga sledeci zahtev
+void io_throttle(struct guest* vm, struct io_limit* limit, int in_stream) {
+    uint64_t start = now_ns();
+    uint64_t guest_wait = io_limit_wait(&vm->io_limit, start);
+    uint64_t file_wait = io_limit_wait(limit, start);
+    uint64_t end = start + (guest_wait > file_wait ? guest_wait : file_wait);
+    uint64_t now = start;
+
+    if (end == start) return;
+
+    while (now < end) {
+        if (in_stream ? atomic_load(&vm->stream.stop) : (atomic_load(&vm->kicks) & (KICK_STOP | KICK_PAUSE)) != 0) break;
+
+        struct timespec until;
+        uint64_t wake = end - now < IO_THROTTLE_SLICE_NS ? end : now + IO_THROTTLE_SLICE_NS;
+        until.tv_sec = wake / 1000000000UL;
+        until.tv_nsec = wake % 1000000000UL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+        now = now_ns();
+    }
+
+    io_limit_count(&vm->io_limit, guest_wait, now - start);
+    if (limit) io_limit_count(limit, file_wait, now - start);
+}
+
+void io_charge(struct guest* vm, struct io_limit* limit, int64_t bytes, uint64_t ops) {
+    io_limit_charge(&vm->io_limit, bytes > 0 ? bytes : 0, ops);
+    io_limit_charge(limit, bytes > 0 ? bytes : 0, ops);
+}
+
+void write_io_limit(FILE* out, struct io_limit* limit) {
+    fprintf(out, "{\"bytes_per_s\": %.0f, \"ops_per_s\": %.0f, \"throttled\": %" PRIu64 ", \"throttled_ns\": %" PRIu64 "}",
+        limit->bytes.rate, limit->ops.rate, limit->throttled, limit->throttled_ns);
+}
+
+int wait_for_mode(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+   
+    vm->current_file->mode = data;
+    vm->current_file->fd = sandbox_open(vm, vm->current_file);
+    if (is_shared_file(vm->current_file->ime)) {
+        vm->current_file->limit = file_limit(vm->current_file->ime);
+    }
+
+    vm->current_file_state = &return_fd_to_vm;
+    return 0;
+}
+
+int wait_for_flag(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    vm->current_file->flags = data;
+    vm->current_file_state = &wait_for_mode;
+
+    return 0;
+}
+
+int reading_name(struct guest* vm, uint32_t data, void* data_offset) {
+
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint8_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    char c = (char) (data & 0xFF);
+    struct file* file = vm->current_file;
+
+    //  Ime raste po potrebi do PATH_MAX, duze ime se cita do kraja ali
+    //  se ne pamti, pa otvaranje vraca ENAMETOOLONG
+    if (file->cnt == file->ime_size && file->ime_size < PATH_MAX) {
+        size_t size = file->ime_size * 2 < PATH_MAX ? file->ime_size * 2 : PATH_MAX;
+        char* ime = malloc(size);
+        if (ime == NULL) {
+            printf("GRESKA: Alokacija nije uspela\n");
+            return -1;
+        }
+
+        memcpy(ime, file->ime, file->cnt);
+        if (file->ime != file->ime_inline) free(file->ime);
+        file->ime = ime;
+        file->ime_size = size;
+    }
+
+    file->ime[file->cnt < file->ime_size ? file->cnt : file->ime_size - 1] = c;
+    file->cnt++;
+
+    if (c != '\0') {
+        vm->current_file_state = &reading_name;
+    } else {
+        vm->current_file_state = &wait_for_flag;
+    }
+
+    return 0;
+}
+
+//  Najveci broj bajtova koji Linux prenosi jednim read/write pozivom
+#define TRANSFER_MAX 0x7ffff000UL
+#define TRANSFER_IOV 64
+
+//  Cita ili pise do len bajtova izmedju fd-a i bafera gosta na virtuelnoj
+//  adresi addr. Bafer se prevodi stranicu po stranicu u iovec (susedne
+//  stranice se spajaju), pa ne mora biti fizicki neprekidan i ne moze
+//  izaci iz memorije gosta. Vraca broj prenetih bajtova ili -1
+//  SIG_KICK nema SA_RESTART, da bi stop_guest prekinuo i blokirajuci
+//  poziv u obradi izlaska. Poziv prekinut zbog pauze (core dump),
+//  profila ili kvote se ponavlja, a oni se obradjuju na sledecem izlasku
+int kick_retry(struct guest* vm) {
+    return errno == EINTR && !(atomic_load(&vm->kicks) & KICK_STOP);
+}
+
+ssize_t guest_transfer(struct guest* vm, int fd, uint64_t addr, uint64_t len, int is_write) {
+    struct iovec iov[TRANSFER_IOV];
+    uint64_t total = 0;
+    int count = 0;
+
+    if (len > TRANSFER_MAX) len = TRANSFER_MAX;
+
+    while (total < len) {
+        uint64_t chunk = PAGE_SIZE - PAGE4KB_OFFSET(addr + total);
+        if (chunk > len - total) chunk = len - total;
+
+        char* host = guest_range(vm, addr + total, chunk);
+        if (host == NULL) break;
+
+        if (count && (char*) iov[count - 1].iov_base + iov[count - 1].iov_len == host) {
+            iov[count - 1].iov_len += chunk;
+        } else if (count < TRANSFER_IOV) {
+            iov[count].iov_base = host;
+            iov[count++].iov_len = chunk;
+        } else {
+            break;
+        }
+        total += chunk;
+    }
+
+    if (count == 0) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = is_write ? writev(fd, iov, count) : readv(fd, iov, count);
+    } while (n < 0 && kick_retry(vm));
+    uint64_t left = !is_write && n > 0 ? n : 0;
+    for (int i = 0; i < count && left > 0; i++) {
+        uint64_t marked = iov[i].iov_len < left ? iov[i].iov_len : left;
+        guest_mark_dirty(vm, iov[i].iov_base, marked);
+        left -= marked;
+    }
+    return n;
+}
+
+int wait_for_read_status(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_IN || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    io_throttle(vm, vm->current_file->limit, 0);
+    int status = guest_transfer(vm, vm->current_file->fd, vm->current_file->addr, vm->current_file->size, 0);
+    io_charge(vm, vm->current_file->limit, status, 1);
     *((int*) data_offset) = status; 
+    if (status > 0) vm->stats.bytes_read += status;
     return end_file_operation(vm);
 
 }
@@ -535,9 +1506,229 @@ int wait_for_write_status(struct guest* vm, u_int32_t data, void* data_offset) {
         return -1;
     }
 
-    void* addr = virtual_to_physical_add(vm, vm->current_file->addr);
-    int status = write(vm->current_file->fd, addr, vm->current_file->size);
+    io_throttle(vm, vm->current_file->limit, 0);
+    int status = guest_transfer(vm, vm->current_file->fd, vm->current_file->addr, vm->current_file->size, 1);
+    io_charge(vm, vm->current_file->limit, status, 1);
     *((int*) data_offset) = status;
+    if (status > 0) vm->stats.bytes_written += status;
+    return end_file_operation(vm);
+}
+
+//  Kopira count bajtova (ili do kraja fajla) iz in u out bez prolaska
+//  kroz memoriju gosta. copy_file_range radi u kernelu (na nekim
+//  fajl sistemima i bez kopiranja podataka), sendfile pokriva slucajeve
+//  koje on ne podrzava, a citanje i upis su poslednja mogucnost
+int64_t copy_between_fds(int in, int out, uint64_t count) {
+    uint64_t copied = 0;
+    int method = 0;
+
+    while (copied < count) {
+        size_t chunk = count - copied > 0x40000000UL ? 0x40000000UL : count - copied;
+        ssize_t n;
+
+        if (method == 0) {
+            n = copy_file_range(in, NULL, out, NULL, chunk, 0);
+        } else if (method == 1) {
+            n = sendfile(out, in, NULL, chunk);
+        } else {
+            char buffer[65536];
+            n = read(in, buffer, chunk < sizeof(buffer) ? chunk : sizeof(buffer));
+            if (n > 0 && write(out, buffer, n) != n) n = -1;
+        }
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && method < 2 && copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            method++;
+            continue;
+        }
+        if (n < 0) return copied > 0 ? (int64_t) copied : -1;
+        if (n == 0) break;
+        copied += n;
+    }
+
+    return copied;
+}
+
+//  Prvo citanje izvrsava kopiranje i vraca donju polovinu rezultata,
+//  drugo vraca gornju. Rezultat je broj kopiranih bajtova ili -1
+int wait_for_copy_status(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_IN || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    io_throttle(vm, vm->current_file->limit, 0);
+    int64_t status = copy_between_fds(vm->current_file->fd, (int) vm->current_file->addr, vm->current_file->size);
+    io_charge(vm, vm->current_file->limit, status, 1);
+    if (status > 0) {
+        vm->stats.bytes_read += status;
+        vm->stats.bytes_written += status;
+    }
+
+    vm->current_file->size = (uint64_t) status;
+    *((uint32_t*) data_offset) = (uint32_t) status;
+    vm->current_file_state = &wait_for_copy_status_high;
+    return 0;
+}
+
+int wait_for_copy_status_high(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_IN || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    *((uint32_t*) data_offset) = (uint32_t) (vm->current_file->size >> 32);
+    return end_file_operation(vm);
+}
+
+//  Kod COPY operacije posle izvornog fd-a dolazi odredisni, cuva se u addr
+int wait_for_copy_fd(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    struct file* source = vm->current_file;
+    get_file_descriptor(vm, data);
+    if (vm->current_file == source && source->fd != (int) data) {
+        perror("GRESKA: Vm: nepostoji file deskriptor\n");
+        return -1;
+    }
+
+    source->addr = data;
+    vm->current_file = source;
+    vm->current_file_state = &wait_for_first_size_half;
+    return 0;
+}
+
+#define STREAM_CHUNK (1024 * 1024UL)
+#define STREAM_PENDING (1UL << 63)
+#define STREAM_POLL_NS (10 * 1000000UL)
+
+void* stream_thread(void* par) {
+    struct stream* stream = (struct stream*) par;
+    uint64_t done = 0;
+    int error = 0;
+
+    while (done < stream->size && !atomic_load(&stream->stop)) {
+        uint64_t chunk = stream->size - done < STREAM_CHUNK ? stream->size - done : STREAM_CHUNK;
+
+        io_throttle(stream->vm, stream->limit, 1);
+        if (atomic_load(&stream->stop)) break;
+        pthread_mutex_lock(&stream->transfer);
+        ssize_t n = guest_transfer(stream->vm, stream->fd, stream->addr + done, chunk, stream->is_write);
+        pthread_mutex_unlock(&stream->transfer);
+        io_charge(stream->vm, stream->limit, n, done == 0);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            error = n < 0 ? errno : 0;
+            break;
+        }
+
+        done += n;
+        pthread_mutex_lock(&stream->lock);
+        stream->done = done;
+        pthread_cond_signal(&stream->progress);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    stream->error = error;
+    stream->finished = 1;
+    pthread_cond_signal(&stream->progress);
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+//  Zaustavlja nit prenosa posle tekuceg dela i ceka je
+void stream_join(struct stream* stream) {
+    if (!stream->active) return;
+
+    atomic_store(&stream->stop, 1);
+    pthread_join(stream->thread, NULL);
+    stream->active = 0;
+}
+
+int stream_start(struct guest* vm) {
+    struct stream* stream = &vm->stream;
+
+    stream_join(stream);
+    stream->vm = vm;
+    stream->fd = vm->current_file->fd;
+    stream->limit = vm->current_file->limit;
+    stream->is_write = vm->lock == STREAM_WRITE;
+    stream->addr = vm->current_file->addr;
+    stream->size = vm->current_file->size;
+    stream->done = 0;
+    stream->reported = 0;
+    stream->finished = 0;
+    stream->error = 0;
+    atomic_store(&stream->stop, 0);
+
+    if (pthread_create(&stream->thread, NULL, &stream_thread, stream) != 0) {
+        perror("GRESKA: Nije moguce pokrenuti nit za prenos\n");
+        return -1;
+    }
+    stream->active = 1;
+    return 0;
+}
+
+//  Ceka sledeci deo prenosa i vraca donju polovinu stanja. Ceka se u
+//  koracima od STREAM_POLL_NS da bi zahtevi iz kicks (stop, pauza,
+//  kvota) stigli na red; tada gost dobija isto stanje i pita ponovo
+int wait_for_stream_status(struct guest* vm, uint32_t data, void* data_offset) {
+    struct stream* stream = &vm->stream;
+
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_IN || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->finished && stream->done == stream->reported && atomic_load(&vm->kicks) == 0) {
+        struct timespec until;
+        uint64_t wake = now_ns() + STREAM_POLL_NS;
+        until.tv_sec = wake / 1000000000UL;
+        until.tv_nsec = wake % 1000000000UL;
+        pthread_cond_clockwait(&stream->progress, &stream->lock, CLOCK_MONOTONIC, &until);
+    }
+    uint64_t done = stream->done;
+    int finished = stream->finished;
+    int error = stream->error;
+    pthread_mutex_unlock(&stream->lock);
+
+    if (stream->is_write) {
+        vm->stats.bytes_written += done - stream->reported;
+    } else {
+        vm->stats.bytes_read += done - stream->reported;
+    }
+    stream->reported = done;
+
+    stream->status = done;
+    if (!finished) {
+        stream->status |= STREAM_PENDING;
+    } else {
+        stream_join(stream);
+        if (done == 0 && error) stream->status = (uint64_t) -1;
+    }
+
+    *((uint32_t*) data_offset) = (uint32_t) stream->status;
+    vm->current_file_state = &wait_for_stream_status_high;
+    return 0;
+}
+
+int wait_for_stream_status_high(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_IN || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    *((uint32_t*) data_offset) = (uint32_t) (vm->stream.status >> 32);
+    if (vm->stream.status != (uint64_t) -1 && (vm->stream.status & STREAM_PENDING)) {
+        vm->current_file_state = &wait_for_stream_status;
+        return 0;
+    }
     return end_file_operation(vm);
 }
 
@@ -550,6 +1741,11 @@ int wait_for_second_size_half(struct guest* vm, uint32_t data, void* data_offset
     vm->current_file->size |= ((uint64_t) data << 32);
     if (vm->lock == READ) {
         vm->current_file_state = &wait_for_read_status;
+    } else if (vm->lock == COPY) {
+        vm->current_file_state = &wait_for_copy_status;
+    } else if (vm->lock == STREAM_READ || vm->lock == STREAM_WRITE) {
+        vm->current_file_state = &wait_for_stream_status;
+        return stream_start(vm);
     } else {
         vm->current_file_state = &wait_for_write_status;
     }
@@ -568,6 +1764,30 @@ int wait_for_first_size_half(struct guest* vm, uint32_t data, void* data_offset)
     return 0;
 }
 
+//  Kod LSEEK operacije addr je pomeraj, a size nacin pomeranja (whence).
+//  Gostu se vraca nova pozicija, ogranicena na INT_MAX, ili -1
+int wait_for_seek_status(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_IN || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    off_t offset = lseek(vm->current_file->fd, (off_t) vm->current_file->addr, (int) vm->current_file->size);
+    *((int*) data_offset) = offset < 0 ? -1 : (offset > INT32_MAX ? INT32_MAX : (int) offset);
+    return end_file_operation(vm);
+}
+
+int wait_for_whence(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    vm->current_file->size = data;
+    vm->current_file_state = &wait_for_seek_status;
+    return 0;
+}
+
 int wait_for_second_addr_half(struct guest* vm, uint32_t data, void* data_offset) {
     if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
         perror("GRESKA: Vm nije ispostovan protokol\n");
@@ -575,7 +1795,11 @@ int wait_for_second_addr_half(struct guest* vm, uint32_t data, void* data_offset
     }
 
     vm->current_file->addr |= ((uint64_t)data << 32);
-    vm->current_file_state = &wait_for_first_size_half;
+    if (vm->lock == LSEEK) {
+        vm->current_file_state = &wait_for_whence;
+    } else {
+        vm->current_file_state = &wait_for_first_size_half;
+    }
     return 0;
 }
 
@@ -598,6 +1822,10 @@ int wait_for_close_status(struct guest* vm, uint32_t data, void* data_offset) {
         return -1;
     }
 
+    if (vm->stream.active && vm->stream.fd == vm->current_file->fd) {
+        stream_join(&vm->stream);
+    }
+
     int status = close(vm->current_file->fd);
     *((int*) data_offset) = status;
 
@@ -608,6 +1836,9 @@ int wait_for_close_status(struct guest* vm, uint32_t data, void* data_offset) {
         }
     }
 
+    if (vm->current_file->ime != vm->current_file->ime_inline) {
+        free(vm->current_file->ime);
+    }
     free(vm->current_file);
 
     return end_file_operation(vm);
@@ -627,8 +1858,10 @@ int wait_for_fd(struct guest* vm, uint32_t data, void* data_offset) {
         return -1;
     }
 
-    if (vm->lock == READ || vm->lock == WRITE) {
+    if (vm->lock == READ || vm->lock == WRITE || vm->lock == LSEEK || vm->lock == STREAM_READ || vm->lock == STREAM_WRITE) {
         vm->current_file_state = &wait_for_first_addr_half;
+    } else if (vm->lock == COPY) {
+        vm->current_file_state = &wait_for_copy_fd;
     } else if (vm->lock == CLOSE) {
         vm->current_file_state = &wait_for_close_status;
     }
@@ -638,6 +1871,9 @@ int wait_for_fd(struct guest* vm, uint32_t data, void* data_offset) {
 
 int start_file_operation(struct guest* vm, uint32_t operation, void* data_offset) {
     vm->lock = operation;
+    if (operation < FILE_OPS) {
+        vm->stats.file_ops[operation]++;
+    }
 
     if (operation == OPEN) {
         struct file* new_file = init_file(); 
@@ -660,165 +1896,4332 @@ int handle_file(struct guest* vm) {
     return vm->current_file_state(vm, data, data_offset);
 }
 
-int exit_io(struct guest* vm) {
-    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT && vm->kvm_run->io.port == 0xE9) {
-        char c = *((char*)vm->kvm_run + vm->kvm_run->io.data_offset);
-        write(vm->pty_master, &c, vm->kvm_run->io.size);
-        return 0;
-    } else if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN && vm->kvm_run->io.port == 0xE9) {
-        char c;
-        read(vm->pty_master, &c, sizeof(char));
-        *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = c;
-        return 0;
-    } else if (vm->kvm_run->io.port == 0x278) {
-        handle_file(vm);
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+//  Putanja iz --disk, --core i --log: prvo %d se zamenjuje id-em gosta,
+//  a sve ostalo (i drugi znaci %) se prepisuje doslovno. Putanja nije
+//  format za printf, pa --disk '%s' ne cita sa steka
+int guest_path(char* path, size_t size, const char* format, int id) {
+    const char* mark = strstr(format, "%d");
+    int n;
+
+    if (mark == NULL) {
+        n = snprintf(path, size, "%s", format);
     } else {
-        fprintf(stderr, "Invalid port %d\n", vm->kvm_run->io.port);
+        n = snprintf(path, size, "%.*s%d%s", (int) (mark - format), format, id, mark + 2);
+    }
+
+    if (n < 0 || (size_t) n >= size) {
+        fprintf(stderr, "GRESKA: Putanja %s je preduga\n", format);
         return -1;
     }
+    return 0;
 }
 
-int exit_internal_error(struct guest* vm) {
-    printf("GRESKA: Interna greska: podgreska = 0x%x\n", vm->kvm_run->internal.suberror);
-    return -1;
+int hist_index(uint64_t value) {
+    if (value < HIST_SUB) {
+        return value;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((value >> shift) & (HIST_SUB - 1));
+}
+
+//  Najveca vrednost koja upada u korpu index
+uint64_t hist_bucket_upper(int index) {
+    if (index < HIST_SUB) {
+        return index;
+    }
+
+    int shift = index / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (HIST_SUB + index % HIST_SUB) << shift;
+    return low + (1UL << shift) - 1;
+}
+
+void hist_record(struct histogram* hist, uint64_t value) {
+    if (hist->count == 0 || value < hist->min) hist->min = value;
+    if (value > hist->max) hist->max = value;
+    hist->count++;
+    hist->sum += value;
+    hist->buckets[hist_index(value)]++;
+}
+
+uint64_t hist_percentile(struct histogram* hist, double percentile) {
+    uint64_t rank = (uint64_t) (hist->count * percentile / 100.0);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            uint64_t upper = hist_bucket_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+uint64_t total_exits(struct vcpu_stats* stats) {
+    uint64_t exits = 0;
+
+    for (int i = 0; i < EXIT_REASONS; i++) {
+        exits += stats->exits[i];
+    }
+
+    return exits;
+}
+
+uint64_t hypervisor_start_ns = 0;
+
+//  Vreme u odnosu na pokretanje hipervizora, 0 ako dogadjaj nije nastupio
+uint64_t relative_ns(uint64_t timestamp) {
+    return timestamp ? timestamp - hypervisor_start_ns : 0;
+}
+
+void stats_record_port(struct vcpu_stats* stats, uint16_t port, int direction) {
+    struct port_stats* entry = &stats->ports[0];
+
+    for (int i = 1; i < STAT_PORTS; i++) {
+        if (stats->ports[i].port == port) {
+            entry = &stats->ports[i];
+            break;
+        }
+        if (stats->ports[i].port == 0) {
+            stats->ports[i].port = port;
+            entry = &stats->ports[i];
+            break;
+        }
+    }
+
+    if (direction == KVM_EXIT_IO_IN) {
+        entry->in++;
+    } else {
+        entry->out++;
+    }
+}
+
+//  Balon uredjaj na portu BALLOON_PORT
+//
+//  Gost javlja opseg svojih virtuelnih adresa koji vise ne koristi
+//  (BALLOON_INFLATE), a hipervizor fizicke stranice iz tog opsega
+//  vraca domacinu. BALLOON_DEFLATE javlja da gost ponovo koristi opseg,
+//  a BALLOON_TARGET vraca broj stranica koje hipervizor zeli da gost
+//  drzi u balonu. Adrese i velicine se salju kao dve 32-bitne polovine,
+//  a rezultat je broj obradjenih stranica.
+int balloon_start(struct guest*, uint32_t, void*);
+
+int end_balloon_operation(struct guest* vm) {
+    vm->balloon_state = &balloon_start;
+    vm->balloon_lock = 0;
+    return 0;
+}
+
+//  Vraca domacinu fizicke stranice gosta u opsegu [start, end).
+//  Memorija gosta je deljeni memfd pa samo MADV_REMOVE
+//  zaista oslobadja stranice, MADV_DONTNEED je rezervna varijanta
+void balloon_release_range(struct guest* vm, uint64_t start, uint64_t end) {
+    guest_mark_dirty(vm, vm->mem + start, end - start);
+    if (madvise(vm->mem + start, end - start, MADV_REMOVE) < 0) {
+        madvise(vm->mem + start, end - start, MADV_DONTNEED);
+    }
+}
+
+//  Prolazi kroz cele stranice zadatog opsega, preskace tabele stranica
+//  i nemapirane adrese, a susedne fizicke stranice oslobadja zajedno
+uint64_t balloon_walk(struct guest* vm, int inflate) {
+    uint64_t start = (vm->balloon_addr + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = vm->balloon_addr + vm->balloon_size;
+    uint64_t run_start = 0, run_end = 0, pages = 0;
+
+    if (end < vm->balloon_addr || end > vm->mem_size) {
+        end = vm->mem_size;
+    }
+    end &= ~(uint64_t)(PAGE_SIZE - 1);
+
+    for (uint64_t addr = start; addr < end; addr += PAGE_SIZE) {
+        char* host = virtual_to_physical_add(vm, addr);
+        if (host == NULL) continue;
+
+        uint64_t phys = host - vm->mem;
+        if (phys < vm->reserved_size || phys + PAGE_SIZE > vm->mem_size) continue;
+        pages++;
+
+        if (!inflate) continue;
+        if (run_end != run_start && run_end == phys) {
+            run_end += PAGE_SIZE;
+            continue;
+        }
+        if (run_end != run_start) {
+            balloon_release_range(vm, run_start, run_end);
+        }
+        run_start = phys;
+        run_end = phys + PAGE_SIZE;
+    }
+
+    if (inflate && run_end != run_start) {
+        balloon_release_range(vm, run_start, run_end);
+    }
+
+    return pages;
+}
+
+int balloon_status(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_IN || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    uint64_t pages;
+    if (vm->balloon_lock == BALLOON_INFLATE) {
+        pages = balloon_walk(vm, 1);
+        vm->balloon_pages += pages;
+    } else if (vm->balloon_lock == BALLOON_DEFLATE) {
+        pages = balloon_walk(vm, 0);
+        vm->balloon_pages -= (pages < vm->balloon_pages) ? pages : vm->balloon_pages;
+    } else {
+        pages = vm->balloon_target;
+    }
+
+    *((uint32_t*) data_offset) = (uint32_t) pages;
+    return end_balloon_operation(vm);
+}
+
+int balloon_second_size_half(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    vm->balloon_size |= ((uint64_t) data << 32);
+    vm->balloon_state = &balloon_status;
+    return 0;
+}
+
+int balloon_first_size_half(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    vm->balloon_size = data;
+    vm->balloon_state = &balloon_second_size_half;
+    return 0;
+}
+
+int balloon_second_addr_half(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    vm->balloon_addr |= ((uint64_t) data << 32);
+    vm->balloon_state = &balloon_first_size_half;
+    return 0;
+}
+
+int balloon_first_addr_half(struct guest* vm, uint32_t data, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    vm->balloon_addr = data;
+    vm->balloon_state = &balloon_second_addr_half;
+    return 0;
+}
+
+int balloon_start(struct guest* vm, uint32_t operation, void* data_offset) {
+    if (vm->kvm_run->io.direction != KVM_EXIT_IO_OUT || vm->kvm_run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    vm->balloon_lock = operation;
+
+    if (operation == BALLOON_INFLATE || operation == BALLOON_DEFLATE) {
+        vm->balloon_state = &balloon_first_addr_half;
+    } else if (operation == BALLOON_TARGET) {
+        vm->balloon_state = &balloon_status;
+    } else {
+        fprintf(stderr, "GRESKA: Nepoznata balon operacija %u\n", operation);
+        return -1;
+    }
+
+    return 0;
+}
+
+int handle_balloon(struct guest* vm) {
+
+    void* data_offset = (char*)vm->kvm_run + vm->kvm_run->io.data_offset;
+    uint32_t data = *((uint32_t*) data_offset);
+
+    return vm->balloon_state(vm, data, data_offset);
+}
+
+//  Vraca broj stranica memorije gosta koje su trenutno
+//  rezidentne kod domacina
+uint64_t guest_rss_pages(struct guest* vm) {
+    size_t pages = vm->mem_size / PAGE_SIZE;
+    unsigned char* vec = malloc(pages);
+    uint64_t resident = 0;
+
+    if (vec == NULL || mincore(vm->mem, vm->mem_size, vec) < 0) {
+        free(vec);
+        return 0;
+    }
+
+    for (size_t i = 0; i < pages; i++) {
+        resident += vec[i] & 1;
+    }
+
+    free(vec);
+    return resident;
+}
+
+//  Spisak gostiju. Bez demona se ne menja posle pokretanja, a demon
+//  (--daemon) ga menja pod guests_lock, pa ga pod njim i citaju niti
+//  koje rade dok gosti dolaze i odlaze
+struct guest** guests;
+int guest_count = 0;
+pthread_mutex_t guests_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t overcommit_limit = 0;
+
+//  Periodicno meri RSS svih gostiju i, ako je zbir veci od
+//  --overcommit granice, visak raspodeljuje gostima srazmerno
+//  njihovom RSS-u kao novi cilj balona. Kada ima dovoljno mesta,
+//  ciljevi se smanjuju pa gosti mogu da vrate memoriju iz balona
+void* balloon_monitor(void* par) {
+
+    uint64_t limit = overcommit_limit / PAGE_SIZE;
+
+    for (;;) {
+        uint64_t total = 0;
+
+        pthread_mutex_lock(&guests_lock);
+        for (int i = 0; i < guest_count; i++) {
+            guests[i]->rss_pages = guest_rss_pages(guests[i]);
+            total += guests[i]->rss_pages;
+        }
+
+        for (int i = 0; limit && total && i < guest_count; i++) {
+            struct guest* vm = guests[i];
+            uint64_t target = vm->balloon_target;
+
+            if (total > limit) {
+                target = vm->balloon_pages + (total - limit) * vm->rss_pages / total;
+            } else if (total < limit - limit / 10) {
+                uint64_t headroom = (limit - total) * vm->rss_pages / total;
+                target = vm->balloon_pages - (headroom < vm->balloon_pages ? headroom : vm->balloon_pages);
+            }
+
+            if (target != vm->balloon_target) {
+                fprintf(stderr, "vm%d: rss %" PRIu64 " KB, balon %" PRIu64 " KB, cilj %" PRIu64 " KB\n",
+                    vm->id, vm->rss_pages * 4, vm->balloon_pages * 4, target * 4);
+                vm->balloon_target = target;
+            }
+        }
+        pthread_mutex_unlock(&guests_lock);
+
+        usleep(100000);
+    }
+
+    return NULL;
+}
+
+static const char* exit_reason_names[EXIT_REASONS] = {
+    [KVM_EXIT_UNKNOWN] = "unknown", [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io", [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug", [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio", [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq_window_open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown", [KVM_EXIT_FAIL_ENTRY] = "fail_entry",
+    [KVM_EXIT_INTR] = "intr", [KVM_EXIT_SET_TPR] = "set_tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr_access", [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal_error", [KVM_EXIT_SYSTEM_EVENT] = "system_event",
+    [KVM_EXIT_X86_RDMSR] = "x86_rdmsr", [KVM_EXIT_X86_WRMSR] = "x86_wrmsr",
+};
+
+static const char* file_op_names[FILE_OPS] = {
+    "finish", "open", "close", "read", "write", "lseek", "copy", "stream_read", "stream_write"
+};
+
+void write_histogram(FILE* out, const char* name, struct histogram* hist) {
+    fprintf(out, "\"%s\": {\"count\": %" PRIu64 ", \"min\": %" PRIu64 ", \"max\": %" PRIu64
+        ", \"mean\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+        ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"buckets\": [",
+        name, hist->count, hist->min, hist->max, hist->count ? hist->sum / hist->count : 0,
+        hist_percentile(hist, 50), hist_percentile(hist, 90),
+        hist_percentile(hist, 99), hist_percentile(hist, 99.9));
+
+    const char* sep = "";
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (hist->buckets[i]) {
+            fprintf(out, "%s[%" PRIu64 ", %" PRIu64 "]", sep, hist_bucket_upper(i), hist->buckets[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(out, "]}");
+}
+
+//  Ispisuje statistiku koju vodi KVM (KVM_GET_STATS_FD) kao JSON objekat.
+//  Skalarne vrednosti se ispisuju kao brojevi, a histogrami kao nizovi
+void write_kvm_stats(FILE* out, int fd) {
+    struct kvm_stats_header header;
+
+    fprintf(out, "{");
+    if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        fprintf(out, "}");
+        return;
+    }
+
+    size_t desc_size = sizeof(struct kvm_stats_desc) + header.name_size;
+    char* descs = malloc(desc_size * header.num_desc);
+    if (descs == NULL || pread(fd, descs, desc_size * header.num_desc, header.desc_offset) < 0) {
+        free(descs);
+        fprintf(out, "}");
+        return;
+    }
+
+    for (uint32_t i = 0; i < header.num_desc; i++) {
+        struct kvm_stats_desc* desc = (struct kvm_stats_desc*) (descs + i * desc_size);
+        uint64_t values[desc->size];
+
+        if (pread(fd, values, sizeof(uint64_t) * desc->size, header.data_offset + desc->offset) < 0) {
+            continue;
+        }
+
+        fprintf(out, "%s\"%s\": ", i ? ", " : "", desc->name);
+        if (desc->size == 1) {
+            fprintf(out, "%" PRIu64, values[0]);
+        } else {
+            fprintf(out, "[");
+            for (int j = 0; j < desc->size; j++) {
+                fprintf(out, "%s%" PRIu64, j ? ", " : "", values[j]);
+            }
+            fprintf(out, "]");
+        }
+    }
+
+    free(descs);
+    fprintf(out, "}");
+}
+
+void write_vcpu_stats(FILE* out, struct guest* vm) {
+    struct vcpu_stats* stats = &vm->stats;
+    const char* sep = "";
+
+    fprintf(out, "{\"id\": 0, \"exits\": {");
+    for (int i = 0; i < EXIT_REASONS; i++) {
+        if (stats->exits[i] == 0) continue;
+        if (exit_reason_names[i]) {
+            fprintf(out, "%s\"%s\": %" PRIu64, sep, exit_reason_names[i], stats->exits[i]);
+        } else {
+            fprintf(out, "%s\"reason_%d\": %" PRIu64, sep, i, stats->exits[i]);
+        }
+        sep = ", ";
+    }
+
+    fprintf(out, "}, \"ports\": [");
+    sep = "";
+    for (int i = 0; i < STAT_PORTS; i++) {
+        if (stats->ports[i].in == 0 && stats->ports[i].out == 0) continue;
+        fprintf(out, "%s{\"port\": %d, \"in\": %" PRIu64 ", \"out\": %" PRIu64 "}",
+            sep, i ? stats->ports[i].port : -1, stats->ports[i].in, stats->ports[i].out);
+        sep = ", ";
+    }
+
+    fprintf(out, "], \"file_ops\": {");
+    for (int i = 1; i < FILE_OPS; i++) {
+        fprintf(out, "\"%s\": %" PRIu64 ", ", file_op_names[i], stats->file_ops[i]);
+    }
+    fprintf(out, "\"bytes_read\": %" PRIu64 ", \"bytes_written\": %" PRIu64 ", \"open_syscalls\": %" PRIu64
+        "}, \"coalesced_mmio\": %" PRIu64 ", ", stats->bytes_read, stats->bytes_written, stats->open_syscalls,
+        stats->coalesced_mmio);
+
+    write_histogram(out, "kvm_run_ns", &stats->kvm_run_ns);
+    fprintf(out, ", ");
+    write_histogram(out, "handler_ns", &stats->handler_ns);
+    fprintf(out, ", \"kvm\": ");
+    write_kvm_stats(out, vm->vcpu_stats_fd);
+    fprintf(out, "}");
+}
+
+#define LOG_PAGE_SIZE (4 * PAGE_SIZE)
+#define LOG_MAX_PAGES 256
+#define LOG_IDLE_NS (100 * 1000000UL)
+
+//  Fajl u koji se upisuje log konzole
+struct log_target {
+    char* path;
+    int fd;
+    uint64_t size;
+    uint64_t rotations;
+};
+
+//  Bafer od LOG_PAGE_SIZE bajtova poravnat na stranicu, tako da ga
+//  vmsplice prebacuje u pipe bez kopiranja
+struct log_page {
+    struct log_page* next;
+    struct log_target* target;
+    size_t used;
+    char* data;
+};
+
+//  Log konzole (--log)
+//
+//  Niti virtuelnih procesora pune svoje stranice zapisima oblika
+//  "<sekunde>.<ns> vm<id> <red>\n" i pune stranice stavljaju u red.
+//  Nit za log ih prebacuje u fajl sa vmsplice i splice, rotira fajlove
+//  i preuzima stranice gostiju koji duze od LOG_IDLE_NS nisu nista
+//  ispisali. Nit virtuelnog procesora nikada ne ceka na disk: kada
+//  nema slobodne stranice bajtovi se odbacuju i broje u dropped
+struct logger {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct log_page* head;
+    struct log_page* tail;
+    struct log_page* free;
+    int pages;
+    int stop;
+    int pipe[2];
+    int per_guest;
+    struct log_target mux;
+    uint64_t rotate_size;
+    _Atomic uint64_t records;
+    uint64_t bytes;
+    _Atomic uint64_t dropped;
+    pthread_t thread;
+};
+
+struct logger* logger = NULL;
+
+int log_target_open(struct log_target* target, const char* path) {
+    target->path = strdup(path);
+    target->size = 0;
+    target->rotations = 0;
+    target->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (target->fd < 0) {
+        fprintf(stderr, "GRESKA: Nije moguce otvoriti log %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+//  Trenutni fajl postaje <path>.1, a log se nastavlja u novom fajlu
+void log_rotate(struct log_target* target) {
+    char old[PATH_MAX];
+
+    snprintf(old, sizeof(old), "%s.1", target->path);
+    close(target->fd);
+    rename(target->path, old);
+    target->fd = open(target->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    target->size = 0;
+    target->rotations++;
+}
+
+//  Poziva se pod logger->lock
+struct log_page* log_page_get(struct log_target* target) {
+    struct log_page* page = logger->free;
+
+    if (page) {
+        logger->free = page->next;
+    } else if (logger->pages < LOG_MAX_PAGES) {
+        page = malloc(sizeof(struct log_page));
+        if (page == NULL) return NULL;
+        page->data = aligned_alloc(PAGE_SIZE, LOG_PAGE_SIZE);
+        if (page->data == NULL) {
+            free(page);
+            return NULL;
+        }
+        logger->pages++;
+    } else {
+        return NULL;
+    }
+
+    page->next = NULL;
+    page->target = target;
+    page->used = 0;
+    return page;
+}
+
+//  Poziva se pod logger->lock
+void log_page_submit(struct log_page* page) {
+    if (logger->tail) {
+        logger->tail->next = page;
+    } else {
+        logger->head = page;
+    }
+    logger->tail = page;
+    pthread_cond_signal(&logger->ready);
+}
+
+//  Zatvara zapis koji je ostao otvoren i predaje stranicu gosta niti
+//  za log. Poziva se pod vm->log_lock
+void log_guest_flush(struct guest* vm) {
+    struct log_page* page = vm->log_page;
+
+    if (page == NULL || page->used == 0) return;
+    if (vm->log_record_open) {
+        page->data[page->used++] = '\n';
+        vm->log_record_open = 0;
+    }
+
+    pthread_mutex_lock(&logger->lock);
+    log_page_submit(page);
+    pthread_mutex_unlock(&logger->lock);
+    vm->log_page = NULL;
+}
+
+//  Dodaje izlaz konzole u log. Svaki red je jedan zapis; red duzi od
+//  stranice se deli na vise zapisa
+void log_console(struct guest* vm, const char* data, size_t len) {
+    pthread_mutex_lock(&vm->log_lock);
+
+    for (size_t i = 0; i < len; i++) {
+        if (!vm->log_record_open) {
+            char header[48];
+            uint64_t now = now_ns();
+            int n = snprintf(header, sizeof(header), "%" PRIu64 ".%09" PRIu64 " vm%d ",
+                now / 1000000000UL, now % 1000000000UL, vm->id);
+
+            if (vm->log_page && vm->log_page->used + n + 2 > LOG_PAGE_SIZE) {
+                log_guest_flush(vm);
+            }
+            if (vm->log_page == NULL) {
+                pthread_mutex_lock(&logger->lock);
+                vm->log_page = log_page_get(vm->log_target);
+                if (vm->log_page == NULL) logger->dropped += len - i;
+                pthread_mutex_unlock(&logger->lock);
+                if (vm->log_page == NULL) break;
+            }
+
+            memcpy(vm->log_page->data + vm->log_page->used, header, n);
+            vm->log_page->used += n;
+            vm->log_record_open = 1;
+            logger->records++;
+        }
+
+        vm->log_page->data[vm->log_page->used++] = data[i];
+        if (data[i] == '\n') {
+            vm->log_record_open = 0;
+        }
+        if (vm->log_page->used == LOG_PAGE_SIZE - 1) {
+            log_guest_flush(vm);
+        }
+    }
+
+    vm->log_last_ns = now_ns();
+    pthread_mutex_unlock(&vm->log_lock);
+}
+
+//  Upisuje stranicu u fajl: vmsplice je mapira u pipe bez kopiranja,
+//  a splice je iz pipe-a prebacuje u fajl. Stranica se ponovo koristi
+//  tek kada splice zavrsi, pa je vmsplice bez SPLICE_F_GIFT bezbedan
+int log_write_page(struct log_page* page) {
+    struct log_target* target = page->target;
+    size_t done = 0;
+
+    if (logger->rotate_size && target->size > 0 && target->size + page->used > logger->rotate_size) {
+        log_rotate(target);
+    }
+
+    while (done < page->used) {
+        struct iovec iov = {page->data + done, page->used - done};
+        ssize_t n = vmsplice(logger->pipe[1], &iov, 1, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("GRESKA: Neuspesan vmsplice\n");
+            return -1;
+        }
+
+        for (ssize_t left = n; left > 0;) {
+            ssize_t m = splice(logger->pipe[0], NULL, target->fd, NULL, left, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) {
+                perror("GRESKA: Neuspesan splice\n");
+                return -1;
+            }
+            left -= m;
+        }
+        done += n;
+    }
+
+    target->size += page->used;
+    logger->bytes += page->used;
+    return 0;
+}
+
+void* log_thread(void* par) {
+    pthread_mutex_lock(&logger->lock);
+
+    for (;;) {
+        while (logger->head == NULL && !logger->stop) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += LOG_IDLE_NS;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+
+            if (pthread_cond_timedwait(&logger->ready, &logger->lock, &until) == ETIMEDOUT) {
+                pthread_mutex_unlock(&logger->lock);
+                uint64_t now = now_ns();
+                pthread_mutex_lock(&guests_lock);
+                for (int i = 0; i < guest_count; i++) {
+                    struct guest* vm = guests[i];
+                    pthread_mutex_lock(&vm->log_lock);
+                    if (now - vm->log_last_ns >= LOG_IDLE_NS) {
+                        log_guest_flush(vm);
+                    }
+                    pthread_mutex_unlock(&vm->log_lock);
+                }
+                pthread_mutex_unlock(&guests_lock);
+                pthread_mutex_lock(&logger->lock);
+            }
+        }
+
+        if (logger->head == NULL) break;
+
+        struct log_page* page = logger->head;
+        logger->head = page->next;
+        if (logger->head == NULL) logger->tail = NULL;
+        pthread_mutex_unlock(&logger->lock);
+
+        if (log_write_page(page) < 0) {
+            logger->dropped += page->used;
+        }
+
+        pthread_mutex_lock(&logger->lock);
+        page->next = logger->free;
+        logger->free = page;
+    }
+
+    pthread_mutex_unlock(&logger->lock);
+    return NULL;
+}
+
+//  Pokrece log. Ako path sadrzi %d svaki gost dobija svoj fajl (path
+//  sa id-em gosta), inace svi gosti pisu u isti fajl
+int log_start(const char* path, uint64_t rotate_size) {
+    logger = calloc(1, sizeof(struct logger));
+    if (logger == NULL) {
+        printf("GRESKA: Alokacija nije uspela\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&logger->lock, NULL);
+    pthread_cond_init(&logger->ready, NULL);
+    logger->rotate_size = rotate_size;
+    logger->per_guest = strstr(path, "%d") != NULL;
+    logger->mux.path = strdup(path);
+    logger->mux.fd = -1;
+
+    if (pipe(logger->pipe) < 0) {
+        perror("GRESKA: Neuspesan pipe\n");
+        return -1;
+    }
+    fcntl(logger->pipe[1], F_SETPIPE_SZ, LOG_PAGE_SIZE);
+
+    if (!logger->per_guest && log_target_open(&logger->mux, path) < 0) {
+        return -1;
+    }
+
+    if (pthread_create(&logger->thread, NULL, &log_thread, NULL) != 0) {
+        perror("GRESKA: Nije moguce pokrenuti nit za log\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int log_guest_open(struct guest* vm) {
+    pthread_mutex_init(&vm->log_lock, NULL);
+    vm->log_page = NULL;
+    vm->log_record_open = 0;
+    vm->log_last_ns = 0;
+    vm->log_target = &logger->mux;
+
+    if (logger->per_guest) {
+        char path[PATH_MAX];
+
+        vm->log_target = malloc(sizeof(struct log_target));
+        if (vm->log_target == NULL) {
+            printf("GRESKA: Alokacija nije uspela\n");
+            return -1;
+        }
+        if (guest_path(path, sizeof(path), logger->mux.path, vm->id) < 0) return -1;
+        return log_target_open(vm->log_target, path);
+    }
+
+    return 0;
+}
+
+//  Predaje preostale stranice, ceka da nit za log sve upise i zatvara fajlove
+void log_stop() {
+    pthread_mutex_lock(&guests_lock);
+    for (int i = 0; i < guest_count; i++) {
+        pthread_mutex_lock(&guests[i]->log_lock);
+        log_guest_flush(guests[i]);
+        pthread_mutex_unlock(&guests[i]->log_lock);
+    }
+    pthread_mutex_unlock(&guests_lock);
+
+    pthread_mutex_lock(&logger->lock);
+    logger->stop = 1;
+    pthread_cond_signal(&logger->ready);
+    pthread_mutex_unlock(&logger->lock);
+    pthread_join(logger->thread, NULL);
+
+    if (logger->per_guest) {
+        pthread_mutex_lock(&guests_lock);
+        for (int i = 0; i < guest_count; i++) {
+            close(guests[i]->log_target->fd);
+        }
+        pthread_mutex_unlock(&guests_lock);
+    } else {
+        close(logger->mux.fd);
+    }
+}
+
+void write_log_stats(FILE* out) {
+    uint64_t rotations = logger->mux.rotations;
+
+    pthread_mutex_lock(&guests_lock);
+    for (int i = 0; logger->per_guest && i < guest_count; i++) {
+        rotations += guests[i]->log_target->rotations;
+    }
+    pthread_mutex_unlock(&guests_lock);
+
+    fprintf(out, "\"log\": {\"records\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"dropped\": %" PRIu64
+        ", \"rotations\": %" PRIu64 ", \"pages\": %d}, ", (uint64_t) logger->records, logger->bytes, (uint64_t) logger->dropped,
+        rotations, logger->pages);
+}
+
+void write_disk_stats(FILE* out, struct disk* disk);
+
+void write_guest_stats(FILE* out, struct guest* vm) {
+    //  Bez --overcommit nit za balon ne radi, pa se RSS meri ovde
+    if (!overcommit_limit) vm->rss_pages = guest_rss_pages(vm);
+    if (vm->vm_stats_fd < 0) vm->vm_stats_fd = ioctl(vm->vm_fd, KVM_GET_STATS_FD, 0);
+    if (vm->vcpu_stats_fd < 0) vm->vcpu_stats_fd = ioctl(vm->vm_vcpu, KVM_GET_STATS_FD, 0);
+
+    fprintf(out, "{\"id\": %d, \"launch_ns\": %" PRIu64 ", \"first_run_ns\": %" PRIu64
+        ", \"end_ns\": %" PRIu64 ", \"exits\": %" PRIu64 ", \"rss_kb\": %" PRIu64 ", \"balloon_kb\": %" PRIu64
+        ", \"throttled\": %" PRIu64 ", \"throttled_ns\": %" PRIu64 ", \"stop\": \"%s\", \"kvm\": ",
+        vm->id, relative_ns(vm->launch_ns), relative_ns(vm->first_run_ns),
+        relative_ns(vm->end_ns), total_exits(&vm->stats), vm->rss_pages * 4, vm->balloon_pages * 4,
+        vm->throttled, vm->throttled_ns, vm->stop_reason ? vm->stop_reason : "-");
+    write_kvm_stats(out, vm->vm_stats_fd);
+    fprintf(out, ", \"vcpus\": [");
+    write_vcpu_stats(out, vm);
+    fprintf(out, "]");
+    if (vm->disk) {
+        write_disk_stats(out, vm->disk);
+    }
+    if (io_limited(&vm->io_limit)) {
+        fprintf(out, ", \"io_limit\": ");
+        write_io_limit(out, &vm->io_limit);
+    }
+    if (use_pmu) {
+        fprintf(out, ", \"pmu\": {\"version\": %d, \"msr_filter\": %d, \"denied_msrs\": %" PRIu64
+            ", \"last_denied_msr\": %u}", pmu_version, vm->pmu_filter, vm->pmu_denied, vm->pmu_last_msr);
+    }
+    fprintf(out, "}");
+}
+
+int daemon_sock = -1;
+void write_daemon_stats(FILE* out);
+
+//  Upisuje statistiku svih gostiju u JSON formatu
+void write_stats(FILE* out) {
+    fprintf(out, "{\"timestamp_ns\": %" PRIu64 ", ", now_ns());
+    if (logger) {
+        write_log_stats(out);
+    }
+    if (file_limit_count > 0) {
+        fprintf(out, "\"file_limits\": [");
+        for (int i = 0; i < file_limit_count; i++) {
+            fprintf(out, "%s{\"name\": \"%s\", \"limit\": ", i ? ", " : "", file_limits[i].name);
+            write_io_limit(out, &file_limits[i].limit);
+            fprintf(out, "}");
+        }
+        fprintf(out, "], ");
+    }
+    if (daemon_sock >= 0) {
+        write_daemon_stats(out);
+    }
+    fprintf(out, "\"guests\": [");
+
+    pthread_mutex_lock(&guests_lock);
+    for (int i = 0; i < guest_count; i++) {
+        fprintf(out, "%s\n  ", i ? "," : "");
+        write_guest_stats(out, guests[i]);
+    }
+    pthread_mutex_unlock(&guests_lock);
+
+    fprintf(out, "\n]}\n");
+    fflush(out);
+}
+
+const char* stats_path = NULL;
+
+void dump_stats() {
+    FILE* out = stats_path ? fopen(stats_path, "w") : stderr;
+    if (out == NULL) {
+        fprintf(stderr, "GRESKA: Nije moguce otvoriti fajl %s\n", stats_path);
+        return;
+    }
+
+    write_stats(out);
+    if (out != stderr) fclose(out);
+}
+
+void stop_guest(struct guest* vm, const char* reason);
+int core_dump(struct guest* vm);
+void daemon_shutdown();
+
+//  Ceka na SIGUSR1 i na svaki signal upisuje statistiku u --stats
+//  fajl (ili na stderr). Na SIGTERM i SIGINT zaustavlja sve goste,
+//  a main posle toga normalno zavrsava. Na GUEST_CORE_SIGNAL pise core
+//  dump gosta iz si_value (ili svih). Signali su blokirani u svim
+//  ostalim nitima
+void* stats_thread(void* par) {
+    sigset_t* set = (sigset_t*) par;
+    siginfo_t info;
+
+    for (;;) {
+        int sig = sigwaitinfo(set, &info);
+        if (sig < 0) continue;
+
+        if (sig == SIGUSR1) {
+            dump_stats();
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            pthread_mutex_lock(&guests_lock);
+            for (int i = 0; i < guest_count; i++) {
+                stop_guest(guests[i], "signal");
+            }
+            pthread_mutex_unlock(&guests_lock);
+            daemon_shutdown();
+        } else if (sig == GUEST_CORE_SIGNAL) {
+            int id = info.si_code == SI_QUEUE ? info.si_value.sival_int : -1;
+            pthread_mutex_lock(&guests_lock);
+            for (int i = 0; i < guest_count; i++) {
+                if (id < 0 || guests[i]->id == id) core_dump(guests[i]);
+            }
+            pthread_mutex_unlock(&guests_lock);
+        }
+    }
+
+    return NULL;
+}
+
+struct trace_header* trace_file = NULL;
+size_t trace_file_size = 0;
+size_t trace_capacity = 16 * 1024 * 1024 / sizeof(struct trace_record);
+volatile int trace_stop = 0;
+
+uint8_t trace_state_id(State state) {
+    if (state == &start_file_operation) return TRACE_STATE_START;
+    if (state == &reading_name) return TRACE_STATE_READING_NAME;
+    if (state == &wait_for_flag) return TRACE_STATE_WAIT_FLAG;
+    if (state == &wait_for_mode) return TRACE_STATE_WAIT_MODE;
+    if (state == &return_fd_to_vm) return TRACE_STATE_RETURN_FD;
+    if (state == &wait_for_fd) return TRACE_STATE_WAIT_FD;
+    if (state == &wait_for_first_addr_half) return TRACE_STATE_FIRST_ADDR;
+    if (state == &wait_for_second_addr_half) return TRACE_STATE_SECOND_ADDR;
+    if (state == &wait_for_first_size_half) return TRACE_STATE_FIRST_SIZE;
+    if (state == &wait_for_second_size_half) return TRACE_STATE_SECOND_SIZE;
+    if (state == &wait_for_read_status) return TRACE_STATE_READ_STATUS;
+    if (state == &wait_for_write_status) return TRACE_STATE_WRITE_STATUS;
+    if (state == &wait_for_close_status) return TRACE_STATE_CLOSE_STATUS;
+    if (state == &wait_for_whence) return TRACE_STATE_WAIT_WHENCE;
+    if (state == &wait_for_seek_status) return TRACE_STATE_SEEK_STATUS;
+    if (state == &wait_for_copy_fd) return TRACE_STATE_COPY_FD;
+    if (state == &wait_for_copy_status) return TRACE_STATE_COPY_STATUS;
+    if (state == &wait_for_copy_status_high) return TRACE_STATE_COPY_STATUS_HIGH;
+    if (state == &wait_for_stream_status) return TRACE_STATE_STREAM_STATUS;
+    if (state == &wait_for_stream_status_high) return TRACE_STATE_STREAM_STATUS_HIGH;
+    return TRACE_STATE_NONE;
+}
+
+//  Upisuje zapis o izlasku u prsten virtuelnog procesora. Poziva se
+//  posle obrade izlaska kako bi podaci za IN vec bili popunjeni
+void trace_exit(struct guest* vm, uint64_t timestamp, State state_from) {
+    struct trace_ring* ring = vm->trace;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= TRACE_RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+
+    struct trace_record* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    memset(record, 0, sizeof(*record));
+    record->timestamp_ns = timestamp;
+    record->guest = vm->id;
+    record->reason = vm->kvm_run->exit_reason;
+
+    if (vm->kvm_run->exit_reason == KVM_EXIT_IO) {
+        uint32_t bytes = vm->kvm_run->io.size * vm->kvm_run->io.count;
+
+        record->direction = vm->kvm_run->io.direction;
+        record->size = vm->kvm_run->io.size;
+        record->port = vm->kvm_run->io.port;
+        record->count = vm->kvm_run->io.count;
+        memcpy(&record->data, (char*) vm->kvm_run + vm->kvm_run->io.data_offset,
+            bytes < sizeof(record->data) ? bytes : sizeof(record->data));
+
+        if (record->port == 0x278) {
+            record->state_from = trace_state_id(state_from);
+            record->state_to = trace_state_id(vm->current_file_state);
+        }
+    } else if (vm->kvm_run->exit_reason == KVM_EXIT_MMIO) {
+        record->direction = vm->kvm_run->mmio.is_write;
+        record->size = vm->kvm_run->mmio.len;
+        record->count = vm->kvm_run->mmio.phys_addr - MMIO_BASE;
+        memcpy(&record->data, vm->kvm_run->mmio.data, sizeof(record->data));
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+//  Prebacuje sve zapise iz prstenova gostiju u mapirani fajl traga
+void trace_flush() {
+    struct trace_record* records = (struct trace_record*) (trace_file + 1);
+    uint64_t dropped = 0;
+
+    for (int i = 0; i < guest_count; i++) {
+        struct trace_ring* ring = guests[i]->trace;
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        for (; tail < head; tail++) {
+            records[trace_file->written % trace_file->capacity] = ring->records[tail & (TRACE_RING_SIZE - 1)];
+            trace_file->written++;
+        }
+
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        dropped += ring->dropped;
+    }
+
+    trace_file->dropped = dropped;
+}
+
+void* trace_thread(void* par) {
+    while (!trace_stop) {
+        trace_flush();
+        usleep(1000);
+    }
+
+    trace_flush();
+    return NULL;
+}
+
+//  Kreira fajl traga velicine size bajtova i mapira ga u memoriju
+int trace_open(const char* path, size_t size) {
+    if (size < sizeof(struct trace_header) + sizeof(struct trace_record)) {
+        fprintf(stderr, "GRESKA: Premali fajl traga\n");
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "GRESKA: Nije moguce otvoriti fajl traga %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    trace_capacity = (size - sizeof(struct trace_header)) / sizeof(struct trace_record);
+    trace_file_size = sizeof(struct trace_header) + trace_capacity * sizeof(struct trace_record);
+
+    if (ftruncate(fd, trace_file_size) < 0) {
+        fprintf(stderr, "GRESKA: ftruncate %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    trace_file = mmap(NULL, trace_file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (trace_file == MAP_FAILED) {
+        perror("GRESKA: Neuspesan mmap fajla traga\n");
+        trace_file = NULL;
+        return -1;
+    }
+
+    trace_file->magic = TRACE_MAGIC;
+    trace_file->version = TRACE_VERSION;
+    trace_file->record_size = sizeof(struct trace_record);
+    trace_file->capacity = trace_capacity;
+    trace_file->written = 0;
+    trace_file->dropped = 0;
+
+    return 0;
+}
+
+//  Rezultat jednog merenja koji gost drzi u svojoj memoriji
+//
+//  phase - 0 na pocetku merenja, 1 na kraju
+//  size - velicina jedne operacije u bajtovima (0 ako nema prenosa)
+//  ops - broj operacija, cycles - trajanje merenja u TSC ciklusima
+struct bench_result {
+    char name[24];
+    uint64_t phase;
+    uint64_t size;
+    uint64_t ops;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t core_cycles;
+    uint64_t llc_misses;
+    uint64_t branch_misses;
+};
+
+//  Ispisuje red tabele za jedno merenje. Iz broja izlazaka se oduzimaju
+//  dva izlaska kojima gost prijavljuje kraj merenja. Ako je gost merio
+//  i brojacima performansi (--pmu), ispod reda ide red sa njima
+void bench_print(struct guest* vm, struct bench_result* result, uint64_t wall_ns, uint64_t exits) {
+    static int header = 0;
+    int tsc_khz = vm->vm_vcpu >= 0 ? ioctl(vm->vm_vcpu, KVM_GET_TSC_KHZ, 0) : -1;
+    double ops = result->ops ? result->ops : 1;
+    double seconds = tsc_khz > 0 ? result->cycles / (tsc_khz * 1000.0) : wall_ns / 1e9;
+    char name[sizeof(result->name) + 1];
+
+    memcpy(name, result->name, sizeof(result->name));
+    name[sizeof(result->name)] = '\0';
+    exits -= exits >= 2 ? 2 : exits;
+
+    if (!header) {
+        fprintf(stderr, "%-4s %-12s %6s %8s %12s %10s %10s %10s %9s %10s\n", "vm", "benchmark", "size",
+            "ops", "cycles/op", "ns/op", "MB/s", "exits", "exits/op", "wall ms");
+        header = 1;
+    }
+
+    fprintf(stderr, "%-4d %-12s %6" PRIu64 " %8" PRIu64 " %12.1f %10.1f ", vm->id, name, result->size,
+        result->ops, result->cycles / ops, seconds * 1e9 / ops);
+    if (result->size) {
+        fprintf(stderr, "%10.2f", result->size * result->ops / 1e6 / seconds);
+    } else {
+        fprintf(stderr, "%10s", "-");
+    }
+    fprintf(stderr, " %10" PRIu64 " %9.2f %10.3f\n", exits, exits / ops, wall_ns / 1e6);
+
+    if (result->core_cycles) {
+        fprintf(stderr, "%-4s %-12s ipc %.2f, instructions/op %.1f, llc_misses/op %.3f, branch_misses/op %.3f\n",
+            "", "  pmu", (double) result->instructions / result->core_cycles, result->instructions / ops,
+            result->llc_misses / ops, result->branch_misses / ops);
+    }
+}
+
+//  Port za merenja iz gosta. Bajtovski IN/OUT ne radi nista i sluzi
+//  za merenje praznog izlaska, a dva 32-bitna OUT-a cine adresu
+//  strukture bench_result u memoriji gosta. Na pocetku merenja se
+//  pamte vreme i broj izlazaka, a na kraju se ispisuje red tabele
+int handle_bench(struct guest* vm) {
+    struct kvm_run* run = vm->kvm_run;
+    void* data_offset = (char*)run + run->io.data_offset;
+
+    if (run->io.size == sizeof(uint8_t)) {
+        if (run->io.direction == KVM_EXIT_IO_IN) {
+            *((uint8_t*) data_offset) = 0;
+        }
+        return 0;
+    }
+
+    if (run->io.direction != KVM_EXIT_IO_OUT || run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    uint32_t data = *((uint32_t*) data_offset);
+    if (vm->bench_half == 0) {
+        vm->bench_addr = data;
+        vm->bench_half = 1;
+        return 0;
+    }
+
+    vm->bench_addr |= (uint64_t) data << 32;
+    vm->bench_half = 0;
+
+    struct bench_result* result = virtual_to_physical_add(vm, vm->bench_addr);
+    if (result == NULL || PAGE4KB_OFFSET(vm->bench_addr) + sizeof(*result) > PAGE_SIZE) {
+        fprintf(stderr, "GRESKA: Neispravna adresa rezultata merenja 0x%" PRIx64 "\n", vm->bench_addr);
+        return -1;
+    }
+
+    if (result->phase == 0) {
+        vm->bench_start_ns = now_ns();
+        vm->bench_start_exits = total_exits(&vm->stats);
+    } else {
+        bench_print(vm, result, now_ns() - vm->bench_start_ns, total_exits(&vm->stats) - vm->bench_start_exits);
+    }
+
+    return 0;
+}
+
+//  Uredjaj na magistrali gosta
+//
+//  port, ports - opseg I/O portova koji uredjaj obradjuje
+//  mmio, mmio_size - opseg fizickih adresa u MMIO prozoru
+//  coalesced - broj bajtova na pocetku MMIO opsega koji su samo za
+//              upis, KVM ih skuplja u prsten umesto da izlazi
+//  io - obrada KVM_EXIT_IO za port uredjaja
+//  mmio_access - obrada jednog MMIO pristupa, offset je u odnosu na mmio
+struct device {
+    const char* name;
+    uint16_t port;
+    uint16_t ports;
+    uint64_t mmio;
+    uint64_t mmio_size;
+    uint64_t coalesced;
+    int (*io)(struct guest* vm);
+    int (*mmio_access)(struct guest* vm, uint64_t offset, uint8_t* data, uint32_t len, int is_write);
+};
+
+//  Uredjaj za svaki port i za svaku stranicu MMIO prozora, tako da je
+//  izbor uredjaja pri izlasku jedno indeksiranje niza
+struct device* port_devices[1 << 16];
+struct device* mmio_devices[MMIO_SIZE / PAGE_SIZE];
+
+void register_device(struct device* device) {
+    for (int i = 0; i < device->ports; i++) {
+        port_devices[device->port + i] = device;
+    }
+
+    for (uint64_t page = 0; page < device->mmio_size; page += PAGE_SIZE) {
+        mmio_devices[(device->mmio - MMIO_BASE + page) / PAGE_SIZE] = device;
+    }
+}
+
+//  Izlaz konzole gosta ide u log ako je ukljucen, inace na console_out
+void console_write(struct guest* vm, const char* data, size_t len) {
+    if (logger) {
+        log_console(vm, data, len);
+    } else {
+        while (len > 0) {
+            ssize_t n = write(vm->console_out, data, len);
+            if (n < 0 && kick_retry(vm)) continue;
+            if (n <= 0) break;
+            data += n;
+            len -= n;
+        }
+    }
+}
+
+int console_io(struct guest* vm) {
+    if (vm->kvm_run->io.direction == KVM_EXIT_IO_OUT) {
+        //  rep outsb stize kao jedan izlazak sa count bajtova (ako ga
+        //  KVM ne emulira bajt po bajt)
+        const char* data = (char*)vm->kvm_run + vm->kvm_run->io.data_offset;
+        console_write(vm, data, vm->kvm_run->io.size * vm->kvm_run->io.count);
+    } else {
+        char c = 0;
+        while (read(vm->console_in, &c, sizeof(char)) < 0 && kick_retry(vm));
+        *((char*)vm->kvm_run + vm->kvm_run->io.data_offset) = c;
+        if (vm->irqchip) {
+            sem_post(&vm->console_armed);
+        }
+    }
+
+    return 0;
+}
+
+//  Opis bafera koji gost salje na CONSOLE_BULK_PORT
+struct console_bulk {
+    uint64_t addr;
+    uint64_t len;
+};
+
+//  32-bitni OUT na CONSOLE_BULK_PORT je adresa strukture console_bulk,
+//  a ceo bafer koji ona opisuje ide na konzolu u jednom izlasku
+int console_bulk_io(struct guest* vm) {
+    struct kvm_run* run = vm->kvm_run;
+
+    if (run->io.direction != KVM_EXIT_IO_OUT || run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    uint32_t desc_addr = *((uint32_t*) ((char*) run + run->io.data_offset));
+    struct console_bulk* desc = guest_range(vm, desc_addr, sizeof(struct console_bulk));
+    if (desc == NULL) {
+        fprintf(stderr, "GRESKA: vm%d: neispravna adresa opisa konzole 0x%x\n", vm->id, desc_addr);
+        return -1;
+    }
+
+    uint64_t addr = desc->addr;
+    uint64_t left = desc->len;
+    while (left > 0) {
+        uint64_t chunk = PAGE_SIZE - PAGE4KB_OFFSET(addr);
+        if (chunk > left) chunk = left;
+
+        char* data = guest_range(vm, addr, chunk);
+        if (data == NULL) {
+            fprintf(stderr, "GRESKA: vm%d: neispravna adresa bafera konzole 0x%" PRIx64 "\n", vm->id, addr);
+            return -1;
+        }
+        console_write(vm, data, chunk);
+        addr += chunk;
+        left -= chunk;
+    }
+
+    return 0;
+}
+
+int file_io(struct guest* vm) {
+    State before = vm->current_file_state;
+    int ret = handle_file(vm);
+
+    if (vm->irqchip && before != &start_file_operation && vm->current_file_state == &start_file_operation) {
+        raise_irq(vm, IRQ_FILE);
+    }
+
+    return ret;
+}
+
+int exit_port_io(struct guest* vm) {
+    return 1;
+}
+
+//  Konzola u MMIO prozoru. Upis u DATA (1 do 8 bajtova) ispisuje
+//  bajtove na konzolu i ide kroz coalesced prsten, a citanje COUNT
+//  vraca ukupan broj ispisanih bajtova. Citanje je pravi izlazak, pa
+//  se pre njega uvek isprazni prsten i broj je tacan
+int mmio_console_access(struct guest* vm, uint64_t offset, uint8_t* data, uint32_t len, int is_write) {
+    if (offset == MMIO_CONSOLE_DATA && is_write) {
+        console_write(vm, (const char*) data, len);
+        vm->mmio_console_bytes += len;
+        return 0;
+    }
+
+    if (offset == MMIO_CONSOLE_COUNT && !is_write) {
+        memcpy(data, &vm->mmio_console_bytes, len < 8 ? len : 8);
+        return 0;
+    }
+
+    fprintf(stderr, "GRESKA: vm%d: mmio_console: neispravan pristup 0x%" PRIx64 "\n", vm->id, offset);
+    return -1;
+}
+
+//  Blok uredjaj (disk)
+//
+//  Slika diska je fajl mapiran sa MAP_SHARED, pa se citanje i upis
+//  svode na memcpy izmedju memorije gosta i kesa stranica, bez sistemskih
+//  poziva po zahtevu. Fajl je redak: pravi se sa ftruncate, blokovi se
+//  zauzimaju tek pri prvom upisu, a DISCARD ih vraca sa PUNCH_HOLE.
+//
+//  Zahtevi su u prstenu u memoriji gosta. Gost upisuje adresu prstena
+//  na DISK_PORT (IN sa istog porta vraca velicinu u sektorima), puni
+//  zahteve i povecava avail, pa jednim OUT-om na DISK_NOTIFY predaje sve
+//  zahteve odjednom. Hipervizor ih obradjuje redom, upisuje status
+//  svakog i na kraju pomera used.
+
+#define DISK_PORT 0x280
+#define DISK_NOTIFY (DISK_PORT + 1)
+#define DISK_SECTOR 512
+#define DISK_RING_SIZE 64
+
+#define DISK_READ 0
+#define DISK_WRITE 1
+#define DISK_FLUSH 2
+#define DISK_DISCARD 3
+#define DISK_OPS 4
+
+#define DISK_OK 0
+#define DISK_IOERR 1
+#define DISK_UNSUPPORTED 2
+
+//  op - DISK_READ, DISK_WRITE, DISK_FLUSH ili DISK_DISCARD
+//  status - hipervizor upisuje DISK_OK, DISK_IOERR ili DISK_UNSUPPORTED
+//  sector, sectors - opseg na disku
+//  addr - virtuelna adresa bafera gosta (za READ i WRITE)
+struct disk_request {
+    uint8_t op;
+    uint8_t status;
+    uint16_t pad;
+    uint32_t sectors;
+    uint64_t sector;
+    uint64_t addr;
+};
+
+//  avail - broj zahteva koje je gost predao, used - broj obradjenih
+struct disk_ring {
+    uint32_t avail;
+    uint32_t used;
+    struct disk_request requests[DISK_RING_SIZE];
+};
+
+//  fd, data, size - slika diska i njeno mapiranje
+//  ring_addr - adresa prstena u gostu, used - sledeci zahtev za obradu
+//  ops, bytes_* - broj zahteva po vrsti i prenetih bajtova
+//  notifies - broj OUT-ova na DISK_NOTIFY, errors - neuspeli zahtevi
+//  lock - prsten obradjuju nit vCPU-a i nit za prstenove (--dedicated)
+struct disk {
+    pthread_mutex_t lock;
+    int fd;
+    char* data;
+    uint64_t size;
+    uint64_t ring_addr;
+    uint32_t used;
+    uint64_t ops[DISK_OPS];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t notifies;
+    uint64_t errors;
+};
+
+static const char* disk_op_names[DISK_OPS] = {"read", "write", "flush", "discard"};
+
+const char* disk_path = NULL;
+uint64_t disk_size = 0;
+
+//  Otvara (ili pravi) sliku diska za gosta. Ako putanja sadrzi %d,
+//  svaki gost dobija svoju sliku, inace svi dele istu
+int disk_open(struct guest* vm) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (guest_path(path, sizeof(path), disk_path, vm->id) < 0) return -1;
+
+    struct disk* disk = calloc(1, sizeof(struct disk));
+    if (disk == NULL) {
+        printf("GRESKA: Alokacija nije uspela\n");
+        return -1;
+    }
+
+    disk->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (disk->fd < 0 || fstat(disk->fd, &st) < 0) {
+        fprintf(stderr, "GRESKA: Nije moguce otvoriti disk %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    if ((uint64_t) st.st_size < disk_size) {
+        if (ftruncate(disk->fd, disk_size) < 0) {
+            fprintf(stderr, "GRESKA: Nije moguce povecati disk %s: %s\n", path, strerror(errno));
+            goto fail;
+        }
+        st.st_size = disk_size;
+    }
+
+    disk->size = st.st_size & ~(uint64_t) (DISK_SECTOR - 1);
+    if (disk->size == 0) {
+        fprintf(stderr, "GRESKA: Disk %s je prazan, velicina se zadaje sa --disk-size\n", path);
+        goto fail;
+    }
+
+    disk->data = mmap(NULL, disk->size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (disk->data == MAP_FAILED) {
+        perror("GRESKA: Neuspesno mapiranje diska\n");
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    pthread_mutex_init(&disk->lock, NULL);
+    vm->disk = disk;
+    return 0;
+
+fail:
+    if (disk->fd >= 0) close(disk->fd);
+    free(disk);
+    return -1;
+}
+
+//  Kopira len bajtova izmedju mapirane slike i bafera gosta na
+//  virtuelnoj adresi addr, stranicu po stranicu
+int disk_copy(struct guest* vm, char* image, uint64_t addr, uint64_t len, int to_guest) {
+    while (len > 0) {
+        uint64_t chunk = PAGE_SIZE - PAGE4KB_OFFSET(addr);
+        if (chunk > len) chunk = len;
+
+        char* host = guest_range(vm, addr, chunk);
+        if (host == NULL) {
+            return -1;
+        }
+
+        if (to_guest) {
+            memcpy(host, image, chunk);
+            guest_mark_dirty(vm, host, chunk);
+        } else {
+            memcpy(image, host, chunk);
+        }
+        image += chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+int disk_execute(struct guest* vm, const struct disk_request* request) {
+    struct disk* disk = vm->disk;
+    uint64_t offset = request->sector * DISK_SECTOR;
+    uint64_t len = (uint64_t) request->sectors * DISK_SECTOR;
+
+    if (request->op >= DISK_OPS) {
+        return DISK_UNSUPPORTED;
+    }
+    if (request->op != DISK_FLUSH && (request->sector > disk->size / DISK_SECTOR || len > disk->size - offset)) {
+        return DISK_IOERR;
+    }
+
+    disk->ops[request->op]++;
+
+    switch (request->op) {
+        case DISK_READ:
+            if (disk_copy(vm, disk->data + offset, request->addr, len, 1) < 0) return DISK_IOERR;
+            disk->bytes_read += len;
+            return DISK_OK;
+        case DISK_WRITE:
+            if (disk_copy(vm, disk->data + offset, request->addr, len, 0) < 0) return DISK_IOERR;
+            disk->bytes_written += len;
+            return DISK_OK;
+        case DISK_FLUSH:
+            return msync(disk->data, disk->size, MS_SYNC) < 0 ? DISK_IOERR : DISK_OK;
+        case DISK_DISCARD:
+            if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0) {
+                return errno == EOPNOTSUPP ? DISK_UNSUPPORTED : DISK_IOERR;
+            }
+            return DISK_OK;
+    }
+
+    return DISK_UNSUPPORTED;
+}
+
+//  Obradjuje sve zahteve izmedju used i avail. Pre kopiranja se za sva
+//  citanja trazi MADV_WILLNEED, pa kernel ucitava blokove svih zahteva
+//  u paraleli dok se prvi kopira
+int disk_process(struct guest* vm) {
+    struct disk* disk = vm->disk;
+    struct disk_ring* ring = guest_range(vm, disk->ring_addr, sizeof(struct disk_ring));
+
+    if (ring == NULL) {
+        fprintf(stderr, "GRESKA: vm%d: neispravna adresa prstena diska 0x%" PRIx64 "\n", vm->id, disk->ring_addr);
+        return -1;
+    }
+
+    uint32_t avail = __atomic_load_n(&ring->avail, __ATOMIC_ACQUIRE);
+    if (avail - disk->used > DISK_RING_SIZE) {
+        fprintf(stderr, "GRESKA: vm%d: neispravan broj zahteva diska %u\n", vm->id, avail - disk->used);
+        return -1;
+    }
+
+    for (uint32_t i = disk->used; i != avail; i++) {
+        struct disk_request* request = &ring->requests[i % DISK_RING_SIZE];
+        uint64_t offset = request->sector * DISK_SECTOR;
+        uint64_t len = (uint64_t) request->sectors * DISK_SECTOR;
+
+        if (request->op == DISK_READ && offset < disk->size && len <= disk->size - offset) {
+            uint64_t start = offset & ~(uint64_t) (PAGE_SIZE - 1);
+            madvise(disk->data + start, offset + len - start, MADV_WILLNEED);
+        }
+    }
+
+    //  Gost sa --dedicated radi dok se prsten obradjuje i moze da menja
+    //  zahtev, pa se on jednom kopira, a provera i izvrsavanje vide samo kopiju
+    for (; disk->used != avail; disk->used++) {
+        struct disk_request* slot = &ring->requests[disk->used % DISK_RING_SIZE];
+        struct disk_request request;
+
+        memcpy(&request, slot, sizeof(request));
+        uint8_t status = disk_execute(vm, &request);
+        slot->status = status;
+        if (status != DISK_OK) {
+            disk->errors++;
+        }
+    }
+
+    __atomic_store_n(&ring->used, disk->used, __ATOMIC_RELEASE);
+    guest_mark_dirty(vm, ring, sizeof(struct disk_ring));
+    return 0;
+}
+
+int disk_io(struct guest* vm) {
+    struct kvm_run* run = vm->kvm_run;
+    uint32_t* data = (uint32_t*) ((char*) run + run->io.data_offset);
+
+    if (vm->disk == NULL) {
+        fprintf(stderr, "GRESKA: vm%d: gost nema disk (--disk)\n", vm->id);
+        return -1;
+    }
+    if (run->io.size != sizeof(uint32_t)) {
+        perror("GRESKA: Vm nije ispostovan protokol\n");
+        return -1;
+    }
+
+    if (run->io.port == DISK_PORT && run->io.direction == KVM_EXIT_IO_IN) {
+        uint64_t sectors = vm->disk->size / DISK_SECTOR;
+        *data = sectors > UINT32_MAX ? UINT32_MAX : sectors;
+        return 0;
+    }
+
+    //  1 ako prsten prati nit za prstenove, pa gost ne mora da javlja
+    if (run->io.direction == KVM_EXIT_IO_IN) {
+        *data = vm->polling;
+        return 0;
+    }
+
+    pthread_mutex_lock(&vm->disk->lock);
+    int ret = 0;
+    if (run->io.port == DISK_PORT) {
+        vm->disk->ring_addr = *data;
+        vm->disk->used = 0;
+    } else {
+        vm->disk->notifies++;
+        ret = disk_process(vm);
+    }
+    pthread_mutex_unlock(&vm->disk->lock);
+
+    return ret;
+}
+
+//  Obradjuje prsten ako je gost predao nove zahteve. Vraca 1 ako je bilo
+//  zahteva, a posle greske prestaje da prati prsten
+int disk_poll(struct guest* vm) {
+    struct disk* disk = vm->disk;
+    int busy = 0;
+
+    pthread_mutex_lock(&disk->lock);
+    struct disk_ring* ring = disk->ring_addr ? guest_range(vm, disk->ring_addr, sizeof(uint32_t)) : NULL;
+    if (ring && __atomic_load_n(&ring->avail, __ATOMIC_ACQUIRE) != disk->used) {
+        busy = 1;
+        if (disk_process(vm) < 0) disk->ring_addr = 0;
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    return busy;
+}
+
+void write_disk_stats(FILE* out, struct disk* disk) {
+    struct stat st;
+
+    fprintf(out, ", \"disk\": {");
+    for (int i = 0; i < DISK_OPS; i++) {
+        fprintf(out, "\"%s\": %" PRIu64 ", ", disk_op_names[i], disk->ops[i]);
+    }
+    fprintf(out, "\"bytes_read\": %" PRIu64 ", \"bytes_written\": %" PRIu64 ", \"notifies\": %" PRIu64
+        ", \"errors\": %" PRIu64 ", \"size_kb\": %" PRIu64 ", \"allocated_kb\": %" PRIu64 "}",
+        disk->bytes_read, disk->bytes_written, disk->notifies, disk->errors, disk->size / 1024,
+        fstat(disk->fd, &st) == 0 ? (uint64_t) st.st_blocks / 2 : 0);
+}
+
+struct device console_device = {"console", 0xE9, 1, 0, 0, 0, &console_io, NULL};
+struct device console_bulk_device = {"console_bulk", CONSOLE_BULK_PORT, 1, 0, 0, 0, &console_bulk_io, NULL};
+struct device file_device = {"file", 0x278, 1, 0, 0, 0, &file_io, NULL};
+struct device balloon_device = {"balloon", BALLOON_PORT, 1, 0, 0, 0, &handle_balloon, NULL};
+struct device bench_device = {"bench", BENCH_PORT, 1, 0, 0, 0, &handle_bench, NULL};
+struct device disk_device = {"disk", DISK_PORT, 2, 0, 0, 0, &disk_io, NULL};
+struct device exit_device = {"exit", EXIT_PORT, 1, 0, 0, 0, &exit_port_io, NULL};
+struct device mmio_console_device = {"mmio_console", 0, 0, MMIO_BASE, PAGE_SIZE, 8, NULL, &mmio_console_access};
+
+void register_devices() {
+    register_device(&console_device);
+    register_device(&console_bulk_device);
+    register_device(&file_device);
+    register_device(&balloon_device);
+    register_device(&bench_device);
+    register_device(&disk_device);
+    register_device(&exit_device);
+    register_device(&mmio_console_device);
+}
+
+//  Prijavljuje coalesced zone svih uredjaja i pamti prsten koji KVM
+//  mapira uz kvm_run
+int setup_coalesced_mmio(struct hypervisor* hypervisor, struct guest* vm) {
+    struct device* last = NULL;
+
+    if (hypervisor->coalesced_mmio_page <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < MMIO_SIZE / PAGE_SIZE; i++) {
+        struct device* device = mmio_devices[i];
+        if (device == NULL || device == last || device->coalesced == 0) continue;
+        last = device;
+
+        struct kvm_coalesced_mmio_zone zone = {.addr = device->mmio, .size = device->coalesced};
+        if (ioctl(vm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0) {
+            perror("GRESKA: Neuspesan ioctl KVM_REGISTER_COALESCED_MMIO\n");
+            fprintf(stderr, "KVM_REGISTER_COALESCED_MMIO: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    vm->coalesced_ring = (void*) ((char*) vm->kvm_run + hypervisor->coalesced_mmio_page * PAGE_SIZE);
+    return 0;
+}
+
+int mmio_dispatch(struct guest* vm, uint64_t addr, uint8_t* data, uint32_t len, int is_write) {
+    uint64_t offset = addr - MMIO_BASE;
+    struct device* device = offset < MMIO_SIZE ? mmio_devices[offset / PAGE_SIZE] : NULL;
+
+    if (device == NULL || device->mmio_access == NULL) {
+        fprintf(stderr, "Invalid MMIO address 0x%" PRIx64 "\n", addr);
+        return -1;
+    }
+
+    return device->mmio_access(vm, addr - device->mmio, data, len, is_write);
+}
+
+//  Obradjuje upise koje je KVM skupio bez izlaska. Poziva se posle
+//  svakog izlaska, pre obrade, da bi redosled upisa i ostalih
+//  pristupa ostao isti kao u gostu
+int coalesced_mmio_flush(struct guest* vm) {
+    struct kvm_coalesced_mmio_ring* ring = vm->coalesced_ring;
+
+    while (ring->first != ring->last) {
+        struct kvm_coalesced_mmio* entry = &ring->coalesced_mmio[ring->first];
+
+        if (mmio_dispatch(vm, entry->phys_addr, entry->data, entry->len, 1) < 0) {
+            return -1;
+        }
+        vm->stats.coalesced_mmio++;
+
+        atomic_thread_fence(memory_order_release);
+        ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
+    }
+
+    return 0;
+}
+
+int exit_io(struct guest* vm) {
+    struct device* device = port_devices[vm->kvm_run->io.port];
+
+    stats_record_port(&vm->stats, vm->kvm_run->io.port, vm->kvm_run->io.direction);
+
+    if (device == NULL || device->io == NULL) {
+        fprintf(stderr, "Invalid port %d\n", vm->kvm_run->io.port);
+        return -1;
+    }
+
+    return device->io(vm);
+}
+
+int exit_mmio(struct guest* vm) {
+    struct kvm_run* run = vm->kvm_run;
+
+    return mmio_dispatch(vm, run->mmio.phys_addr, run->mmio.data, run->mmio.len, run->mmio.is_write);
+}
+
+int exit_internal_error(struct guest* vm) {
+    printf("GRESKA: Interna greska: podgreska = 0x%x\n", vm->kvm_run->internal.suberror);
+    return -1;
+}
+
+int exit_shutdown(struct guest* vm) {
+    printf("Shutdown\n");
+    return 1;
+}
+
+#ifdef ALLOC_COUNT
+//  Brojanje alokacija za merenje (make bench-replay linkuje sa
+//  -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc). Broji se po niti,
+//  pa run_guest meri samo svoju petlju, bez pripreme gostiju i drugih niti
+_Thread_local uint64_t alloc_count = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    alloc_count++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    alloc_count++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+int kvm_run_vcpu(struct guest* vm) {
+    return ioctl(vm->vm_vcpu, KVM_RUN, 0);
+}
+
+const struct vcpu_backend kvm_backend = {"KVM_RUN", &kvm_run_vcpu};
+
+#define REPLAY_DATA_OFFSET PAGE_SIZE
+
+//  Pamti fajl deskriptor koji je handler vratio za snimljeni fd
+void replay_map_fd(struct replay* replay, int recorded, int actual) {
+    for (int i = 0; i < 16; i++) {
+        if (replay->fd_map[0][i] == recorded || replay->fd_map[0][i] < 0) {
+            replay->fd_map[0][i] = recorded;
+            replay->fd_map[1][i] = actual;
+            return;
+        }
+    }
+}
+
+int replay_lookup_fd(struct replay* replay, int recorded) {
+    for (int i = 0; i < 16 && replay->fd_map[0][i] >= 0; i++) {
+        if (replay->fd_map[0][i] == recorded) {
+            return replay->fd_map[1][i];
+        }
+    }
+
+    return recorded;
+}
+
+//  Umesto pokretanja gosta popunjava kvm_run sledecim snimljenim
+//  izlaskom. Fajl deskriptori koje su handleri vratili pri snimanju
+//  i pri reprodukciji se razlikuju, pa se fd iz stanja wait_fd
+//  prevodi na osnovu vrednosti koju je vratio return_fd_to_vm
+int replay_run_vcpu(struct guest* vm) {
+    struct replay* replay = vm->replay;
+    struct kvm_run* run = vm->kvm_run;
+    char* data = (char*) run + REPLAY_DATA_OFFSET;
+
+    if (run->immediate_exit) {
+        errno = EINTR;
+        return -1;
+    }
+
+    if (replay->last_state == TRACE_STATE_RETURN_FD && replay->position > 0) {
+        replay_map_fd(replay, replay->records[replay->position - 1].data, *((int*) data));
+    }
+
+    if (replay->count > 0 && replay->position == replay->count) {
+        replay->position = 0;
+        replay->loops--;
+    }
+
+    if (replay->count == 0 || replay->loops == 0) {
+        replay->last_state = TRACE_STATE_NONE;
+        run->exit_reason = KVM_EXIT_HLT;
+        return 0;
+    }
+
+    struct trace_record* record = &replay->records[replay->position++];
+    uint64_t value = record->data;
+
+    if (record->state_from == TRACE_STATE_WAIT_FD || record->state_from == TRACE_STATE_COPY_FD) {
+        value = replay_lookup_fd(replay, value);
+    }
+
+    run->exit_reason = KVM_EXIT_IO;
+    run->io.direction = record->direction;
+    run->io.size = record->size;
+    run->io.port = record->port;
+    run->io.count = record->count ? record->count : 1;
+    run->io.data_offset = REPLAY_DATA_OFFSET;
+    memset(data, 0, sizeof(uint64_t));
+    if (record->direction == KVM_EXIT_IO_OUT) {
+        memcpy(data, &value, sizeof(value));
+    }
+    replay->last_state = record->state_from;
+
+    return 0;
+}
+
+const struct vcpu_backend replay_backend = {"replay", &replay_run_vcpu};
+
+struct trace_record* replay_add(struct replay* replay, int direction, int size, uint64_t data, int state) {
+    if (replay->count % 64 == 0) {
+        replay->records = realloc(replay->records, sizeof(struct trace_record) * (replay->count + 64));
+        if (replay->records == NULL) {
+            printf("GRESKA: Alokacija nije uspela\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct trace_record* record = &replay->records[replay->count++];
+    memset(record, 0, sizeof(*record));
+    record->reason = KVM_EXIT_IO;
+    record->direction = direction;
+    record->size = size;
+    record->port = 0x278;
+    record->count = 1;
+    record->data = data;
+    record->state_from = state;
+    return record;
+}
+
+void replay_add_open(struct replay* replay, const char* name, int flags, int recorded_fd) {
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, OPEN, TRACE_STATE_START);
+    for (int i = 0; i == 0 || name[i - 1]; i++) {
+        replay_add(replay, KVM_EXIT_IO_OUT, 1, name[i], TRACE_STATE_READING_NAME);
+    }
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, flags, TRACE_STATE_WAIT_FLAG);
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, 0644, TRACE_STATE_WAIT_MODE);
+    replay_add(replay, KVM_EXIT_IO_IN, 4, recorded_fd, TRACE_STATE_RETURN_FD);
+}
+
+void replay_add_transfer(struct replay* replay, int operation, int recorded_fd, uint64_t addr, uint64_t size) {
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, operation, TRACE_STATE_START);
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, recorded_fd, TRACE_STATE_WAIT_FD);
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, addr & 0xFFFFFFFF, TRACE_STATE_FIRST_ADDR);
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, addr >> 32, TRACE_STATE_SECOND_ADDR);
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, size & 0xFFFFFFFF, TRACE_STATE_FIRST_SIZE);
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, size >> 32, TRACE_STATE_SECOND_SIZE);
+    replay_add(replay, KVM_EXIT_IO_IN, 4, 0,
+        operation == READ ? TRACE_STATE_READ_STATUS : TRACE_STATE_WRITE_STATUS);
+}
+
+void replay_add_close(struct replay* replay, int recorded_fd) {
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, CLOSE, TRACE_STATE_START);
+    replay_add(replay, KVM_EXIT_IO_OUT, 4, recorded_fd, TRACE_STATE_WAIT_FD);
+    replay_add(replay, KVM_EXIT_IO_IN, 4, 0, TRACE_STATE_CLOSE_STATUS);
+}
+
+//  Sinteticki niz izlazaka: ispis na konzolu, zatim upis 64 bajta u
+//  fajl i njihovo citanje (open/write/close/open/read/close)
+void replay_synthetic(struct replay* replay) {
+    const char* line = "replay\n";
+    uint64_t buffer = 0x100000;
+
+    for (int i = 0; line[i]; i++) {
+        replay_add(replay, KVM_EXIT_IO_OUT, 1, line[i], TRACE_STATE_NONE)->port = 0xE9;
+    }
+
+    replay_add_open(replay, "replay.txt", O_RDWR | O_CREAT | O_TRUNC, 100);
+    replay_add_transfer(replay, WRITE, 100, buffer, 64);
+    replay_add_close(replay, 100);
+    replay_add_open(replay, "replay.txt", O_RDONLY, 101);
+    replay_add_transfer(replay, READ, 101, buffer, 64);
+    replay_add_close(replay, 101);
+}
+
+//  Ucitava I/O izlaske jednog gosta iz fajla traga (--trace)
+int replay_load_trace(struct replay* replay, const char* path, int guest) {
+    int fd = open(path, O_RDONLY);
+    struct trace_header header;
+
+    if (fd < 0 || read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != TRACE_MAGIC
+        || header.version != TRACE_VERSION || header.record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "GRESKA: %s nije ispravan fajl traga\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    uint64_t first = header.written > header.capacity ? header.written - header.capacity : 0;
+    int guests_in_trace = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint64_t n = first; n < header.written; n++) {
+            struct trace_record record;
+            off_t offset = sizeof(header) + (n % header.capacity) * sizeof(record);
+
+            if (pread(fd, &record, sizeof(record), offset) != sizeof(record)) break;
+            if (pass == 0) {
+                if (record.guest >= guests_in_trace) guests_in_trace = record.guest + 1;
+                continue;
+            }
+            if (record.reason != KVM_EXIT_IO || record.guest != guest % guests_in_trace) continue;
+            //  exit() gosta bi zaustavio reprodukciju posle prvog prolaza
+            if (record.port == EXIT_PORT) continue;
+
+            *replay_add(replay, 0, 0, 0, 0) = record;
+        }
+
+        if (guests_in_trace == 0) break;
+    }
+
+    close(fd);
+    return 0;
+}
+
+typedef int (*Handler)(struct guest* vm);
+
+static Handler handlers[] = {
+    [KVM_EXIT_IO] = &exit_io,
+    [KVM_EXIT_HLT] = &exit_halt,
+    [KVM_EXIT_MMIO] = &exit_mmio,
+    [KVM_EXIT_SHUTDOWN] = &exit_shutdown,
+    [KVM_EXIT_INTERNAL_ERROR] = &exit_internal_error,
+    [KVM_EXIT_X86_RDMSR] = &exit_msr,
+    [KVM_EXIT_X86_WRMSR] = &exit_msr,
+};
+
+#define HANDLER_COUNT (sizeof(handlers) / sizeof(handlers[0]))
+
+#define PROFILE_DEPTH 16
+#define PROFILE_SLOTS 4096
+
+//  Jedan jedinstven stek uzoraka, frames[0] je RIP, ostalo su
+//  povratne adrese dobijene pracenjem lanca RBP registara
+struct profile_stack {
+    uint64_t count;
+    int depth;
+    uint64_t frames[PROFILE_DEPTH];
+};
+
+struct symbol {
+    uint64_t addr;
+    uint64_t size;
+    char* name;
+};
+
+//  Profil jednog gosta
+//
+//  stacks - hes tabela stekova sa otvorenim adresiranjem
+//  samples - broj uzetih uzoraka, lost - uzorci koji nisu sacuvani
+//  symbols - funkcije iz ELF verzije slike gosta, sortirane po adresi
+struct profile {
+    struct profile_stack stacks[PROFILE_SLOTS];
+    uint64_t samples;
+    uint64_t lost;
+    timer_t timer;
+    struct symbol* symbols;
+    int symbol_count;
+};
+
+int profile_hz = 0;
+const char* profile_path = "profile.folded";
+
+__thread struct guest* current_vm = NULL;
+
+//  Obrada SIG_KICK signala u niti virtuelnog procesora. Signal prekida
+//  KVM_RUN, a immediate_exit pokriva slucaj kada signal stigne pre
+//  ulaska u KVM_RUN. Tajmeri u si_value salju razlog prekida
+void kick_handler(int sig, siginfo_t* info, void* context) {
+    struct guest* vm = current_vm;
+
+    if (vm == NULL) return;
+    if (info->si_code == SI_TIMER) {
+        atomic_fetch_or(&vm->kicks, info->si_value.sival_int);
+    }
+    vm->kvm_run->immediate_exit = 1;
+}
+
+//  Zahteva od niti virtuelnog procesora da zaustavi gosta. Kick se
+//  upisuje pre immediate_exit, a nit prvo brise immediate_exit pa tek
+//  onda cita kicks, tako da zahtev ne moze da se izgubi. Signal
+//  prekida KVM_RUN ili blokirajuci poziv u obradi izlaska. Poziva se
+//  pod guests_lock: nit upisuje end_ns pod istom bravom kao poslednju
+//  stvar, pa je nit kojoj se salje signal sigurno jos ziva (nije join-ovana)
+void stop_guest(struct guest* vm, const char* reason) {
+    if (vm->end_ns != 0) return;
+
+    if (vm->stop_reason == NULL) vm->stop_reason = reason;
+    atomic_fetch_or(&vm->kicks, KICK_STOP);
+    vm->kvm_run->immediate_exit = 1;
+    pthread_kill(vm->thread, SIG_KICK);
+}
+
+//  Pokazivac na len bajtova gosta na virtuelnoj adresi addr ili NULL
+//  ako opseg nije mapiran, prelazi granicu stranice ili izlazi iz memorije
+void* guest_range(struct guest* vm, uint64_t addr, size_t len) {
+    char* host = virtual_to_physical_add(vm, addr);
+
+    if (host == NULL || PAGE4KB_OFFSET(addr) + len > PAGE_SIZE || host + len > vm->mem + vm->mem_size) {
+        return NULL;
+    }
+
+    return host;
+}
+
+int compare_symbols(const void* a, const void* b) {
+    const struct symbol* first = a;
+    const struct symbol* second = b;
+    return (first->addr > second->addr) - (first->addr < second->addr);
+}
+
+//  Da li je sekcija cela unutar ELF fajla velicine size
+int elf_section_fits(const Elf64_Shdr* section, uint64_t size) {
+    return section->sh_offset <= size && section->sh_size <= size - section->sh_offset;
+}
+
+//  Ucitava funkcije iz ELF fajla koji odgovara slici gosta
+//  (guest2.img -> guest2.elf). Bez ELF-a profil sadrzi samo adrese
+void profile_load_symbols(struct profile* profile, const char* image) {
+    char path[256];
+    const char* dot = strrchr(image, '.');
+    int length = dot ? dot - image : strlen(image);
+
+    snprintf(path, sizeof(path), "%.*s.elf", length, image);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    char* elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (elf == MAP_FAILED) return;
+
+    Elf64_Ehdr* ehdr = (Elf64_Ehdr*) elf;
+    if (st.st_size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+        || ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > st.st_size) {
+        munmap(elf, st.st_size);
+        return;
+    }
+
+    Elf64_Shdr* sections = (Elf64_Shdr*) (elf + ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (sections[i].sh_type != SHT_SYMTAB || sections[i].sh_link >= ehdr->e_shnum) continue;
+
+        Elf64_Sym* symbols = (Elf64_Sym*) (elf + sections[i].sh_offset);
+        Elf64_Shdr* strtab = &sections[sections[i].sh_link];
+        if (!elf_section_fits(&sections[i], st.st_size) || !elf_section_fits(strtab, st.st_size)) break;
+        int count = sections[i].sh_size / sizeof(Elf64_Sym);
+
+        profile->symbols = malloc(sizeof(struct symbol) * count);
+        if (profile->symbols == NULL) break;
+
+        for (int j = 0; j < count; j++) {
+            if (ELF64_ST_TYPE(symbols[j].st_info) != STT_FUNC || symbols[j].st_name >= strtab->sh_size) continue;
+
+            struct symbol* symbol = &profile->symbols[profile->symbol_count++];
+            symbol->addr = symbols[j].st_value;
+            symbol->size = symbols[j].st_size;
+            symbol->name = strndup(elf + strtab->sh_offset + symbols[j].st_name, strtab->sh_size - symbols[j].st_name);
+        }
+
+        qsort(profile->symbols, profile->symbol_count, sizeof(struct symbol), &compare_symbols);
+        break;
+    }
+
+    munmap(elf, st.st_size);
+}
+
+struct profile* profile_create(const char* image) {
+    struct profile* profile = calloc(1, sizeof(struct profile));
+    if (profile == NULL) {
+        printf("GRESKA: Alokacija nije uspela\n");
+        exit(EXIT_FAILURE);
+    }
+
+    profile_load_symbols(profile, image);
+    return profile;
+}
+
+//  Pravi tajmer nad procesorskim vremenom tekuce niti koji svakih
+//  interval_ns nanosekundi salje SIG_KICK sa vrednoscu kick
+int kick_timer_start(timer_t* timer, int kick, uint64_t interval_ns) {
+    struct sigevent event;
+    struct itimerspec period;
+
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIG_KICK;
+    event.sigev_value.sival_int = kick;
+    event._sigev_un._tid = gettid();
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, timer) < 0) {
+        perror("GRESKA: Neuspesan timer_create\n");
+        return -1;
+    }
+
+    period.it_interval.tv_sec = interval_ns / 1000000000UL;
+    period.it_interval.tv_nsec = interval_ns % 1000000000UL;
+    period.it_value = period.it_interval;
+
+    return timer_settime(*timer, 0, &period, NULL);
+}
+
+//  Pokrece tajmer koji na svakih 1/profile_hz sekundi procesorskog
+//  vremena niti virtuelnog procesora salje SIG_KICK toj niti
+int profile_start(struct guest* vm) {
+    return kick_timer_start(&vm->profile->timer, KICK_PROFILE, 1000000000L / profile_hz);
+}
+
+//  Uzima jedan uzorak: RIP i povratne adrese sa steka gosta
+void profile_sample(struct guest* vm) {
+    struct profile* profile = vm->profile;
+    struct kvm_regs regs;
+    struct profile_stack sample;
+
+    if (ioctl(vm->vm_vcpu, KVM_GET_REGS, &regs) < 0) {
+        profile->lost++;
+        return;
+    }
+
+    memset(&sample, 0, sizeof(sample));
+    sample.frames[sample.depth++] = regs.rip;
+
+    uint64_t frame_pointer = regs.rbp;
+    while (sample.depth < PROFILE_DEPTH && frame_pointer && (frame_pointer & 7) == 0) {
+        uint64_t* frame = guest_range(vm, frame_pointer, 2 * sizeof(uint64_t));
+        if (frame == NULL || frame[1] == 0) break;
+
+        sample.frames[sample.depth++] = frame[1];
+        if (frame[0] <= frame_pointer) break;
+        frame_pointer = frame[0];
+    }
+
+    uint64_t hash = 1469598103934665603UL;
+    for (int i = 0; i < sample.depth; i++) {
+        hash = (hash ^ sample.frames[i]) * 1099511628211UL;
+    }
+
+    profile->samples++;
+    for (int i = 0; i < PROFILE_SLOTS; i++) {
+        struct profile_stack* slot = &profile->stacks[(hash + i) % PROFILE_SLOTS];
+
+        if (slot->count == 0) {
+            *slot = sample;
+        } else if (slot->depth != sample.depth
+            || memcmp(slot->frames, sample.frames, sizeof(uint64_t) * sample.depth) != 0) {
+            continue;
+        }
+
+        slot->count++;
+        return;
+    }
+
+    profile->lost++;
+}
+
+void profile_write_frame(FILE* out, struct profile* profile, uint64_t addr) {
+    int low = 0, high = profile->symbol_count - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        struct symbol* symbol = &profile->symbols[middle];
+
+        if (addr < symbol->addr) {
+            high = middle - 1;
+        } else if (addr >= symbol->addr + (symbol->size ? symbol->size : 1)) {
+            low = middle + 1;
+        } else {
+            fprintf(out, ";%s", symbol->name);
+            return;
+        }
+    }
+
+    fprintf(out, ";0x%" PRIx64, addr);
+}
+
+//  Upisuje profile svih gostiju u "collapsed stack" formatu koji
+//  citaju flamegraph.pl i speedscope: "vm0;_start;printf;putc 42"
+void write_profile(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "GRESKA: Nije moguce otvoriti fajl %s\n", path);
+        return;
+    }
+
+    for (int i = 0; i < guest_count; i++) {
+        struct profile* profile = guests[i]->profile;
+        if (profile == NULL) continue;
+
+        for (int j = 0; j < PROFILE_SLOTS; j++) {
+            struct profile_stack* stack = &profile->stacks[j];
+            if (stack->count == 0) continue;
+
+            fprintf(out, "vm%d", guests[i]->id);
+            for (int k = stack->depth - 1; k >= 0; k--) {
+                profile_write_frame(out, profile, k ? stack->frames[k] - 1 : stack->frames[k]);
+            }
+            fprintf(out, " %" PRIu64 "\n", stack->count);
+        }
+
+        fprintf(stderr, "vm%d: %" PRIu64 " uzoraka, %" PRIu64 " izgubljeno\n",
+            guests[i]->id, profile->samples, profile->lost);
+    }
+
+    fclose(out);
+}
+
+uint64_t quota_period_ns = 100 * 1000000UL;
+uint64_t quota_ns = 0;
+uint64_t watchdog_ns = 0;
+
+uint64_t thread_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+//  Kvota: tajmer nad procesorskim vremenom niti izbacuje vCPU iz
+//  KVM_RUN svakih quota_ns / 4. Ako je gost u tekucem periodu potrosio
+//  quota_ns, nit spava do kraja perioda
+void quota_check(struct guest* vm) {
+    uint64_t now = now_ns();
+    uint64_t cpu = thread_cpu_ns();
+
+    if (now - vm->quota_period_start >= quota_period_ns) {
+        vm->quota_period_start = now;
+        vm->quota_cpu_start = cpu;
+        return;
+    }
+
+    if (cpu - vm->quota_cpu_start < quota_ns) return;
+
+    struct timespec until;
+    uint64_t end = vm->quota_period_start + quota_period_ns;
+    until.tv_sec = end / 1000000000UL;
+    until.tv_nsec = end % 1000000000UL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+
+    vm->throttled++;
+    vm->throttled_ns += now_ns() - now;
+    vm->quota_period_start = now_ns();
+    vm->quota_cpu_start = thread_cpu_ns();
+}
+
+//  Watchdog: tajmer nad procesorskim vremenom niti okida posle
+//  watchdog_ns potrosenog vremena. Gost koji za to vreme nije imao
+//  nijedan izlazak osim ovih kick-ova vrti se u petlji i zaustavlja
+//  se. Gost koji ceka u HLT-u ne trosi procesor, pa ga watchdog ne dira
+int watchdog_check(struct guest* vm) {
+    uint64_t exits = total_exits(&vm->stats) - vm->stats.exits[KVM_EXIT_INTR];
+
+    if (exits == vm->watchdog_exits) {
+        fprintf(stderr, "vm%d: watchdog: nema napretka posle %" PRIu64 " ms procesorskog vremena\n",
+            vm->id, watchdog_ns / 1000000);
+        vm->stop_reason = "watchdog";
+        return 1;
+    }
+
+    vm->watchdog_exits = exits;
+    return 0;
+}
+
+//  Core dump bez zaustavljanja gosta
+//
+//  Na GUEST_CORE_SIGNAL memorija se prepisuje u ELF core fajl dok gost
+//  radi, uz ukljucen KVM dirty log. Svaka sledeca runda prepisuje samo
+//  stranice upisane u prethodnoj, dok ih ne ostane malo. Tek tada se
+//  vCPU zaustavlja izmedju dva KVM_RUN-a, prepisuju se poslednje
+//  stranice, citaju registri i tabele stranica, pa gost nastavlja.
+//  Fajl ima PT_NOTE sa NT_PRSTATUS i PT_LOAD za svaki mapirani opseg
+//  virtuelnih adresa, pa ga gdb otvara uz guestN.elf.
+
+#define CORE_MAX_SEGMENTS 64
+#define CORE_ROUNDS 8
+#define CORE_ROUND_PAGES 64
+#define CORE_PAUSE_TIMEOUT_NS (1000 * 1000000UL)
+
+const char* core_path = "core.vm%d";
+
+//  Belezi stranice koje domacin upisuje u memoriju gosta dok traje
+//  core dump. KVM-ov dirty log vidi samo upise samog gosta
+void guest_mark_dirty(struct guest* vm, const void* host, size_t len) {
+    atomic_thread_fence(memory_order_seq_cst);
+    _Atomic uint64_t* bitmap = atomic_load(&vm->host_dirty);
+
+    if (bitmap == NULL || len == 0) return;
+
+    uint64_t first = ((const char*) host - vm->mem) / PAGE_SIZE;
+    uint64_t last = ((const char*) host - vm->mem + len - 1) / PAGE_SIZE;
+    for (uint64_t page = first; page <= last; page++) {
+        atomic_fetch_or(&bitmap[page / 64], 1UL << (page % 64));
+    }
+}
+
+//  Zaustavlja vCPU izmedju dva KVM_RUN-a. Vraca 0 kada je zaustavljen,
+//  1 ako je gost vec zavrsio i -1 ako obrada izlaska predugo blokira
+int pause_guest(struct guest* vm) {
+    if (vm->end_ns != 0) return 1;
+
+    atomic_fetch_or(&vm->kicks, KICK_PAUSE);
+    vm->kvm_run->immediate_exit = 1;
+    pthread_kill(vm->thread, SIG_KICK);
+
+    uint64_t deadline = now_ns() + CORE_PAUSE_TIMEOUT_NS;
+    for (;;) {
+        struct timespec until;
+        uint64_t wake = now_ns() + 10 * 1000000UL;
+        until.tv_sec = wake / 1000000000UL;
+        until.tv_nsec = wake % 1000000000UL;
+
+        if (sem_clockwait(&vm->paused, CLOCK_MONOTONIC, &until) == 0) return 0;
+        if (vm->end_ns != 0) return 1;
+        if (now_ns() < deadline) continue;
+
+        //  Ako nit jos nije preuzela zahtev, povlaci se; inace ce
+        //  se uskoro zaustaviti
+        if (atomic_fetch_and(&vm->kicks, ~KICK_PAUSE) & KICK_PAUSE) return -1;
+        deadline = UINT64_MAX;
+    }
+}
+
+void resume_guest(struct guest* vm) {
+    sem_post(&vm->resume);
+}
+
+struct core_segments {
+    Elf64_Phdr phdr[CORE_MAX_SEGMENTS];
+    int count;
+    int dropped;
+    uint64_t mem_size;
+    uint64_t data_offset;
+};
+
+//  Dodaje PT_LOAD za opseg iz guest_mappings. Podaci su u fajlu na
+//  data_offset + fizicka adresa, opsezi van memorije (MMIO) se preskacu
+void core_add_segment(void* ctx, uint64_t virt, uint64_t phys, uint64_t size) {
+    struct core_segments* segments = ctx;
+
+    if (phys >= segments->mem_size) return;
+    if (phys + size > segments->mem_size) size = segments->mem_size - phys;
+    if (segments->count == CORE_MAX_SEGMENTS) {
+        segments->dropped++;
+        return;
+    }
+
+    Elf64_Phdr* phdr = &segments->phdr[segments->count++];
+    memset(phdr, 0, sizeof(*phdr));
+    phdr->p_type = PT_LOAD;
+    phdr->p_flags = PF_R | PF_W | PF_X;
+    phdr->p_offset = segments->data_offset + phys;
+    phdr->p_vaddr = virt;
+    phdr->p_paddr = phys;
+    phdr->p_filesz = size;
+    phdr->p_memsz = size;
+    phdr->p_align = PAGE_SIZE;
+}
+
+int page_is_zero(const char* page) {
+    const uint64_t* words = (const uint64_t*) page;
+
+    for (int i = 0; i < PAGE_SIZE / 8; i++) {
+        if (words[i]) return 0;
+    }
+    return 1;
+}
+
+//  Upisuje stranice oznacene u bitmap (sve ako je bitmap NULL, osim
+//  nultih, koje ostaju rupe u fajlu). Susedne stranice idu jednim pwrite-om
+int core_write_pages(struct guest* vm, int fd, uint64_t data_offset, const uint64_t* bitmap) {
+    uint64_t pages = vm->mem_size / PAGE_SIZE;
+    uint64_t run_start = 0, run_pages = 0;
+
+    for (uint64_t page = 0; page <= pages; page++) {
+        int take = page < pages && (bitmap ? (bitmap[page / 64] >> (page % 64)) & 1
+            : !page_is_zero(vm->mem + page * PAGE_SIZE));
+
+        if (take) {
+            if (run_pages == 0) run_start = page;
+            run_pages++;
+            continue;
+        }
+        if (run_pages == 0) continue;
+
+        uint64_t offset = run_start * PAGE_SIZE;
+        if (pwrite(fd, vm->mem + offset, run_pages * PAGE_SIZE, data_offset + offset) < 0) {
+            return -1;
+        }
+        run_pages = 0;
+    }
+
+    return 0;
+}
+
+//  Cita (i brise) KVM-ov dirty log i dodaje mu stranice koje je upisao
+//  domacin. Vraca broj prljavih stranica
+int64_t core_collect_dirty(struct guest* vm, uint64_t* bitmap, _Atomic uint64_t* host_dirty, size_t words) {
+    struct kvm_dirty_log log;
+    int64_t count = 0;
+
+    memset(bitmap, 0, words * sizeof(uint64_t));
+    memset(&log, 0, sizeof(log));
+    log.slot = 0;
+    log.dirty_bitmap = bitmap;
+
+    if (ioctl(vm->vm_fd, KVM_GET_DIRTY_LOG, &log) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_GET_DIRTY_LOG\n");
+        fprintf(stderr, "KVM_GET_DIRTY_LOG: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < words; i++) {
+        bitmap[i] |= atomic_exchange(&host_dirty[i], 0);
+        count += __builtin_popcountll(bitmap[i]);
+    }
+
+    return count;
+}
+
+//  Registri vCPU-a u rasporedu koji gdb ocekuje u NT_PRSTATUS
+void core_prstatus(struct guest* vm, struct elf_prstatus* status) {
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+
+    memset(status, 0, sizeof(*status));
+    status->pr_pid = vm->id + 1;
+    if (ioctl(vm->vm_vcpu, KVM_GET_REGS, &regs) < 0 || ioctl(vm->vm_vcpu, KVM_GET_SREGS, &sregs) < 0) {
+        fprintf(stderr, "GRESKA: vm%d: registri nisu procitani: %s\n", vm->id, strerror(errno));
+        return;
+    }
+
+    struct user_regs_struct* r = (struct user_regs_struct*) &status->pr_reg;
+    r->r15 = regs.r15;
+    r->r14 = regs.r14;
+    r->r13 = regs.r13;
+    r->r12 = regs.r12;
+    r->rbp = regs.rbp;
+    r->rbx = regs.rbx;
+    r->r11 = regs.r11;
+    r->r10 = regs.r10;
+    r->r9 = regs.r9;
+    r->r8 = regs.r8;
+    r->rax = regs.rax;
+    r->rcx = regs.rcx;
+    r->rdx = regs.rdx;
+    r->rsi = regs.rsi;
+    r->rdi = regs.rdi;
+    r->rip = regs.rip;
+    r->eflags = regs.rflags;
+    r->rsp = regs.rsp;
+    r->cs = sregs.cs.selector;
+    r->ss = sregs.ss.selector;
+    r->ds = sregs.ds.selector;
+    r->es = sregs.es.selector;
+    r->fs = sregs.fs.selector;
+    r->gs = sregs.gs.selector;
+    r->fs_base = sregs.fs.base;
+    r->gs_base = sregs.gs.base;
+}
+
+//  Zaglavlje, PT_NOTE i PT_LOAD-ovi na pocetku fajla. Prostor za njih
+//  je rezervisan za CORE_MAX_SEGMENTS, memorija pocinje na data_offset
+int core_write_headers(int fd, struct core_segments* segments, struct elf_prstatus* status) {
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr note;
+    Elf64_Nhdr nhdr;
+    char name[8] = "CORE";
+    uint64_t note_offset = sizeof(Elf64_Ehdr) + (CORE_MAX_SEGMENTS + 1) * sizeof(Elf64_Phdr);
+
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_CORE;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = segments->count + 1;
+
+    nhdr.n_namesz = 5;
+    nhdr.n_descsz = sizeof(struct elf_prstatus);
+    nhdr.n_type = NT_PRSTATUS;
+
+    memset(&note, 0, sizeof(note));
+    note.p_type = PT_NOTE;
+    note.p_offset = note_offset;
+    note.p_filesz = sizeof(nhdr) + sizeof(name) + sizeof(struct elf_prstatus);
+    note.p_align = 4;
+
+    struct iovec iov[] = {
+        {&ehdr, sizeof(ehdr)},
+        {&note, sizeof(note)},
+        {segments->phdr, segments->count * sizeof(Elf64_Phdr)},
+    };
+    struct iovec note_iov[] = {
+        {&nhdr, sizeof(nhdr)},
+        {name, sizeof(name)},
+        {status, sizeof(*status)},
+    };
+
+    if (pwritev(fd, iov, 3, 0) < 0 || pwritev(fd, note_iov, 3, note_offset) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+//  Uzima brave pod kojima niti za disk i prenos pisu u memoriju gosta.
+//  Nit prenosa moze da ceka na sporom fd-u, pa se na nju ceka najvise
+//  CORE_PAUSE_TIMEOUT_NS
+int core_quiesce(struct guest* vm) {
+    struct timespec until;
+    uint64_t deadline = now_ns() + CORE_PAUSE_TIMEOUT_NS;
+
+    until.tv_sec = deadline / 1000000000UL;
+    until.tv_nsec = deadline % 1000000000UL;
+    if (pthread_mutex_clocklock(&vm->stream.transfer, CLOCK_MONOTONIC, &until) != 0) return -1;
+    if (vm->disk) pthread_mutex_lock(&vm->disk->lock);
+    return 0;
+}
+
+void core_unquiesce(struct guest* vm) {
+    if (vm->disk) pthread_mutex_unlock(&vm->disk->lock);
+    pthread_mutex_unlock(&vm->stream.transfer);
+}
+
+int core_dump(struct guest* vm) {
+    char path[PATH_MAX];
+    uint64_t pages = vm->mem_size / PAGE_SIZE;
+    size_t words = (pages + 63) / 64;
+    uint64_t note_end = sizeof(Elf64_Ehdr) + (CORE_MAX_SEGMENTS + 1) * sizeof(Elf64_Phdr)
+        + sizeof(Elf64_Nhdr) + 8 + sizeof(struct elf_prstatus);
+    struct core_segments segments = {.count = 0, .dropped = 0, .mem_size = vm->mem_size,
+        .data_offset = (note_end + PAGE_SIZE - 1) & ~(uint64_t) (PAGE_SIZE - 1)};
+    struct elf_prstatus status;
+    int64_t dirty_pages, copied_pages = 0;
+    int rounds = 0, ret = -1;
+
+    if (vm->vm_fd < 0) {
+        fprintf(stderr, "GRESKA: vm%d: core dump je moguc samo za KVM gosta\n", vm->id);
+        return -1;
+    }
+
+    //  Bitmapa domacina ostaje gostu do destroy_guest: nit koja je
+    //  procitala pokazivac pre nego sto je vracen na NULL moze jos da
+    //  upisuje u nju, a posle neuspele pauze to moze biti i vCPU
+    if (vm->host_dirty_bitmap == NULL) vm->host_dirty_bitmap = calloc(words, sizeof(uint64_t));
+    _Atomic uint64_t* host_dirty = vm->host_dirty_bitmap;
+    for (size_t i = 0; host_dirty && i < words; i++) atomic_store(&host_dirty[i], 0);
+
+    int fd = guest_path(path, sizeof(path), core_path, vm->id) < 0 ? -1
+        : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    uint64_t* dirty = calloc(words, sizeof(uint64_t));
+    if (fd < 0 || dirty == NULL || host_dirty == NULL) {
+        fprintf(stderr, "GRESKA: vm%d: core dump %s: %s\n", vm->id, path, strerror(errno));
+        goto out;
+    }
+
+    uint64_t start = now_ns();
+    if (set_memory_region(vm, KVM_MEM_LOG_DIRTY_PAGES) < 0) goto out;
+    atomic_store(&vm->host_dirty, host_dirty);
+
+    //  Prva runda upisuje celu memoriju, a dirty log od tada belezi
+    //  sve sto treba ponovo prepisati
+    if (core_write_pages(vm, fd, segments.data_offset, NULL) < 0) goto write_error;
+    do {
+        if ((dirty_pages = core_collect_dirty(vm, dirty, host_dirty, words)) < 0) goto stop_log;
+        if (core_write_pages(vm, fd, segments.data_offset, dirty) < 0) goto write_error;
+        copied_pages += dirty_pages;
+        rounds++;
+    } while (dirty_pages > CORE_ROUND_PAGES && rounds < CORE_ROUNDS);
+
+    int paused = pause_guest(vm);
+    if (paused < 0) {
+        fprintf(stderr, "GRESKA: vm%d: vCPU nije zaustavljen, core dump prekinut\n", vm->id);
+        goto stop_log;
+    }
+
+    //  Nit za prstenove diska i nit prenosa pisu u memoriju i dok vCPU
+    //  stoji, pa se i one zaustavljaju do kraja poslednje runde
+    uint64_t pause_start = now_ns();
+    if (paused == 0 && core_quiesce(vm) < 0) {
+        fprintf(stderr, "GRESKA: vm%d: nit prenosa nije zaustavljena, core dump prekinut\n", vm->id);
+        resume_guest(vm);
+        goto stop_log;
+    }
+    atomic_store(&vm->host_dirty, NULL);
+    dirty_pages = core_collect_dirty(vm, dirty, host_dirty, words);
+    if (dirty_pages >= 0 && core_write_pages(vm, fd, segments.data_offset, dirty) < 0) dirty_pages = -1;
+    core_prstatus(vm, &status);
+    guest_mappings(vm->mem, vm->mem_size, &core_add_segment, &segments);
+    if (paused == 0) {
+        core_unquiesce(vm);
+        resume_guest(vm);
+    }
+    uint64_t pause_ns = now_ns() - pause_start;
+
+    if (dirty_pages < 0 || core_write_headers(fd, &segments, &status) < 0) goto write_error;
+    if (segments.dropped) {
+        fprintf(stderr, "vm%d: core dump: %d opsega preko %d nije upisano\n", vm->id, segments.dropped, CORE_MAX_SEGMENTS);
+    }
+
+    fprintf(stderr, "vm%d: core dump %s: %d opsega, %d rundi (%" PRId64 " prepisanih stranica), "
+        "pauza %.1f us za %" PRId64 " stranica, ukupno %.1f ms\n", vm->id, path, segments.count, rounds,
+        copied_pages, pause_ns / 1e3, dirty_pages, (now_ns() - start) / 1e6);
+    ret = 0;
+    goto stop_log;
+
+write_error:
+    fprintf(stderr, "GRESKA: vm%d: upis core dump-a %s: %s\n", vm->id, path, strerror(errno));
+stop_log:
+    atomic_store(&vm->host_dirty, NULL);
+    set_memory_region(vm, 0);
+out:
+    if (fd >= 0) close(fd);
+    free(dirty);
+    return ret;
+}
+
+//  Posveceno jezgro (--dedicated)
+//
+//  Za goste kojima je bitno kasnjenje. Nit virtuelnog procesora se vezuje
+//  za svoje jezgro, a KVM ne izlazi na HLT, PAUSE i MWAIT (koliko domacin
+//  dozvoljava KVM_CAP_X86_DISABLE_EXITS), pa gost koji ceka ostaje u
+//  gostu. Prsten diska prati nit za prstenove na susednom jezgru: gost
+//  posle predaje zahteva kratko ceka da used stigne avail i tek onda
+//  izlazi na DISK_NOTIFY. Citanje DISK_NOTIFY porta govori gostu da li
+//  nit postoji, a nit se pokrece samo za gosta sa --disk.
+//
+//  Jezgra se uzimaju iz skupa koji je procesu dozvoljen i vracaju kad se
+//  gost zavrsi, pa dva gosta nikad ne dele jezgro. Bez --daemon hipervizor
+//  odbija --dedicated kad jezgara nema za sve goste, a proces gostiju
+//  (--workers) preskace jezgra gostiju pre svog prvog
+
+int dedicated = 0;
+pthread_mutex_t dedicated_lock = PTHREAD_MUTEX_INITIALIZER;
+cpu_set_t dedicated_free;
+
+//  Broj jezgara koja trazi jedan gost
+int dedicated_cores() {
+    return disk_path ? 2 : 1;
+}
+
+//  Skup slobodnih jezgara, bez prvih skip dozvoljenih. Poziva se pre
+//  pokretanja niti gostiju. Vraca broj slobodnih jezgara
+int dedicated_init(int skip) {
+    if (sched_getaffinity(0, sizeof(dedicated_free), &dedicated_free) < 0) {
+        perror("GRESKA: Neuspesan sched_getaffinity\n");
+        return 0;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && skip > 0; cpu++) {
+        if (CPU_ISSET(cpu, &dedicated_free)) {
+            CPU_CLR(cpu, &dedicated_free);
+            skip--;
+        }
+    }
+
+    return CPU_COUNT(&dedicated_free);
+}
+
+//  Uzima slobodno jezgro ili vraca -1
+int dedicated_take() {
+    int cpu;
+
+    pthread_mutex_lock(&dedicated_lock);
+    for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &dedicated_free); cpu++);
+    if (cpu < CPU_SETSIZE) {
+        CPU_CLR(cpu, &dedicated_free);
+    } else {
+        cpu = -1;
+    }
+    pthread_mutex_unlock(&dedicated_lock);
+
+    return cpu;
+}
+
+void dedicated_release(int cpu) {
+    if (cpu < 0) return;
+
+    pthread_mutex_lock(&dedicated_lock);
+    CPU_SET(cpu, &dedicated_free);
+    pthread_mutex_unlock(&dedicated_lock);
+}
+
+int pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+//  Iskljucuje izlaske na HLT, PAUSE i MWAIT koje domacin dozvoljava.
+//  Mora se pozvati pre pravljenja vCPU-a
+int disable_exits(struct guest* vm) {
+    uint64_t wanted = KVM_X86_DISABLE_EXITS_HLT | KVM_X86_DISABLE_EXITS_PAUSE | KVM_X86_DISABLE_EXITS_MWAIT;
+    struct kvm_enable_cap cap = {.cap = KVM_CAP_X86_DISABLE_EXITS};
+    int allowed = ioctl(vm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_DISABLE_EXITS);
+
+    vm->disabled_exits = 0;
+    if (allowed <= 0 || (allowed & wanted) == 0) {
+        fprintf(stderr, "vm%d: domacin ne dozvoljava KVM_CAP_X86_DISABLE_EXITS\n", vm->id);
+        return 0;
+    }
+
+    cap.args[0] = allowed & wanted;
+    if (ioctl(vm->vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        perror("GRESKA: Neuspesan ioctl KVM_ENABLE_CAP\n");
+        fprintf(stderr, "KVM_CAP_X86_DISABLE_EXITS: %s\n", strerror(errno));
+        return -1;
+    }
+
+    vm->disabled_exits = cap.args[0];
+    return 0;
+}
+
+int disk_poll(struct guest* vm);
+
+//  Nit za prstenove, vrti se bez spavanja na svom jezgru
+void* ring_poll_thread(void* par) {
+    struct guest* vm = (struct guest*) par;
+
+    while (!atomic_load_explicit(&vm->poll_stop, memory_order_relaxed)) {
+        vm->poll_loops++;
+        if (vm->disk && disk_poll(vm) > 0) {
+            vm->poll_batches++;
+        } else {
+            __builtin_ia32_pause();
+        }
+    }
+
+    return NULL;
+}
+
+//  Vezuje vCPU za slobodno jezgro, a za gosta sa diskom pokrece i nit za
+//  prstenove na drugom slobodnom jezgru. Vraca -1 kad nema jezgra za vCPU
+int dedicated_start(struct guest* vm) {
+    vm->poll_loops = 0;
+    vm->poll_batches = 0;
+    vm->poll_core = -1;
+    vm->core = dedicated_take();
+    if (vm->core < 0) {
+        fprintf(stderr, "GRESKA: vm%d: nema slobodnog jezgra za --dedicated\n", vm->id);
+        return -1;
+    }
+
+    if (pin_thread(pthread_self(), vm->core) != 0) {
+        fprintf(stderr, "GRESKA: vm%d: vCPU nije vezan za jezgro %d\n", vm->id, vm->core);
+    }
+    vm->dedicated = 1;
+
+    if (vm->disk == NULL) {
+        return 0;
+    }
+
+    //  Nit koja bi delila jezgro sa vCPU-om dobija procesor tek kada
+    //  raspored istisne vCPU, pa bi gost cekao duze nego uz izlazak
+    vm->poll_core = dedicated_take();
+    if (vm->poll_core < 0) {
+        fprintf(stderr, "vm%d: nema slobodnog jezgra za nit za prstenove, disk radi preko izlazaka\n", vm->id);
+        return 0;
+    }
+
+    atomic_store(&vm->poll_stop, 0);
+    if (pthread_create(&vm->poll_thread, NULL, &ring_poll_thread, vm) != 0) {
+        perror("GRESKA: Nije moguce pokrenuti nit za prstenove\n");
+        dedicated_release(vm->poll_core);
+        vm->poll_core = -1;
+        return 0;
+    }
+    pin_thread(vm->poll_thread, vm->poll_core);
+    vm->polling = 1;
+
+    return 0;
+}
+
+//  Vrednost jedne KVM statistike po imenu ili 0
+uint64_t kvm_stat_value(int fd, const char* name) {
+    struct kvm_stats_header header;
+    uint64_t value = 0;
+
+    if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header)) return 0;
+
+    size_t desc_size = sizeof(struct kvm_stats_desc) + header.name_size;
+    char* descs = malloc(desc_size * header.num_desc);
+    if (descs == NULL || pread(fd, descs, desc_size * header.num_desc, header.desc_offset) < 0) {
+        free(descs);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < header.num_desc; i++) {
+        struct kvm_stats_desc* desc = (struct kvm_stats_desc*) (descs + i * desc_size);
+        if (desc->size == 1 && strcmp(desc->name, name) == 0) {
+            pread(fd, &value, sizeof(value), header.data_offset + desc->offset);
+            break;
+        }
+    }
+
+    free(descs);
+    return value;
+}
+
+//  Zaustavlja nit za prstenove i ispisuje sta je postignuto: izlasci
+//  iz KVM-a (i po sekundi), koliko ih je stiglo do hipervizora, koliko
+//  je puta nit obradila prsten i koliko je gost ipak javljao
+void dedicated_stop(struct guest* vm) {
+    if (!vm->dedicated) return;
+
+    if (vm->polling) {
+        atomic_store(&vm->poll_stop, 1);
+        pthread_join(vm->poll_thread, NULL);
+        vm->polling = 0;
+    }
+    dedicated_release(vm->poll_core);
+    dedicated_release(vm->core);
+
+    if (vm->vcpu_stats_fd < 0) vm->vcpu_stats_fd = ioctl(vm->vm_vcpu, KVM_GET_STATS_FD, 0);
+    uint64_t exits = kvm_stat_value(vm->vcpu_stats_fd, "exits");
+    uint64_t halts = kvm_stat_value(vm->vcpu_stats_fd, "halt_exits");
+    double seconds = (now_ns() - vm->first_run_ns) / 1e9;
+
+    fprintf(stderr, "vm%d: jezgro %d, prsten diska: %s, bez izlazaka na%s%s%s%s\n", vm->id,
+        vm->core, vm->disk == NULL ? "-" : vm->poll_loops ? "nit na drugom jezgru" : "izlasci",
+        vm->disabled_exits & KVM_X86_DISABLE_EXITS_HLT ? " hlt" : "",
+        vm->disabled_exits & KVM_X86_DISABLE_EXITS_PAUSE ? " pause" : "",
+        vm->disabled_exits & KVM_X86_DISABLE_EXITS_MWAIT ? " mwait" : "",
+        vm->disabled_exits ? "" : " -");
+    fprintf(stderr, "vm%d: %" PRIu64 " izlazaka iz KVM-a (%.0f/s, hlt %" PRIu64 "), %" PRIu64
+        " u hipervizor, prsten obradjen %" PRIu64 " puta u %" PRIu64 " prolaza, javljanja %" PRIu64 "\n",
+        vm->id, exits, exits / seconds, halts, total_exits(&vm->stats), vm->poll_batches, vm->poll_loops,
+        vm->disk ? vm->disk->notifies : 0);
+}
+
+void* run_guest(void* par) {
+
+    struct guest* vm = (struct guest*) par;
+    int stop = 0;
+    int ret;
+
+    current_vm = vm;
+    if (vm->profile && profile_start(vm) < 0) {
+        fprintf(stderr, "GRESKA: vm%d: profiler nije pokrenut\n", vm->id);
+    }
+
+    vm->first_run_ns = now_ns();
+    vm->quota_period_start = vm->first_run_ns;
+
+    vm->polling = 0;
+    vm->dedicated = 0;
+    if (dedicated && vm->vm_vcpu >= 0 && dedicated_start(vm) < 0) {
+        vm->stop_reason = "dedicated";
+        stop = 1;
+    }
+    vm->quota_cpu_start = thread_cpu_ns();
+
+    if (quota_ns && kick_timer_start(&vm->quota_timer, KICK_QUOTA, quota_ns / 4) < 0) {
+        fprintf(stderr, "GRESKA: vm%d: kvota nije postavljena\n", vm->id);
+    }
+    if (watchdog_ns && kick_timer_start(&vm->watchdog_timer, KICK_WATCHDOG, watchdog_ns) < 0) {
+        fprintf(stderr, "GRESKA: vm%d: watchdog nije pokrenut\n", vm->id);
+    }
+
+    if (vm->irqchip) {
+        sem_init(&vm->console_armed, 0, 1);
+        if (pthread_create(&vm->console_thread, NULL, &console_irq_thread, vm) != 0) {
+            fprintf(stderr, "GRESKA: vm%d: nit konzole nije pokrenuta\n", vm->id);
+            vm->irqchip = 0;
+        }
+    }
+
+#ifdef ALLOC_COUNT
+    uint64_t alloc_start = alloc_count;
+#endif
+    while (stop == 0) {
+
+        uint64_t start = now_ns();
+        ret = vm->backend->run(vm);
+        uint64_t exited = now_ns();
+        hist_record(&vm->stats.kvm_run_ns, exited - start);
+
+        if (ret < 0 && errno != EINTR) {
+            perror("GRESKA: Neuspesno izvrsavanje gosta\n");
+            fprintf(stderr, "%s: %s\n", vm->backend->name, strerror(errno));
+            break;
+        }
+
+        vm->kvm_run->immediate_exit = 0;
+        int kicks = atomic_exchange(&vm->kicks, 0);
+        if (kicks & KICK_PROFILE) {
+            profile_sample(vm);
+        }
+        if (kicks & KICK_PAUSE) {
+            sem_post(&vm->paused);
+            sem_wait(&vm->resume);
+        }
+        if (kicks & KICK_STOP) {
+            break;
+        }
+        if ((kicks & KICK_WATCHDOG) && watchdog_check(vm)) {
+            break;
+        }
+        if (kicks & KICK_QUOTA) {
+            quota_check(vm);
+        }
+
+        if (vm->coalesced_ring && coalesced_mmio_flush(vm) < 0) {
+            break;
+        }
+
+        if (ret < 0) {
+            vm->stats.exits[KVM_EXIT_INTR]++;
+            continue;
+        }
+
+        int exit_reason = vm->kvm_run->exit_reason;
+        vm->stats.exits[exit_reason < EXIT_REASONS ? exit_reason : 0]++;
+        State file_state = vm->current_file_state;
+
+        if (exit_reason < HANDLER_COUNT && handlers[exit_reason]) {
+            stop = handlers[exit_reason](vm);
+        } else {
+            printf("Unknown exit reason %d\n", exit_reason);
+            stop = -1;
+        }
+
+        hist_record(&vm->stats.handler_ns, now_ns() - exited);
+
+        if (vm->trace) {
+            trace_exit(vm, exited, file_state);
+        }
+    }
+#ifdef ALLOC_COUNT
+    vm->allocations = alloc_count - alloc_start;
+#endif
+
+    if (vm->profile) timer_delete(vm->profile->timer);
+    if (quota_ns) timer_delete(vm->quota_timer);
+    if (watchdog_ns) timer_delete(vm->watchdog_timer);
+    stream_join(&vm->stream);
+    dedicated_stop(vm);
+
+    if (vm->irqchip) {
+        pthread_cancel(vm->console_thread);
+        pthread_join(vm->console_thread, NULL);
+    }
+
+    pthread_mutex_lock(&guests_lock);
+    vm->end_ns = now_ns();
+    pthread_mutex_unlock(&guests_lock);
+    return NULL;
+} 
+
+//  Ucitava sliku gosta u memoriju od starting_adress
+void load_image(struct guest* vm, FILE* img, int starting_adress) {
+
+    char* p = vm->mem + starting_adress;
+    while (feof(img) == 0 && ferror(img) == 0 && p < vm->mem + vm->mem_size) {
+        int r = fread(p, 1, 1024 < vm->mem + vm->mem_size - p ? 1024 : vm->mem + vm->mem_size - p, img);
+        p += r;
+    }
+}
+
+pthread_t start_guest(struct guest* vm, FILE* img, int starting_adress) {
+
+    pthread_t handle;
+
+    load_image(vm, img, starting_adress);
+
+    if (pthread_create(&handle, NULL, &run_guest, vm) == 0) {
+        vm->thread = handle;
+        return handle;
+    } else {
+        return -1;
+    }
+}
+
+int next_guest_id = 0;
+
+//  Postavlja stanje gosta koje ne zavisi od nacina izvrsavanja
+int init_guest_state(struct guest* vm, int starting_address) {
+
+    vm->lock = 0;
+    vm->file_head = NULL;
+    vm->current_file = NULL;
+    vm->current_file_state = &start_file_operation;
+    vm->reserved_size = starting_address;
+    vm->balloon_state = &balloon_start;
+    vm->balloon_lock = 0;
+    vm->balloon_pages = 0;
+    vm->balloon_target = 0;
+    vm->rss_pages = 0;
+    vm->vm_stats_fd = -1;
+    vm->vcpu_stats_fd = -1;
+    memset(&vm->stats, 0, sizeof(vm->stats));
+    vm->trace = NULL;
+
+    vm->backend = &kvm_backend;
+    vm->replay = NULL;
+    vm->console_in = STDIN_FILENO;
+    vm->console_out = STDOUT_FILENO;
+    vm->bench_half = 0;
+    vm->first_run_ns = 0;
+    vm->end_ns = 0;
+    vm->allocations = 0;
+    vm->kicks = 0;
+    vm->profile = NULL;
+    vm->irqchip = 0;
+    vm->throttled = 0;
+    vm->throttled_ns = 0;
+    vm->watchdog_exits = 0;
+    vm->stop_reason = NULL;
+    vm->coalesced_ring = NULL;
+    vm->mmio_console_bytes = 0;
+    vm->disk = NULL;
+    vm->host_dirty = NULL;
+    vm->host_dirty_bitmap = NULL;
+    memset(&vm->stream, 0, sizeof(vm->stream));
+    pthread_mutex_init(&vm->stream.lock, NULL);
+    pthread_mutex_init(&vm->stream.transfer, NULL);
+    pthread_cond_init(&vm->stream.progress, NULL);
+    memset(vm->lookup, 0, sizeof(vm->lookup));
+    io_limit_init(vm);
+    vm->client = -1;
+
+    vm->dir_fd = open(sandbox_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (vm->dir_fd < 0) {
+        fprintf(stderr, "GRESKA: Nije moguce otvoriti direktorijum %s: %s\n", sandbox_path, strerror(errno));
+        return -1;
+    }
+
+    if (logger && log_guest_open(vm) < 0) {
+        return -1;
+    }
+
+    if (trace_file) {
+        vm->trace = calloc(1, sizeof(struct trace_ring));
+        if (vm->trace == NULL) {
+            printf("GRESKA: Alokacija nije uspela\n");
+            return -1;
+        }
+    }
+
+    return starting_address;
+}
+
+int init_guest(struct hypervisor* hypervisor, struct guest* vm, size_t mem_size, enum PageSize page_size, FILE* img) {
+
+    int starting_address;
+
+    vm->launch_ns = now_ns();
+    vm->id = next_guest_id++;
+    vm->disabled_exits = 0;
+
+    //  Polja koja destroy_guest oslobadja, da bi mogao da pocisti i gosta
+    //  cija inicijalizacija nije uspela na pola puta
+    vm->vm_fd = -1;
+    vm->mem_fd = -1;
+    vm->vm_vcpu = -1;
+    vm->dir_fd = -1;
+    vm->vm_stats_fd = -1;
+    vm->vcpu_stats_fd = -1;
+    vm->mem = MAP_FAILED;
+    vm->mem_size = 0;
+    vm->kvm_run = MAP_FAILED;
+    vm->file_head = NULL;
+    memset(vm->lookup, 0, sizeof(vm->lookup));
+    vm->disk = NULL;
+    vm->console_in = STDIN_FILENO;
+    vm->console_out = STDOUT_FILENO;
+    vm->host_dirty_bitmap = NULL;
+    sem_init(&vm->paused, 0, 0);
+    sem_init(&vm->resume, 0, 0);
+
+    if (create_guest(hypervisor, vm) < 0) return -1;
+    if (create_memory_region(vm, mem_size) < 0) return -1;
+    if (use_irqchip && setup_irqchip(vm) < 0) return -1;
+    if (dedicated && disable_exits(vm) < 0) return -1;
+    if (use_pmu && setup_pmu(vm) < 0) return -1;
+    if (create_vcpu(vm) < 0) return -1;
+    if ((use_simd || use_pmu) && setup_cpuid(hypervisor, vm) < 0) return -1;
+    if (create_kvm_run(hypervisor, vm) < 0) return - 1; 
+    if ((starting_address = setup_long_mode(hypervisor, vm, mem_size, page_size)) < 0) return -1;
+    if (setup_registers(vm) < 0) return -1;
+
+    if (init_guest_state(vm, starting_address) < 0) return -1;
+    vm->irqchip = use_irqchip;
+    if (setup_coalesced_mmio(hypervisor, vm) < 0) return -1;
+    if (disk_path && disk_open(vm) < 0) return -1;
+
+    return starting_address;
+}
+
+//  Kreira gosta bez KVM-a: memorija je obican bafer sa istim tabelama
+//  stranica, a izlaske umesto procesora daje replay backend. Izvor je
+//  "synthetic" ili fajl traga snimljen sa --trace
+int init_replay_guest(struct guest* vm, size_t mem_size, enum PageSize page_size, const char* source, uint64_t loops) {
+
+    vm->launch_ns = now_ns();
+    vm->id = next_guest_id++;
+    vm->vm_fd = -1;
+    vm->vm_vcpu = -1;
+    vm->mem_fd = -1;
+    sem_init(&vm->paused, 0, 0);
+    sem_init(&vm->resume, 0, 0);
+    vm->mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    vm->kvm_run = calloc(1, REPLAY_DATA_OFFSET + PAGE_SIZE);
+    if (vm->mem == MAP_FAILED || vm->kvm_run == NULL) {
+        perror("GRESKA: Alokacija memorije gosta nije uspela\n");
+        return -1;
+    }
+    vm->mem_size = mem_size;
+
+    if (init_guest_state(vm, setup_page_tables(vm, mem_size, page_size)) < 0) return -1;
+    vm->console_out = open("/dev/null", O_WRONLY);
+
+    vm->replay = calloc(1, sizeof(struct replay));
+    if (vm->replay == NULL) {
+        printf("GRESKA: Alokacija nije uspela\n");
+        return -1;
+    }
+    memset(vm->replay->fd_map[0], -1, sizeof(vm->replay->fd_map[0]));
+    vm->replay->loops = loops;
+    vm->backend = &replay_backend;
+
+    if (strcmp(source, "synthetic") == 0) {
+        replay_synthetic(vm->replay);
+    } else if (replay_load_trace(vm->replay, source, vm->id) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+//  Ispisuje propusnost handlera za goste pokrenute sa --replay
+void replay_report(uint64_t elapsed_ns) {
+    uint64_t all_exits = 0, all_file_ops = 0, allocations = 0;
+
+    for (int i = 0; i < guest_count; i++) {
+        struct vcpu_stats* stats = &guests[i]->stats;
+        uint64_t exits = total_exits(stats), file_ops = 0;
+
+        for (int j = 1; j < FILE_OPS; j++) file_ops += stats->file_ops[j];
+
+        printf("replay vm%d: %" PRIu64 " izlazaka, %" PRIu64 " fajl operacija, handler p50 %" PRIu64
+            " ns, p99 %" PRIu64 " ns\n", guests[i]->id, exits, file_ops,
+            hist_percentile(&stats->handler_ns, 50), hist_percentile(&stats->handler_ns, 99));
+        all_exits += exits;
+        all_file_ops += file_ops;
+        allocations += guests[i]->allocations;
+    }
+
+    printf("replay: %.0f izlazaka/s, %.0f fajl operacija/s", all_exits * 1e9 / elapsed_ns,
+        all_file_ops * 1e9 / elapsed_ns);
+#ifdef ALLOC_COUNT
+    printf(", %.3f alokacija/izlazak, %.3f alokacija/fajl operaciji",
+        (double) allocations / all_exits, all_file_ops ? (double) allocations / all_file_ops : 0.0);
+#endif
+    printf("\n");
+}
+
+void add_to_files(const char*** files, int* size, const char* file) {
+
+    if (*size % 10 == 0) {
+        *files = realloc(*files, sizeof(const char*) * (*size + 10));
+        if (*files == NULL) {
+            printf("GRESKA: alokacija nije uspela\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    (*files)[(*size)++] = file;
+}
+
+//  Procesi gostiju (--workers N)
+//
+//  Nadzorni proces deli goste u N grupa i svaku grupu pokrece u posebnom
+//  procesu. Page fault-ovi, mmap i izmene memorijskih slotova jednog
+//  procesa tako ne cekaju na mmap_lock ostalih, a pad jednog procesa ne
+//  rusi goste u drugim procesima. Slike gostiju i deljene fajlove otvara
+//  nadzorni proces i salje ih preko Unix socketa (SCM_RIGHTS), a proces
+//  gostiju mu na kraju vraca statistiku u JSON formatu
+
+#define WORKER_GUEST 1
+#define WORKER_FILE 2
+#define WORKER_START 3
+#define WORKER_STATS 4
+
+//  Najveca poruka koja se prima (statistika svih gostiju jednog procesa)
+#define WORKER_MESSAGE_MAX (64UL << 20)
+
+//  Zaglavlje poruke, iza njega je size bajtova podataka. Uz WORKER_GUEST
+//  (id gosta i ime slike) i WORKER_FILE (ime deljenog fajla) stize i
+//  jedan fajl deskriptor
+struct worker_message {
+    uint32_t type;
+    uint32_t id;
+    uint32_t size;
+};
+
+//  Proces sa gostima first .. first + count - 1 iz --guest
+//
+//  stats - JSON statistika koju je proces poslao na kraju ili NULL
+//  status - rezultat waitpid
+struct worker {
+    pid_t pid;
+    int sock;
+    int first;
+    int count;
+    char* stats;
+    int status;
+};
+
+int worker_count = 0;
+int worker_sock = -1;
+struct worker* workers = NULL;
+
+union worker_control {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+int worker_send(int sock, uint32_t type, uint32_t id, const void* data, uint32_t size, int fd) {
+    struct worker_message header = {type, id, size};
+    struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    union worker_control control;
+
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    for (size_t done = 0; n >= 0 && done < size; done += n) {
+        n = send(sock, (const char*) data + done, size - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) n = 0;
+    }
+
+    if (n < 0) {
+        perror("GRESKA: Neuspesno slanje poruke\n");
+        fprintf(stderr, "sendmsg: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//  Prima jednu poruku. Podaci se alociraju i zavrsavaju sa '\0', a fd je
+//  -1 ako uz poruku nije stigao deskriptor. Vraca 1 za poruku, 0 za kraj
+//  veze i -1 u slucaju greske ili poruke vece od WORKER_MESSAGE_MAX
+int worker_receive(int sock, struct worker_message* header, char** data, int* fd) {
+    struct iovec iov = {.iov_base = header, .iov_len = sizeof(*header)};
+    union worker_control control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)};
+    ssize_t n;
+
+    *data = NULL;
+    *fd = -1;
+
+    while ((n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (n == 0) return 0;
+    if (n != sizeof(*header)) return -1;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    size_t size = header->size;
+    if (size > WORKER_MESSAGE_MAX) {
+        fprintf(stderr, "GRESKA: Poruka od %zu bajtova je prevelika\n", size);
+        return -1;
+    }
+
+    *data = malloc(size + 1);
+    if (*data == NULL) return -1;
+
+    for (size_t done = 0; done < size; done += n) {
+        n = recv(sock, *data + done, size - done, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) n = 0;
+        else if (n <= 0) return -1;
+    }
+    (*data)[size] = '\0';
+
+    return 1;
+}
+
+//  Proces gostiju prima svoje goste i deljene fajlove do WORKER_START.
+//  Gosti dobijaju id-eve iz --guest redosleda kao i bez procesa
+int worker_setup(int sock, const char*** imgs, int* img_size, int** image_fds) {
+    struct worker_message header;
+    char* data;
+    int fd;
+
+    *img_size = 0;
+    shared_file_size = 0;
+
+    for (;;) {
+        if (worker_receive(sock, &header, &data, &fd) <= 0) {
+            return -1;
+        }
+
+        if (header.type == WORKER_START) {
+            free(data);
+            return 0;
+        } else if (header.type == WORKER_GUEST) {
+            if (*img_size == 0) next_guest_id = header.id;
+            *image_fds = realloc(*image_fds, sizeof(int) * (*img_size + 1));
+            if (*image_fds == NULL) return -1;
+            (*image_fds)[*img_size] = fd;
+            add_to_files(imgs, img_size, data);
+        } else if (header.type == WORKER_FILE) {
+            shared_fds = realloc(shared_fds, sizeof(int) * (shared_file_size + 1));
+            if (shared_fds == NULL) return -1;
+            shared_fds[shared_file_size] = fd;
+            add_to_files(&shared_files, &shared_file_size, data);
+        } else {
+            free(data);
+        }
+    }
+}
+
+//  Salje statistiku gostiju ovog procesa nadzornom procesu
+void worker_report() {
+    char* text = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&text, &size);
+
+    if (out == NULL) {
+        perror("GRESKA: Neuspesan open_memstream\n");
+        return;
+    }
+    write_stats(out);
+    fclose(out);
+
+    worker_send(worker_sock, WORKER_STATS, 0, text, size, -1);
+    free(text);
+}
+
+//  Signale za zaustavljanje, statistiku i core dump nadzorni proces
+//  prosledjuje procesima gostiju, sa istim si_value
+void forward_signal(int sig, siginfo_t* info, void* context) {
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i].pid <= 0) continue;
+
+        if (info->si_code == SI_QUEUE) {
+            sigqueue(workers[i].pid, sig, info->si_value);
+        } else {
+            kill(workers[i].pid, sig);
+        }
+    }
+}
+
+void worker_status(char* buf, size_t size, int status) {
+    if (WIFSIGNALED(status)) {
+        snprintf(buf, size, "signal %d (%s)", WTERMSIG(status), strsignal(WTERMSIG(status)));
+    } else {
+        snprintf(buf, size, "exit %d", WEXITSTATUS(status));
+    }
+}
+
+//  Upisuje statistiku svih procesa: za svaki proces njegov status i
+//  JSON koji je poslao (null ako se srusio pre slanja)
+void write_worker_stats(FILE* out) {
+    char status[64];
+
+    fprintf(out, "{\"timestamp_ns\": %" PRIu64 ", \"workers\": [", now_ns());
+    for (int i = 0; i < worker_count; i++) {
+        struct worker* w = &workers[i];
+
+        worker_status(status, sizeof(status), w->status);
+        fprintf(out, "%s\n {\"pid\": %d, \"first\": %d, \"guests\": %d, \"status\": \"%s\", \"stats\": %s}",
+            i ? "," : "", w->pid, w->first, w->count, status, w->stats ? w->stats : "null");
+    }
+    fprintf(out, "\n]}\n");
+}
+
+//  Ceka poruke svih procesa dok ne zatvore socket, pa i njihov kraj
+void collect_workers() {
+    struct pollfd* fds = calloc(worker_count, sizeof(struct pollfd));
+    int open_count = worker_count;
+
+    if (fds == NULL) {
+        printf("GRESKA: Alokacija nije uspela\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        fds[i].fd = workers[i].sock;
+        fds[i].events = POLLIN;
+    }
+
+    while (open_count > 0) {
+        if (poll(fds, worker_count, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("GRESKA: Neuspesan poll\n");
+            break;
+        }
+
+        for (int i = 0; i < worker_count; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+
+            struct worker_message header;
+            char* data;
+            int fd;
+            int r = worker_receive(fds[i].fd, &header, &data, &fd);
+
+            if (fd >= 0) close(fd);
+            if (r <= 0) {
+                free(data);
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_count--;
+            } else if (header.type == WORKER_STATS) {
+                size_t len = strlen(data);
+                while (len > 0 && data[len - 1] == '\n') data[--len] = '\0';
+                free(workers[i].stats);
+                workers[i].stats = data;
+            } else {
+                free(data);
+            }
+        }
+    }
+    free(fds);
+
+    for (int i = 0; i < worker_count; i++) {
+        while (waitpid(workers[i].pid, &workers[i].status, 0) < 0 && errno == EINTR);
+    }
+}
+
+//  Pokrece procese gostiju. U procesu gostiju vraca njegov kraj socketa,
+//  a nadzorni proces ovde ceka da svi procesi zavrse, upisuje statistiku
+//  (--stats) i izlazi sa greskom ako neki proces nije uspesno zavrsio
+int supervise(const char** imgs, int img_size) {
+    int per_worker = (img_size + worker_count - 1) / worker_count;
+    worker_count = (img_size + per_worker - 1) / per_worker;
+
+    workers = calloc(worker_count, sizeof(struct worker));
+    int* image_fds = malloc(sizeof(int) * img_size);
+    int* file_fds = malloc(sizeof(int) * (shared_file_size + 1));
+    if (workers == NULL || image_fds == NULL || file_fds == NULL) {
+        printf("GRESKA: Alokacija nije uspela\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < img_size; i++) {
+        image_fds[i] = open(imgs[i], O_RDONLY | O_CLOEXEC);
+        if (image_fds[i] < 0) {
+            printf("GRESKA: Nije omoguce otvoriti fajl %s\n", imgs[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < shared_file_size; i++) {
+        file_fds[i] = open(shared_files[i], O_RDONLY | O_CLOEXEC);
+        if (file_fds[i] < 0) {
+            fprintf(stderr, "GRESKA: Nepostojeci deljeni fajl %s\n", shared_files[i]);
+        }
+    }
+
+    for (int w = 0; w < worker_count; w++) {
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+            perror("GRESKA: Neuspesan socketpair\n");
+            fprintf(stderr, "socketpair: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("GRESKA: Neuspesan fork\n");
+            fprintf(stderr, "fork: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        //  Proces gostiju ne zadrzava nista od nadzornog procesa, sve
+        //  fajlove dobija preko socketa
+        if (pid == 0) {
+            close(sv[0]);
+            for (int i = 0; i < w; i++) close(workers[i].sock);
+            for (int i = 0; i < img_size; i++) close(image_fds[i]);
+            for (int i = 0; i < shared_file_size; i++) {
+                if (file_fds[i] >= 0) close(file_fds[i]);
+            }
+            free(image_fds);
+            free(file_fds);
+            file_limits_divide(worker_count);
+            return sv[1];
+        }
+
+        close(sv[1]);
+        struct worker* worker = &workers[w];
+        worker->pid = pid;
+        worker->sock = sv[0];
+        worker->first = w * per_worker;
+        worker->count = img_size - worker->first < per_worker ? img_size - worker->first : per_worker;
+
+        for (int i = worker->first; i < worker->first + worker->count; i++) {
+            worker_send(worker->sock, WORKER_GUEST, i, imgs[i], strlen(imgs[i]) + 1, image_fds[i]);
+        }
+        for (int i = 0; i < shared_file_size; i++) {
+            if (file_fds[i] < 0) continue;
+            worker_send(worker->sock, WORKER_FILE, i, shared_files[i], strlen(shared_files[i]) + 1, file_fds[i]);
+        }
+        worker_send(worker->sock, WORKER_START, 0, NULL, 0, -1);
+    }
+
+    for (int i = 0; i < img_size; i++) close(image_fds[i]);
+    for (int i = 0; i < shared_file_size; i++) {
+        if (file_fds[i] >= 0) close(file_fds[i]);
+    }
+    free(image_fds);
+    free(file_fds);
+
+    struct sigaction forward;
+    memset(&forward, 0, sizeof(forward));
+    forward.sa_sigaction = &forward_signal;
+    forward.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&forward.sa_mask);
+    sigaction(SIGINT, &forward, NULL);
+    sigaction(SIGTERM, &forward, NULL);
+    sigaction(SIGUSR1, &forward, NULL);
+    sigaction(GUEST_CORE_SIGNAL, &forward, NULL);
+
+    collect_workers();
+
+    int failed = 0;
+    char status[64];
+    for (int i = 0; i < worker_count; i++) {
+        struct worker* w = &workers[i];
+        if (WIFEXITED(w->status) && WEXITSTATUS(w->status) == 0) continue;
+
+        worker_status(status, sizeof(status), w->status);
+        fprintf(stderr, "GRESKA: Proces %d (gosti %d-%d) je zavrsio sa %s\n", w->pid, w->first,
+            w->first + w->count - 1, status);
+        failed = 1;
+    }
+
+    if (stats_path) {
+        FILE* out = fopen(stats_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "GRESKA: Nije moguce otvoriti fajl %s\n", stats_path);
+        } else {
+            write_worker_stats(out);
+            fclose(out);
+        }
+    }
+
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
-int exit_shutdown(struct guest* vm) {
-    printf("Shutdown\n");
-    return 1;
+//  Demon (--daemon SOCKET)
+//
+//  Hipervizor ostaje pokrenut sa otvorenim /dev/kvm i pokrece goste na
+//  zahtev preko Unix socketa, porukama istog formata kao za procese
+//  gostiju. Klijent (--connect SOCKET) salje svoje deskriptore za izlaz
+//  i ulaz konzole i za direktorijum (SCM_RIGHTS), pa konzola i fajl port
+//  gosta rade direktno sa klijentovim fajlovima, bez prepisivanja kroz
+//  demon. Demon drzi --pool unapred napravljenih gostiju (VM, memorija
+//  sa tabelama stranica, vCPU, kvm_run i registri), pa pokretanje samo
+//  ucitava sliku i pokrece nit. Gost koji se zavrsio se unistava, a
+//  skup se dopunjava tek posle DAEMON_REFILL_MS bez zahteva, da pravljenje
+//  novog gosta ne uzme procesor tek pokrenutom
+//
+//  Socket je 0600, a veza ciji proces (SO_PEERCRED) nema uid demona se
+//  odmah zatvara, jer klijent moze da zaustavi bilo kog gosta. Poruke se
+//  primaju i salju blokirajuce, ali sa DAEMON_TIMEOUT_MS: klijent koji
+//  zastane usred poruke ili ne cita odgovore gubi vezu umesto da zaustavi
+//  pokretanje i zavrsavanje ostalih gostiju
+
+#define DAEMON_CONSOLE 16
+#define DAEMON_INPUT 17
+#define DAEMON_DIR 18
+#define DAEMON_LAUNCH 19
+#define DAEMON_STARTED 20
+#define DAEMON_EXIT 21
+#define DAEMON_STOP 22
+#define DAEMON_STATS 23
+#define DAEMON_ERROR 24
+
+#define DAEMON_GUESTS 256
+#define DAEMON_CLIENTS 64
+#define DAEMON_REFILL_MS 1
+#define DAEMON_TIMEOUT_MS 1000
+
+//  Veza sa klijentom, slobodna kad je sock -1 i nema gostiju
+//
+//  console_out, console_in, dir_fd - deskriptori klijenta za sledece goste
+//  guests - broj njegovih gostiju koji jos rade
+struct daemon_client {
+    int sock;
+    int console_out;
+    int console_in;
+    int dir_fd;
+    int guests;
+};
+
+const char* daemon_path = NULL;
+struct daemon_client daemon_clients[DAEMON_CLIENTS];
+int daemon_pipe[2] = {-1, -1};
+struct guest** daemon_pool = NULL;
+int daemon_pool_count = 0;
+int daemon_pool_size = 0;
+uint64_t daemon_launched = 0;
+uint64_t daemon_finished = 0;
+struct histogram daemon_start_ns;
+
+void write_daemon_stats(FILE* out) {
+    fprintf(out, "\"daemon\": {\"pool\": %d, \"pool_size\": %d, \"launched\": %" PRIu64 ", \"finished\": %" PRIu64 ", ",
+        daemon_pool_count, daemon_pool_size, daemon_launched, daemon_finished);
+    write_histogram(out, "start_ns", &daemon_start_ns);
+    fprintf(out, "}, ");
 }
 
-typedef int (*Handler)(struct guest* vm);
+//  Budi demona da zavrsi (SIGTERM i SIGINT)
+void daemon_shutdown() {
+    struct guest* none = NULL;
 
-static Handler handlers[] = {
-    NULL, NULL, &exit_io, NULL, NULL, &exit_halt,
-    NULL, NULL, &exit_shutdown, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL,
-    &exit_internal_error
-};
+    if (daemon_pipe[1] >= 0) {
+        write(daemon_pipe[1], &none, sizeof(none));
+    }
+}
 
-void* run_guest(void* par) {
+//  Oslobadja sve sto je gost zauzeo, posle kraja njegove niti
+void destroy_guest(struct hypervisor* hypervisor, struct guest* vm) {
+    while (vm->file_head) {
+        struct file* file = vm->file_head;
+        vm->file_head = file->next;
+        if (file->fd >= 0) close(file->fd);
+        if (file->ime != file->ime_inline) free(file->ime);
+        free(file);
+    }
 
-    struct guest* vm = (struct guest*) par;
-    int stop = 0;
-    int ret;
+    for (int i = 0; i < LOOKUP_BUCKETS; i++) {
+        while (vm->lookup[i]) {
+            struct lookup_entry* entry = vm->lookup[i];
+            vm->lookup[i] = entry->next;
+            free(entry);
+        }
+    }
 
-    while (stop == 0) {
+    if (vm->disk) {
+        munmap(vm->disk->data, vm->disk->size);
+        close(vm->disk->fd);
+        free(vm->disk);
+    }
 
-        ret = ioctl(vm->vm_vcpu, KVM_RUN, 0);
-        if (ret < 0) {
-            perror("GRESKA: Neuspesan ioctl KVM_RUN\n");
-            fprintf(stderr, "KVM_RUN: %s\n", strerror(errno));
-            return NULL;
+    if (vm->console_out != STDOUT_FILENO) close(vm->console_out);
+    if (vm->console_in != STDIN_FILENO) close(vm->console_in);
+    if (vm->vm_stats_fd >= 0) close(vm->vm_stats_fd);
+    if (vm->vcpu_stats_fd >= 0) close(vm->vcpu_stats_fd);
+    if (vm->dir_fd >= 0) close(vm->dir_fd);
+
+    if (vm->kvm_run != MAP_FAILED) munmap(vm->kvm_run, hypervisor->kvm_run_mmap_size);
+    if (vm->mem != MAP_FAILED) munmap(vm->mem, vm->mem_size);
+    if (vm->mem_fd >= 0) close(vm->mem_fd);
+    if (vm->vm_vcpu >= 0) close(vm->vm_vcpu);
+    if (vm->vm_fd >= 0) close(vm->vm_fd);
+    sem_destroy(&vm->paused);
+    sem_destroy(&vm->resume);
+    free((void*) vm->host_dirty_bitmap);
+    free(vm);
+}
+
+//  Pravi gosta spremnog za pokretanje, bez slike
+struct guest* daemon_create(struct hypervisor* hypervisor, size_t mem_size, enum PageSize page_size) {
+    struct guest* vm = malloc(sizeof(struct guest));
+
+    if (vm == NULL) {
+        printf("GRESKA: Alokacija nije uspela\n");
+        return NULL;
+    }
+
+    if (init_guest(hypervisor, vm, mem_size, page_size, NULL) < 0) {
+        printf("GRESKA: Nije moguce inicijalizovati gosta\n");
+        destroy_guest(hypervisor, vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
+void* daemon_guest(void* par) {
+    run_guest(par);
+    write(daemon_pipe[1], &par, sizeof(par));
+    return NULL;
+}
+
+//  Pokrece sliku iz image_fd (koji zatvara) za klijenta c. Gost se uzima
+//  iz skupa, a pravi se samo kad je skup prazan
+struct guest* daemon_launch(struct hypervisor* hypervisor, int c, int image_fd, uint64_t request_ns,
+    size_t mem_size, enum PageSize page_size) {
+
+    struct daemon_client* client = &daemon_clients[c];
+    struct guest* vm = daemon_pool_count > 0 ? daemon_pool[--daemon_pool_count] :
+        daemon_create(hypervisor, mem_size, page_size);
+    FILE* img = fdopen(image_fd, "r");
+
+    if (img == NULL) {
+        close(image_fd);
+        if (vm) destroy_guest(hypervisor, vm);
+        return NULL;
+    }
+    if (vm == NULL) {
+        fclose(img);
+        return NULL;
+    }
+
+    load_image(vm, img, vm->reserved_size);
+    fclose(img);
+
+    vm->launch_ns = request_ns;
+    vm->client = c;
+    if (client->console_out >= 0) vm->console_out = dup(client->console_out);
+    if (client->console_in >= 0) vm->console_in = dup(client->console_in);
+    if (client->dir_fd >= 0) {
+        close(vm->dir_fd);
+        vm->dir_fd = dup(client->dir_fd);
+    }
+
+    if (pthread_create(&vm->thread, NULL, &daemon_guest, vm) != 0) {
+        destroy_guest(hypervisor, vm);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&guests_lock);
+    guests[guest_count++] = vm;
+    pthread_mutex_unlock(&guests_lock);
+
+    client->guests++;
+    daemon_launched++;
+    return vm;
+}
+
+//  Zatvara deskriptore klijenta kad je veza zatvorena i nema gostiju
+void daemon_client_release(struct daemon_client* client) {
+    if (client->sock >= 0 || client->guests > 0) return;
+
+    if (client->console_out >= 0) close(client->console_out);
+    if (client->console_in >= 0) close(client->console_in);
+    if (client->dir_fd >= 0) close(client->dir_fd);
+    client->console_out = client->console_in = client->dir_fd = -1;
+}
+
+//  Kraj veze zaustavlja sve goste klijenta, jer njihova konzola vise
+//  nema citaoca
+void daemon_client_close(int c) {
+    close(daemon_clients[c].sock);
+    daemon_clients[c].sock = -1;
+
+    pthread_mutex_lock(&guests_lock);
+    for (int i = 0; i < guest_count; i++) {
+        if (guests[i]->client == c) stop_guest(guests[i], "client");
+    }
+    pthread_mutex_unlock(&guests_lock);
+
+    daemon_client_release(&daemon_clients[c]);
+}
+
+//  Odgovor klijentu. Ako slanje ne uspe (i posle DAEMON_TIMEOUT_MS),
+//  poruka je mozda poslata do pola, pa se veza prekida i poll je zatvara
+void daemon_send(struct daemon_client* client, uint32_t type, uint32_t id, const void* data, uint32_t size) {
+    if (worker_send(client->sock, type, id, data, size, -1) < 0) {
+        shutdown(client->sock, SHUT_RDWR);
+    }
+}
+
+//  Gost koji se zavrsio: klijent dobija njegovu statistiku, a sve sto
+//  je gost zauzeo se oslobadja
+void daemon_reap(struct hypervisor* hypervisor, struct guest* vm) {
+    pthread_join(vm->thread, NULL);
+    if (vm->first_run_ns) {
+        hist_record(&daemon_start_ns, vm->first_run_ns - vm->launch_ns);
+    }
+
+    pthread_mutex_lock(&guests_lock);
+    for (int i = 0; i < guest_count; i++) {
+        if (guests[i] == vm) {
+            guests[i] = guests[--guest_count];
+            break;
         }
+    }
+    pthread_mutex_unlock(&guests_lock);
+
+    struct daemon_client* client = &daemon_clients[vm->client];
+    if (client->sock >= 0) {
+        char* text = NULL;
+        size_t size = 0;
+        FILE* out = open_memstream(&text, &size);
+
+        if (out != NULL) {
+            write_guest_stats(out, vm);
+            fclose(out);
+            daemon_send(client, DAEMON_EXIT, vm->id, text, size);
+            free(text);
+        }
+    }
+    client->guests--;
+    daemon_client_release(client);
 
-        int exit_reason = vm->kvm_run->exit_reason;
+    daemon_finished++;
+    destroy_guest(hypervisor, vm);
+}
 
-        if (handlers[exit_reason]) {
-            stop = handlers[exit_reason](vm);
+//  Obradjuje jednu poruku klijenta c
+void daemon_request(struct hypervisor* hypervisor, int c, size_t mem_size, enum PageSize page_size) {
+    struct daemon_client* client = &daemon_clients[c];
+    struct worker_message header;
+    uint64_t request_ns = now_ns();
+    char* data;
+    int fd;
+
+    if (worker_receive(client->sock, &header, &data, &fd) <= 0) {
+        free(data);
+        if (fd >= 0) close(fd);
+        daemon_client_close(c);
+        return;
+    }
+
+    if (header.type == DAEMON_CONSOLE || header.type == DAEMON_INPUT || header.type == DAEMON_DIR) {
+        int* slot = header.type == DAEMON_CONSOLE ? &client->console_out :
+            header.type == DAEMON_INPUT ? &client->console_in : &client->dir_fd;
+        if (*slot >= 0) close(*slot);
+        *slot = fd;
+        fd = -1;
+    } else if (header.type == DAEMON_LAUNCH) {
+        const char* error = NULL;
+        struct guest* vm = NULL;
+
+        if (fd < 0) {
+            error = "uz zahtev nije stigla slika";
+        } else if (guest_count >= DAEMON_GUESTS) {
+            error = "demon vec ima najveci broj gostiju";
+        } else if ((vm = daemon_launch(hypervisor, c, fd, request_ns, mem_size, page_size)) == NULL) {
+            error = "gost nije pokrenut";
+        }
+        fd = -1;
+
+        if (vm) {
+            daemon_send(client, DAEMON_STARTED, vm->id, NULL, 0);
         } else {
-            printf("Unknown exit reason %d\n", exit_reason);
-            stop = -1;
+            fprintf(stderr, "GRESKA: %s: %s\n", data, error);
+            daemon_send(client, DAEMON_ERROR, header.id, error, strlen(error) + 1);
+        }
+    } else if (header.type == DAEMON_STOP) {
+        pthread_mutex_lock(&guests_lock);
+        for (int i = 0; i < guest_count; i++) {
+            if (guests[i]->id == (int) header.id) stop_guest(guests[i], "daemon");
+        }
+        pthread_mutex_unlock(&guests_lock);
+    } else if (header.type == DAEMON_STATS) {
+        char* text = NULL;
+        size_t size = 0;
+        FILE* out = open_memstream(&text, &size);
+
+        if (out != NULL) {
+            write_stats(out);
+            fclose(out);
+            daemon_send(client, DAEMON_STATS, 0, text, size);
+            free(text);
         }
     }
 
-    return NULL;
-} 
-
-pthread_t start_guest(struct guest* vm, FILE* img, int starting_adress) {
+    if (fd >= 0) close(fd);
+    free(data);
+}
 
-    pthread_t handle;
+//  Proverava uid klijenta i postavlja rokove za primanje i slanje
+int daemon_accept(int sock) {
+    struct timeval timeout = {.tv_sec = DAEMON_TIMEOUT_MS / 1000, .tv_usec = DAEMON_TIMEOUT_MS % 1000 * 1000};
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
 
-    char* p = vm->mem + starting_adress;
-    while (feof(img) == 0) {
-        int r = fread(p, 1, 1024, img);
-        p += r;
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        fprintf(stderr, "SO_PEERCRED: %s\n", strerror(errno));
+        return -1;
+    }
+    if (cred.uid != geteuid()) {
+        fprintf(stderr, "GRESKA: Odbijen klijent demona (pid %d, uid %d)\n", cred.pid, cred.uid);
+        return -1;
     }
 
-    if (pthread_create(&handle, NULL, &run_guest, vm) == 0) {
-        return handle;
-    } else {
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        fprintf(stderr, "SO_RCVTIMEO: %s\n", strerror(errno));
         return -1;
     }
+
+    return 0;
 }
 
-int init_guest(struct hypervisor* hypervisor, struct guest* vm, size_t mem_size, enum PageSize page_size, FILE* img) {
+//  Glavna petlja demona. Ceka na klijente, zahteve i kraj gostiju, a
+//  kad nema nicega dopunjava skup po jednog gosta. Posle SIGTERM-a ceka
+//  da se svi gosti zavrse
+int daemon_serve(struct hypervisor* hypervisor, size_t mem_size, enum PageSize page_size) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct pollfd fds[DAEMON_CLIENTS + 2];
+    int stopping = 0;
 
-    static int incId = 0;
+    if (strlen(daemon_path) >= sizeof(addr.sun_path)) {
+        printf("GRESKA: Predugacka putanja socketa %s\n", daemon_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, daemon_path);
+    unlink(daemon_path);
+
+    daemon_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(0177);
+    int bound = daemon_sock >= 0 ? bind(daemon_sock, (struct sockaddr*) &addr, sizeof(addr)) : -1;
+    umask(mask);
+    if (bound < 0 || chmod(daemon_path, 0600) < 0 ||
+        listen(daemon_sock, DAEMON_CLIENTS) < 0 || pipe2(daemon_pipe, O_CLOEXEC) < 0) {
+        perror("GRESKA: Demon nije pokrenut\n");
+        fprintf(stderr, "%s: %s\n", daemon_path, strerror(errno));
+        return -1;
+    }
 
-    int starting_address;
+    for (int c = 0; c < DAEMON_CLIENTS; c++) {
+        daemon_clients[c] = (struct daemon_client) {-1, -1, -1, -1, 0};
+    }
+    daemon_pool = malloc(sizeof(struct guest*) * (daemon_pool_size + 1));
+    if (daemon_pool == NULL) {
+        printf("GRESKA: Alokacija nije uspela\n");
+        return -1;
+    }
+    fprintf(stderr, "Demon: %s, %d gostiju unapred\n", daemon_path, daemon_pool_size);
 
-    if (create_guest(hypervisor, vm) < 0) return -1;
-    if (create_memory_region(vm, mem_size) < 0) return -1;
-    if (create_vcpu(vm) < 0) return -1;
-    if (create_kvm_run(hypervisor, vm) < 0) return - 1; 
-    if ((starting_address = setup_long_mode(vm, mem_size, page_size)) < 0) return -1;
-    if (setup_registers(vm) < 0) return -1;
-    vm->lock = 0;
-    vm->file_head = NULL;
-    vm->current_file = NULL;
-    vm->id = incId++;
-    vm->current_file_state = &start_file_operation;
+    while (!stopping || guest_count > 0) {
+        fds[0] = (struct pollfd) {.fd = daemon_pipe[0], .events = POLLIN};
+        fds[1] = (struct pollfd) {.fd = stopping ? -1 : daemon_sock, .events = POLLIN};
+        for (int c = 0; c < DAEMON_CLIENTS; c++) {
+            fds[c + 2] = (struct pollfd) {.fd = stopping ? -1 : daemon_clients[c].sock, .events = POLLIN};
+        }
 
-    return starting_address;
+        int n = poll(fds, DAEMON_CLIENTS + 2, !stopping && daemon_pool_count < daemon_pool_size ? DAEMON_REFILL_MS : -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("GRESKA: Neuspesan poll\n");
+            break;
+        }
+
+        if (n == 0) {
+            struct guest* vm = daemon_create(hypervisor, mem_size, page_size);
+            if (vm == NULL) {
+                daemon_pool_size = daemon_pool_count;
+            } else {
+                daemon_pool[daemon_pool_count++] = vm;
+            }
+            continue;
+        }
+
+        struct guest* vm;
+        if ((fds[0].revents & POLLIN) && read(daemon_pipe[0], &vm, sizeof(vm)) == sizeof(vm)) {
+            if (vm) {
+                daemon_reap(hypervisor, vm);
+            } else if (!stopping) {
+                stopping = 1;
+                pthread_mutex_lock(&guests_lock);
+                for (int i = 0; i < guest_count; i++) {
+                    stop_guest(guests[i], "signal");
+                }
+                pthread_mutex_unlock(&guests_lock);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int sock = accept4(daemon_sock, NULL, NULL, SOCK_CLOEXEC);
+            int c = 0;
+
+            while (c < DAEMON_CLIENTS && (daemon_clients[c].sock >= 0 || daemon_clients[c].guests > 0)) c++;
+            if (sock >= 0 && daemon_accept(sock) < 0) {
+                close(sock);
+            } else if (sock >= 0 && c == DAEMON_CLIENTS) {
+                fprintf(stderr, "GRESKA: Demon vec ima %d klijenata\n", DAEMON_CLIENTS);
+                close(sock);
+            } else if (sock >= 0) {
+                daemon_clients[c].sock = sock;
+            }
+        }
+
+        for (int c = 0; c < DAEMON_CLIENTS; c++) {
+            if (fds[c + 2].fd >= 0 && fds[c + 2].revents) {
+                daemon_request(hypervisor, c, mem_size, page_size);
+            }
+        }
+    }
 
+    close(daemon_sock);
+    unlink(daemon_path);
+    return 0;
 }
 
-void add_to_files(const char** files, int* size, const char* file) {
+//  Klijent demona (--connect SOCKET). Pokrece slike iz --guest sa svojom
+//  konzolom i direktorijumom (--sandbox) i ceka da se zavrse, a --stop ID
+//  zaustavlja gosta. Sa --stats na kraju upisuje statistiku svojih
+//  gostiju i demona
+int daemon_connect(const char* path, const char** imgs, int img_size, int stop_id) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct worker_message header;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int pending = 0, exited = 0, failed = 0;
+    char* data;
+    int fd;
 
-    if (*size % 10 == 0) {
-        files = realloc(files, sizeof(const char*) * (*size + 10));
-        if (files == NULL) {
-            printf("GRESKA: alokacija nije uspela\n");
-            exit(EXIT_FAILURE);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror("GRESKA: Nije moguce povezati se sa demonom\n");
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (stop_id >= 0) {
+        worker_send(sock, DAEMON_STOP, stop_id, NULL, 0, -1);
+    }
+
+    if (img_size > 0) {
+        int dir_fd = open(sandbox_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0) {
+            fprintf(stderr, "GRESKA: Nije moguce otvoriti direktorijum %s: %s\n", sandbox_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        worker_send(sock, DAEMON_CONSOLE, 0, NULL, 0, STDOUT_FILENO);
+        worker_send(sock, DAEMON_INPUT, 0, NULL, 0, STDIN_FILENO);
+        worker_send(sock, DAEMON_DIR, 0, NULL, 0, dir_fd);
+        close(dir_fd);
+    }
+
+    for (int i = 0; i < img_size; i++) {
+        int image_fd = open(imgs[i], O_RDONLY | O_CLOEXEC);
+        if (image_fd < 0) {
+            printf("GRESKA: Nije omoguce otvoriti fajl %s\n", imgs[i]);
+            failed = 1;
+            continue;
+        }
+        worker_send(sock, DAEMON_LAUNCH, i, imgs[i], strlen(imgs[i]) + 1, image_fd);
+        close(image_fd);
+        pending++;
+    }
+
+    FILE* out = stats_path ? fopen(stats_path, "w") : NULL;
+    if (stats_path && out == NULL) {
+        fprintf(stderr, "GRESKA: Nije moguce otvoriti fajl %s\n", stats_path);
+    }
+    if (out) fprintf(out, "{\"guests\": [");
+
+    while (pending > 0 && worker_receive(sock, &header, &data, &fd) > 0) {
+        if (header.type == DAEMON_ERROR) {
+            printf("GRESKA: %s: %s\n", imgs[header.id < img_size ? header.id : 0], data);
+            failed = 1;
+            pending--;
+        } else if (header.type == DAEMON_EXIT) {
+            if (out) fprintf(out, "%s\n  %s", exited ? "," : "", data);
+            exited++;
+            pending--;
+        }
+        if (fd >= 0) close(fd);
+        free(data);
+    }
+    if (pending > 0) {
+        printf("GRESKA: Demon je prekinuo vezu\n");
+        failed = 1;
+    }
+
+    if (out) {
+        fprintf(out, "\n], \"daemon\": ");
+        worker_send(sock, DAEMON_STATS, 0, NULL, 0, -1);
+        if (worker_receive(sock, &header, &data, &fd) > 0 && header.type == DAEMON_STATS) {
+            fputs(data, out);
+        } else {
+            fprintf(out, "null");
         }
+        free(data);
+        fprintf(out, "}\n");
+        fclose(out);
     }
 
-    files[(*size)++] = file;
+    close(sock);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int main(int argc, char* argv[]) {
 
     int opt;
-    int memory = 0;
-    enum PageSize page_size;
+    size_t memory = 0;
+    enum PageSize page_size = MB2;
     struct hypervisor hypervisor;
     int starting_adress;
     const char** imgs = malloc(sizeof(const char*) * 10) ;
     int img_size = 0;
+    int* image_fds = NULL;
     shared_files = malloc(sizeof(const char* ) * 10);
-    
+    hypervisor_start_ns = now_ns();
 
     struct option long_options[] = {
         {"memory", required_argument, 0, 'm'},
         {"page", required_argument, 0, 'p'},
         {"guest", no_argument, 0, 'g'},
         {"file", no_argument, 0, 'f'},
+        {"overcommit", required_argument, 0, 'o'},
+        {"stats", required_argument, 0, 's'},
+        {"trace", required_argument, 0, 't'},
+        {"trace-size", required_argument, 0, 'T'},
+        {"replay", required_argument, 0, 'r'},
+        {"replay-loops", required_argument, 0, 'l'},
+        {"replay-guests", required_argument, 0, 'n'},
+        {"profile", required_argument, 0, 'P'},
+        {"profile-out", required_argument, 0, 'O'},
+        {"irqchip", no_argument, 0, 'i'},
+        {"quota", required_argument, 0, 'q'},
+        {"quota-period", required_argument, 0, 'Q'},
+        {"watchdog", required_argument, 0, 'w'},
+        {"simd", no_argument, 0, 'S'},
+        {"pmu", no_argument, 0, 'U'},
+        {"log", required_argument, 0, 'L'},
+        {"log-rotate", required_argument, 0, 'R'},
+        {"disk", required_argument, 0, 'D'},
+        {"disk-size", required_argument, 0, 'Z'},
+        {"core", required_argument, 0, 'C'},
+        {"workers", required_argument, 0, 'W'},
+        {"sandbox", required_argument, 0, 'b'},
+        {"dedicated", no_argument, 0, 'E'},
+        {"io-limit", required_argument, 0, 'I'},
+        {"file-limit", required_argument, 0, 'F'},
+        {"daemon", required_argument, 0, 'd'},
+        {"pool", required_argument, 0, 'N'},
+        {"connect", required_argument, 0, 'c'},
+        {"stop", required_argument, 0, 'X'},
         {0, 0, 0, 0,}
     };
-
-    while ((opt = getopt_long(argc, argv, "m:p:gf", long_options, NULL)) != -1) {
+    const char* trace_path = NULL;
+    size_t trace_size = 16 * 1024 * 1024;
+    const char* replay_source = NULL;
+    uint64_t replay_loops = 1;
+    int replay_guests = 1;
+    int quota_percent = 0;
+    const char* log_path = NULL;
+    uint64_t log_rotate_size = 0;
+    const char* connect_path = NULL;
+    int stop_id = -1;
+
+    while ((opt = getopt_long(argc, argv, "m:p:gfo:s:t:T:r:l:n:P:O:iq:Q:w:SUL:R:D:Z:C:W:b:EI:F:d:N:c:X:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'm':
-                memory = atoi(optarg) * 1024 * 1024;
+                memory = (size_t) atoi(optarg) * 1024 * 1024;
                 break;
             case 'p':
                 page_size = (atoi(optarg) == 4) ? KB4 : MB2;
                 break;
             case 'g':
                 while (optind < argc && argv[optind][0] != '-') {
-                    add_to_files(imgs, &img_size, argv[optind++]);
+                    add_to_files(&imgs, &img_size, argv[optind++]);
                 }
                 break;
             case 'f':
                 while (optind < argc && argv[optind][0] != '-') {
-                    add_to_files(shared_files, &shared_file_size, argv[optind++]);
+                    add_to_files(&shared_files, &shared_file_size, argv[optind++]);
+                }
+                break;
+            case 'o':
+                overcommit_limit = (size_t) atoi(optarg) * 1024 * 1024;
+                break;
+            case 's':
+                stats_path = optarg;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'T':
+                trace_size = (size_t) atoi(optarg) * 1024 * 1024;
+                break;
+            case 'r':
+                replay_source = optarg;
+                break;
+            case 'l':
+                replay_loops = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                replay_guests = atoi(optarg);
+                break;
+            case 'P':
+                profile_hz = atoi(optarg);
+                break;
+            case 'O':
+                profile_path = optarg;
+                break;
+            case 'i':
+                use_irqchip = 1;
+                break;
+            case 'q':
+                quota_percent = atoi(optarg);
+                break;
+            case 'Q':
+                quota_period_ns = (uint64_t) atoi(optarg) * 1000000UL;
+                break;
+            case 'w':
+                watchdog_ns = (uint64_t) atoi(optarg) * 1000000UL;
+                break;
+            case 'S':
+                use_simd = 1;
+                break;
+            case 'U':
+                use_pmu = 1;
+                break;
+            case 'L':
+                log_path = optarg;
+                break;
+            case 'R':
+                log_rotate_size = (uint64_t) atoi(optarg) * 1024 * 1024;
+                break;
+            case 'D':
+                disk_path = optarg;
+                break;
+            case 'Z':
+                disk_size = (uint64_t) atoi(optarg) * 1024 * 1024;
+                break;
+            case 'C':
+                core_path = optarg;
+                break;
+            case 'W':
+                worker_count = atoi(optarg);
+                break;
+            case 'b':
+                sandbox_path = optarg;
+                break;
+            case 'E':
+                dedicated = 1;
+                break;
+            case 'd':
+                daemon_path = optarg;
+                break;
+            case 'N':
+                daemon_pool_size = atoi(optarg);
+                break;
+            case 'c':
+                connect_path = optarg;
+                break;
+            case 'X':
+                stop_id = atoi(optarg);
+                break;
+            case 'I':
+            case 'F':
+                if (add_io_limit(optarg, opt == 'F') < 0) {
+                    printf("GRESKA: Neispravno ogranicenje %s\n", optarg);
+                    exit(EXIT_FAILURE);
                 }
                 break;
         }
     }
 
-    if (init_hypervisor(&hypervisor) < 0) {
+    if (connect_path) {
+        exit(daemon_connect(connect_path, imgs, img_size, stop_id));
+    }
+
+    if (daemon_path && (trace_path || profile_hz > 0 || log_path || worker_count > 0 || replay_source || img_size > 0)) {
+        printf("GRESKA: --guest, --trace, --profile, --log, --workers i --replay nisu podrzani sa --daemon\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (quota_percent > 0 && quota_percent < 100) {
+        quota_ns = quota_period_ns * quota_percent / 100;
+    }
+
+    if (replay_source && memory == 0) {
+        memory = 4 * 1024 * 1024;
+    }
+
+    if (dedicated && !daemon_path && !replay_source && dedicated_init(0) < img_size * dedicated_cores()) {
+        printf("GRESKA: --dedicated trazi %d jezgara za %d gostiju, procesu je dozvoljeno %d\n",
+            img_size * dedicated_cores(), img_size, dedicated_init(0));
+        exit(EXIT_FAILURE);
+    }
+
+    //  Sa --workers dalje nastavljaju samo procesi gostiju, svaki sa
+    //  svojim gostima i deljenim fajlovima
+    if (worker_count > 0 && !replay_source && img_size > 0) {
+        if (trace_path || profile_hz > 0 || (log_path && strstr(log_path, "%d") == NULL)) {
+            printf("GRESKA: --trace, --profile i --log bez %%d nisu podrzani sa --workers\n");
+            exit(EXIT_FAILURE);
+        }
+
+        worker_sock = supervise(imgs, img_size);
+        stats_path = NULL;
+        if (worker_setup(worker_sock, &imgs, &img_size, &image_fds) < 0) {
+            printf("GRESKA: Proces gostiju nije primio goste\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (dedicated) {
+        dedicated_init(worker_sock >= 0 ? next_guest_id * dedicated_cores() : 0);
+    }
+
+    if (!replay_source && init_hypervisor(&hypervisor) < 0) {
         printf("GRESKA: Nije moguce inicijalizovati hipervizora\n");
         exit(EXIT_FAILURE);
     }
@@ -828,8 +6231,34 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    int num_of_vms = img_size;
+    if (trace_path && trace_open(trace_path, trace_size) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    int num_of_vms = replay_source ? replay_guests : img_size;
     pthread_t* vms = (pthread_t*) malloc(sizeof(pthread_t) * (num_of_vms));
+    guests = (struct guest**) malloc(sizeof(struct guest*) * (daemon_path ? DAEMON_GUESTS : num_of_vms));
+
+    static sigset_t stats_signals;
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
+    sigaddset(&stats_signals, SIGTERM);
+    sigaddset(&stats_signals, SIGINT);
+    sigaddset(&stats_signals, GUEST_CORE_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+
+    struct sigaction kick;
+    memset(&kick, 0, sizeof(kick));
+    kick.sa_sigaction = &kick_handler;
+    kick.sa_flags = SA_SIGINFO;
+    sigemptyset(&kick.sa_mask);
+    sigaction(SIG_KICK, &kick, NULL);
+
+    register_devices();
+
+    if (log_path && log_start(log_path, log_rotate_size) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
     if (sem_init(&file_mutex, 0, 1) < 0) {
         perror("GRESKA: Neuspesan sem_init\n");
@@ -837,8 +6266,25 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    for (int i = 0; i < img_size; i++) {
-        FILE* img = fopen(imgs[i], "r");
+    uint64_t replay_start = now_ns();
+
+    for (int i = 0; replay_source && i < num_of_vms; i++) {
+        struct guest* vm = malloc(sizeof(struct guest));
+        if (vm == NULL || init_replay_guest(vm, memory, page_size, replay_source, replay_loops) < 0) {
+            printf("GRESKA: Nije moguce inicijalizovati gosta\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pthread_create(&vms[i], NULL, &run_guest, vm) != 0) {
+            printf("GRESKA: Nije moguce pokrenuti gosta\n");
+            exit(EXIT_FAILURE);
+        }
+        vm->thread = vms[i];
+        guests[guest_count++] = vm;
+    }
+
+    for (int i = 0; !replay_source && i < img_size; i++) {
+        FILE* img = image_fds ? fdopen(image_fds[i], "r") : fopen(imgs[i], "r");
         if (img == NULL) {
             printf("GRESKA: Nije omoguce otvoriti fajl %s\n", imgs[i]);
             exit(EXIT_FAILURE);
@@ -856,12 +6302,62 @@ int main(int argc, char* argv[]) {
             exit(EXIT_FAILURE);
         }
 
+        if (profile_hz > 0) {
+            vm->profile = profile_create(imgs[i]);
+        }
+
         pthread_t handle = start_guest(vm, img, starting_adress);
         vms[i] = handle;
+        guests[guest_count++] = vm;
+    }
+
+    pthread_t monitor;
+    if (overcommit_limit && pthread_create(&monitor, NULL, &balloon_monitor, NULL) == 0) {
+        pthread_detach(monitor);
+    }
+
+    pthread_t stats;
+    if (pthread_create(&stats, NULL, &stats_thread, &stats_signals) == 0) {
+        pthread_detach(stats);
+    }
+
+    pthread_t tracer;
+    if (trace_file && pthread_create(&tracer, NULL, &trace_thread, NULL) != 0) {
+        perror("GRESKA: Nije moguce pokrenuti nit za trag\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (daemon_path && daemon_serve(&hypervisor, memory, page_size) < 0) {
+        exit(EXIT_FAILURE);
     }
 
     for (int i = 0; i < num_of_vms; i++) {
         pthread_join(vms[i], NULL);
     }
 
+    if (replay_source) {
+        replay_report(now_ns() - replay_start);
+    }
+
+    if (trace_file) {
+        trace_stop = 1;
+        pthread_join(tracer, NULL);
+        msync(trace_file, trace_file_size, MS_SYNC);
+        munmap(trace_file, trace_file_size);
+    }
+
+    if (logger) {
+        log_stop();
+    }
+
+    if (worker_sock >= 0) {
+        worker_report();
+    } else if (stats_path) {
+        dump_stats();
+    }
+
+    if (profile_hz > 0) {
+        write_profile(profile_path);
+    }
+
 }
\ No newline at end of file
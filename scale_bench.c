@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+//  Meri kako se mini_hypervisor ponasa sa 1, 2, 4, ... N gostiju.
+//  Za svaki korak pokrece hipervizor sa N kopija slike gosta, iz
+//  --stats fajla cita vremena i broj izlazaka svakog gosta, a iz
+//  wait4 vrsno zauzece memorije i procesorsko vreme. Rezultat je CSV
+//
+//  ./scale_bench [-n max_gostiju] [-i slika] [-m memorija_mb] [-o fajl.csv] [-x hipervizor] [-p]
+//
+//  Sa -p svaki gost radi u svom procesu (--workers), inace su gosti
+//  niti jednog procesa. Vrsni RSS je tada najveci medju procesima
+
+#define STATS_FILE "scale_stats.json"
+
+struct guest_result {
+    uint64_t launch_ns;
+    uint64_t first_run_ns;
+    uint64_t end_ns;
+    uint64_t exits;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+//  Cita rezultate gostiju iz JSON statistike hipervizora
+static int read_results(const char* path, struct guest_result* results, int max) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror("GRESKA: Nije moguce otvoriti fajl statistike");
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* text = malloc(size + 1);
+    if (text == NULL || fread(text, 1, size, file) != size) {
+        fclose(file);
+        free(text);
+        return -1;
+    }
+    text[size] = '\0';
+    fclose(file);
+
+    int count = 0;
+    for (char* p = text; count < max && (p = strstr(p, "\"launch_ns\": ")) != NULL; p++) {
+        struct guest_result* r = &results[count];
+        if (sscanf(p, "\"launch_ns\": %" SCNu64 ", \"first_run_ns\": %" SCNu64 ", \"end_ns\": %" SCNu64
+            ", \"exits\": %" SCNu64, &r->launch_ns, &r->first_run_ns, &r->end_ns, &r->exits) == 4) {
+            count++;
+        }
+    }
+
+    free(text);
+    return count;
+}
+
+static void remove_guest_files() {
+    glob_t files;
+
+    if (glob("vm*_scale.txt", 0, NULL, &files) == 0) {
+        for (size_t i = 0; i < files.gl_pathc; i++) {
+            unlink(files.gl_pathv[i]);
+        }
+        globfree(&files);
+    }
+}
+
+//  Pokrece jedan korak sa n gostiju i upisuje red u CSV
+static int run_step(FILE* csv, const char* hypervisor, const char* image, const char* memory, int n, int processes) {
+    const char** args = malloc(sizeof(char*) * (n + 12));
+    char workers[16];
+    int argc = 0;
+
+    args[argc++] = hypervisor;
+    args[argc++] = "--memory";
+    args[argc++] = memory;
+    args[argc++] = "--page";
+    args[argc++] = "2";
+    args[argc++] = "--stats";
+    args[argc++] = STATS_FILE;
+    if (processes) {
+        snprintf(workers, sizeof(workers), "%d", n);
+        args[argc++] = "--workers";
+        args[argc++] = workers;
+    }
+    args[argc++] = "--guest";
+    for (int i = 0; i < n; i++) {
+        args[argc++] = image;
+    }
+    args[argc] = NULL;
+
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("GRESKA: fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        execv(hypervisor, (char* const*) args);
+        perror("GRESKA: execv");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "GRESKA: Hipervizor sa %d gostiju nije uspesno zavrsio\n", n);
+        free(args);
+        return -1;
+    }
+    double wall = (now_ns() - start) / 1e9;
+    free(args);
+
+    struct guest_result* results = calloc(n, sizeof(struct guest_result));
+    if (read_results(STATS_FILE, results, n) != n) {
+        fprintf(stderr, "GRESKA: Neispravan fajl statistike za %d gostiju\n", n);
+        free(results);
+        return -1;
+    }
+
+    uint64_t total_exits = 0, first_start = UINT64_MAX, last_end = 0;
+    double guest_rate_sum = 0, guest_rate_min = -1, first_run_sum = 0, first_run_max = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct guest_result* r = &results[i];
+        double rate = r->end_ns > r->first_run_ns ? r->exits * 1e9 / (r->end_ns - r->first_run_ns) : 0;
+
+        total_exits += r->exits;
+        guest_rate_sum += rate;
+        if (guest_rate_min < 0 || rate < guest_rate_min) guest_rate_min = rate;
+        first_run_sum += r->first_run_ns / 1e6;
+        if (r->first_run_ns / 1e6 > first_run_max) first_run_max = r->first_run_ns / 1e6;
+        if (r->first_run_ns < first_start) first_start = r->first_run_ns;
+        if (r->end_ns > last_end) last_end = r->end_ns;
+    }
+    free(results);
+
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    fprintf(csv, "%d,%.3f,%" PRIu64 ",%.0f,%.0f,%.0f,%.3f,%.3f,%ld,%.2f,%.1f\n", n, wall, total_exits,
+        total_exits * 1e9 / (last_end - first_start), guest_rate_sum / n, guest_rate_min,
+        first_run_sum / n, first_run_max, usage.ru_maxrss, cpu / wall, cpu / wall / cpus * 100);
+    fflush(csv);
+
+    remove_guest_files();
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int max_guests = 8;
+    const char* image = "guest7.img";
+    const char* memory = "4";
+    const char* hypervisor = "./mini_hypervisor";
+    FILE* csv = stdout;
+    int processes = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:m:o:x:p")) != -1) {
+        switch (opt) {
+            case 'n': max_guests = atoi(optarg); break;
+            case 'i': image = optarg; break;
+            case 'm': memory = optarg; break;
+            case 'x': hypervisor = optarg; break;
+            case 'p': processes = 1; break;
+            case 'o':
+                csv = fopen(optarg, "w");
+                if (csv == NULL) {
+                    perror("GRESKA: Nije moguce otvoriti CSV fajl");
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                fprintf(stderr, "Upotreba: %s [-n max_gostiju] [-i slika] [-m memorija_mb] [-o fajl.csv] [-x hipervizor] [-p]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    fprintf(csv, "guests,wall_s,total_exits,exits_per_s,guest_exits_per_s_mean,guest_exits_per_s_min,"
+        "first_run_ms_mean,first_run_ms_max,peak_rss_kb,cpu_cores,cpu_pct\n");
+
+    for (int n = 1; n <= max_guests; n = (n * 2 > max_guests && n < max_guests) ? max_guests : n * 2) {
+        if (run_step(csv, hypervisor, image, memory, n, processes) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    unlink(STATS_FILE);
+    if (csv != stdout) fclose(csv);
+    return 0;
+}
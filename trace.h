@@ -0,0 +1,78 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+//  Format binarnog traga izlazaka koji pise mini_hypervisor (--trace)
+//  i cita trace_decode.
+//
+//  Fajl pocinje zaglavljem iza kojeg je kruzni bafer od capacity
+//  zapisa. Zapis sa rednim brojem n je na poziciji n % capacity,
+//  a written je ukupan broj upisanih zapisa, tako da fajl uvek cuva
+//  poslednjih capacity izlazaka.
+
+#define TRACE_MAGIC 0x3145434152545648UL /* "HVTRACE1" */
+#define TRACE_VERSION 2
+
+//  Identifikatori stanja fajl protokola (State funkcije). Upisuju se
+//  u trag, pa novo stanje ili promena redosleda menja TRACE_VERSION,
+//  a ime stanja se dodaje u trace_decode.c
+enum trace_file_state {
+    TRACE_STATE_NONE,
+    TRACE_STATE_START,
+    TRACE_STATE_READING_NAME,
+    TRACE_STATE_WAIT_FLAG,
+    TRACE_STATE_WAIT_MODE,
+    TRACE_STATE_RETURN_FD,
+    TRACE_STATE_WAIT_FD,
+    TRACE_STATE_FIRST_ADDR,
+    TRACE_STATE_SECOND_ADDR,
+    TRACE_STATE_FIRST_SIZE,
+    TRACE_STATE_SECOND_SIZE,
+    TRACE_STATE_READ_STATUS,
+    TRACE_STATE_WRITE_STATUS,
+    TRACE_STATE_CLOSE_STATUS,
+    TRACE_STATE_WAIT_WHENCE,
+    TRACE_STATE_SEEK_STATUS,
+    TRACE_STATE_COPY_FD,
+    TRACE_STATE_COPY_STATUS,
+    TRACE_STATE_COPY_STATUS_HIGH,
+    TRACE_STATE_STREAM_STATUS,
+    TRACE_STATE_STREAM_STATUS_HIGH,
+    TRACE_STATE_COUNT
+};
+
+struct trace_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t written;
+    uint64_t dropped;
+};
+
+//  Jedan izlazak iz gosta
+//
+//  timestamp_ns - CLOCK_MONOTONIC trenutak izlaska
+//  guest - id gosta, vcpu - redni broj virtuelnog procesora
+//  reason - kvm_run->exit_reason
+//  direction, size, port, count - polja kvm_run->io za I/O izlaske;
+//  za MMIO direction je is_write, a count pomeraj u MMIO prozoru
+//  state_from, state_to - stanje fajl protokola pre i posle obrade
+//  data - prvih do 8 bajtova podataka (za IN posle obrade)
+struct trace_record {
+    uint64_t timestamp_ns;
+    uint16_t guest;
+    uint8_t vcpu;
+    uint8_t reason;
+    uint8_t direction;
+    uint8_t size;
+    uint8_t state_from;
+    uint8_t state_to;
+    uint16_t port;
+    uint16_t pad;
+    uint32_t count;
+    uint64_t data;
+};
+
+#endif
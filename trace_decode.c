@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/kvm.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+//  Cita fajl traga koji je napisao mini_hypervisor --trace i ispisuje
+//  jedan red po izlasku, od najstarijeg sacuvanog do najnovijeg
+//
+//  ./trace_decode trace.bin [id gosta]
+
+static const char* reason_name(int reason) {
+    switch (reason) {
+        case KVM_EXIT_IO: return "io";
+        case KVM_EXIT_HLT: return "hlt";
+        case KVM_EXIT_MMIO: return "mmio";
+        case KVM_EXIT_SHUTDOWN: return "shutdown";
+        case KVM_EXIT_FAIL_ENTRY: return "fail_entry";
+        case KVM_EXIT_INTR: return "intr";
+        case KVM_EXIT_INTERNAL_ERROR: return "internal_error";
+        default: return "other";
+    }
+}
+
+static const char* trace_state_names[TRACE_STATE_COUNT] = {
+    "-", "start", "reading_name", "wait_flag", "wait_mode", "return_fd",
+    "wait_fd", "first_addr", "second_addr", "first_size", "second_size",
+    "read_status", "write_status", "close_status", "wait_whence", "seek_status",
+    "copy_fd", "copy_status", "copy_status_high", "stream_status", "stream_status_high"
+};
+
+static const char* state_name(int state) {
+    return state < TRACE_STATE_COUNT ? trace_state_names[state] : "?";
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2) {
+        fprintf(stderr, "Upotreba: %s fajl_traga [id_gosta]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int guest = argc > 2 ? atoi(argv[2]) : -1;
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(struct trace_header)) {
+        perror("GRESKA: Nije moguce otvoriti fajl traga");
+        return EXIT_FAILURE;
+    }
+
+    struct trace_header* header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("GRESKA: Neuspesan mmap fajla traga");
+        return EXIT_FAILURE;
+    }
+
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION
+        || header->record_size != sizeof(struct trace_record)
+        || sizeof(struct trace_header) + header->capacity * sizeof(struct trace_record) > st.st_size) {
+        fprintf(stderr, "GRESKA: %s nije ispravan fajl traga (verzija %u, ocekivana %d)\n",
+            argv[1], header->version, TRACE_VERSION);
+        return EXIT_FAILURE;
+    }
+
+    struct trace_record* records = (struct trace_record*) (header + 1);
+    uint64_t written = header->written;
+    uint64_t first = written > header->capacity ? written - header->capacity : 0;
+    uint64_t start = 0, previous = 0;
+
+    for (uint64_t n = first; n < written; n++) {
+        struct trace_record* r = &records[n % header->capacity];
+        if (guest >= 0 && r->guest != guest) continue;
+
+        if (start == 0) start = previous = r->timestamp_ns;
+
+        printf("%12.3f us  +%9.3f  vm%d/%d  %-6s", (r->timestamp_ns - start) / 1000.0,
+            (r->timestamp_ns - previous) / 1000.0, r->guest, r->vcpu, reason_name(r->reason));
+        previous = r->timestamp_ns;
+
+        if (r->reason == KVM_EXIT_IO) {
+            printf("  %-3s port=0x%03x size=%d count=%u data=0x%0*" PRIx64,
+                r->direction == KVM_EXIT_IO_IN ? "in" : "out", r->port, r->size, r->count,
+                r->size * 2, r->size < 8 ? r->data & ((1UL << (r->size * 8)) - 1) : r->data);
+            if (r->state_from || r->state_to) {
+                printf("  %s -> %s", state_name(r->state_from), state_name(r->state_to));
+            }
+        } else if (r->reason == KVM_EXIT_MMIO) {
+            printf("  %-3s offset=0x%05x size=%d data=0x%0*" PRIx64,
+                r->direction ? "w" : "r", r->count, r->size,
+                r->size * 2, r->size < 8 ? r->data & ((1UL << (r->size * 8)) - 1) : r->data);
+        }
+        printf("\n");
+    }
+
+    fprintf(stderr, "%" PRIu64 " zapisa, %" PRIu64 " odbaceno, kapacitet %" PRIu64 "\n",
+        written - first, header->dropped, header->capacity);
+
+    return 0;
+}